@@ -0,0 +1,265 @@
+//
+// Created by Andy on 2020/7/14.
+//
+
+#include "XAudioEffect.h"
+#include "XMixKernels.h"
+
+#include <algorithm>
+#include <cmath>
+
+void XEffectChain::add(const std::shared_ptr<XAudioEffect> &effect) {
+    if (effect) {
+        mEffects.emplace_back(effect);
+    }
+}
+
+void XEffectChain::clear() {
+    mEffects.clear();
+}
+
+bool XEffectChain::empty() const {
+    return mEffects.empty();
+}
+
+void XEffectChain::process(float *samples, int nbSamples) {
+    for (auto &effect : mEffects) {
+        effect->process(samples, nbSamples);
+    }
+}
+
+void XEffectChain::reset() {
+    for (auto &effect : mEffects) {
+        effect->reset();
+    }
+}
+
+XBiquadEffect::XBiquadEffect(int sampleRate, int channels, Type type, double frequency, double q, double gainDb)
+        : mChannels(channels), mState(static_cast<size_t>(channels) * 2, 0.0f) {
+    double A = std::pow(10.0, gainDb / 40);
+    double w0 = 2 * M_PI * frequency / sampleRate;
+    double cosw = std::cos(w0);
+    double alpha = std::sin(w0) / (2 * q);
+    double sqrtA2alpha = 2 * std::sqrt(A) * alpha;
+
+    double b0, b1, b2, a0, a1, a2;
+    switch (type) {
+        case LOW_PASS:
+            b0 = (1 - cosw) / 2;
+            b1 = 1 - cosw;
+            b2 = (1 - cosw) / 2;
+            a0 = 1 + alpha;
+            a1 = -2 * cosw;
+            a2 = 1 - alpha;
+            break;
+        case HIGH_PASS:
+            b0 = (1 + cosw) / 2;
+            b1 = -(1 + cosw);
+            b2 = (1 + cosw) / 2;
+            a0 = 1 + alpha;
+            a1 = -2 * cosw;
+            a2 = 1 - alpha;
+            break;
+        case PEAK:
+            b0 = 1 + alpha * A;
+            b1 = -2 * cosw;
+            b2 = 1 - alpha * A;
+            a0 = 1 + alpha / A;
+            a1 = -2 * cosw;
+            a2 = 1 - alpha / A;
+            break;
+        case LOW_SHELF:
+            b0 = A * ((A + 1) - (A - 1) * cosw + sqrtA2alpha);
+            b1 = 2 * A * ((A - 1) - (A + 1) * cosw);
+            b2 = A * ((A + 1) - (A - 1) * cosw - sqrtA2alpha);
+            a0 = (A + 1) + (A - 1) * cosw + sqrtA2alpha;
+            a1 = -2 * ((A - 1) + (A + 1) * cosw);
+            a2 = (A + 1) + (A - 1) * cosw - sqrtA2alpha;
+            break;
+        case HIGH_SHELF:
+        default:
+            b0 = A * ((A + 1) + (A - 1) * cosw + sqrtA2alpha);
+            b1 = -2 * A * ((A - 1) + (A + 1) * cosw);
+            b2 = A * ((A + 1) + (A - 1) * cosw - sqrtA2alpha);
+            a0 = (A + 1) - (A - 1) * cosw + sqrtA2alpha;
+            a1 = 2 * ((A - 1) - (A + 1) * cosw);
+            a2 = (A + 1) - (A - 1) * cosw - sqrtA2alpha;
+            break;
+    }
+
+    mB0 = static_cast<float>(b0 / a0);
+    mB1 = static_cast<float>(b1 / a0);
+    mB2 = static_cast<float>(b2 / a0);
+    mA1 = static_cast<float>(a1 / a0);
+    mA2 = static_cast<float>(a2 / a0);
+}
+
+template<int C>
+void XBiquadEffect::processChannels(float *samples, int nbSamples) {
+    // 递归滤波无法沿时间向量化, 这里把声道作为向量的通道, 声道数为编译期常量
+    float s0[C], s1[C];
+    for (int c = 0; c < C; ++c) {
+        s0[c] = mState[c * 2];
+        s1[c] = mState[c * 2 + 1];
+    }
+
+    for (int i = 0; i < nbSamples; ++i) {
+        float *frame = samples + i * C;
+        for (int c = 0; c < C; ++c) {
+            float x = frame[c];
+            float y = mB0 * x + s0[c];
+            s0[c] = mB1 * x - mA1 * y + s1[c];
+            s1[c] = mB2 * x - mA2 * y;
+            frame[c] = y;
+        }
+    }
+
+    for (int c = 0; c < C; ++c) {
+        mState[c * 2] = s0[c];
+        mState[c * 2 + 1] = s1[c];
+    }
+}
+
+void XBiquadEffect::processGeneric(float *samples, int nbSamples) {
+    for (int c = 0; c < mChannels; ++c) {
+        float s0 = mState[c * 2];
+        float s1 = mState[c * 2 + 1];
+        for (int i = 0; i < nbSamples; ++i) {
+            float x = samples[i * mChannels + c];
+            float y = mB0 * x + s0;
+            s0 = mB1 * x - mA1 * y + s1;
+            s1 = mB2 * x - mA2 * y;
+            samples[i * mChannels + c] = y;
+        }
+        mState[c * 2] = s0;
+        mState[c * 2 + 1] = s1;
+    }
+}
+
+void XBiquadEffect::process(float *samples, int nbSamples) {
+    switch (mChannels) {
+        case 1:
+            processChannels<1>(samples, nbSamples);
+            break;
+        case 2:
+            processChannels<2>(samples, nbSamples);
+            break;
+        default:
+            processGeneric(samples, nbSamples);
+            break;
+    }
+}
+
+void XBiquadEffect::reset() {
+    std::fill(mState.begin(), mState.end(), 0.0f);
+}
+
+XGainEffect::XGainEffect(int channels, double gainDb)
+        : mChannels(channels) {
+    setGain(gainDb);
+}
+
+void XGainEffect::process(float *samples, int nbSamples) {
+    XMixKernels::applyGain(samples, mGain, nbSamples * mChannels);
+}
+
+void XGainEffect::setGain(double gainDb) {
+    mGain = static_cast<float>(std::pow(10.0, gainDb / 20));
+}
+
+XPanEffect::XPanEffect(int channels, double pan)
+        : mChannels(channels) {
+    double angle = (std::max(-1.0, std::min(1.0, pan)) + 1) * M_PI / 4;
+    // 居中时两个声道都是 -3dB, 这里补偿回 0dB, 让 pan = 0 时不改变电平
+    mLeft = static_cast<float>(std::cos(angle) * M_SQRT2);
+    mRight = static_cast<float>(std::sin(angle) * M_SQRT2);
+}
+
+void XPanEffect::process(float *samples, int nbSamples) {
+    if (mChannels != 2) {
+        return;
+    }
+
+    for (int i = 0; i < nbSamples; ++i) {
+        samples[i * 2] *= mLeft;
+        samples[i * 2 + 1] *= mRight;
+    }
+}
+
+XDelayEffect::XDelayEffect(int sampleRate, int channels, double delayMs, double feedback, double mix)
+        : mChannels(channels), mFeedback(static_cast<float>(feedback)), mMix(static_cast<float>(mix)), mPos(0) {
+    mDelay = std::max(1, static_cast<int>(sampleRate * delayMs / 1000));
+    mBuffer.assign(static_cast<size_t>(mDelay) * channels, 0.0f);
+}
+
+void XDelayEffect::process(float *samples, int nbSamples) {
+    for (int i = 0; i < nbSamples; ++i) {
+        float *delayed = &mBuffer[static_cast<size_t>(mPos) * mChannels];
+        float *frame = samples + i * mChannels;
+        for (int c = 0; c < mChannels; ++c) {
+            float dry = frame[c];
+            float wet = delayed[c];
+            delayed[c] = dry + wet * mFeedback;
+            frame[c] = dry + wet * mMix;
+        }
+        mPos = mPos + 1 == mDelay ? 0 : mPos + 1;
+    }
+}
+
+void XDelayEffect::reset() {
+    std::fill(mBuffer.begin(), mBuffer.end(), 0.0f);
+    mPos = 0;
+}
+
+XCompressorEffect::XCompressorEffect(int sampleRate, int channels, double thresholdDb, double ratio, double attackMs,
+                                     double releaseMs, double makeupDb)
+        : mChannels(channels), mThresholdDb(thresholdDb), mRatio(std::max(1.0, ratio)) {
+    double blockRate = static_cast<double>(sampleRate) / CONTROL_BLOCK;
+    mAttackCoeff = static_cast<float>(1.0 - std::exp(-1.0 / (blockRate * attackMs / 1000)));
+    mReleaseCoeff = static_cast<float>(1.0 - std::exp(-1.0 / (blockRate * releaseMs / 1000)));
+    mMakeup = static_cast<float>(std::pow(10.0, makeupDb / 20));
+    reset();
+}
+
+void XCompressorEffect::process(float *samples, int nbSamples) {
+    int i = 0;
+    while (i < nbSamples) {
+        int count = std::min(nbSamples - i, CONTROL_BLOCK - mBlockFill);
+        float *block = samples + i * mChannels;
+        mBlockPeak = std::max(mBlockPeak, XMixKernels::peak(block, count * mChannels));
+
+        for (int n = 0; n < count; ++n) {
+            float gain = mGain * mMakeup;
+            for (int c = 0; c < mChannels; ++c) {
+                block[n * mChannels + c] *= gain;
+            }
+            mGain += mGainStep;
+        }
+
+        mBlockFill += count;
+        i += count;
+        if (mBlockFill < CONTROL_BLOCK) {
+            continue;
+        }
+
+        double target = 0;
+        if (mBlockPeak > 0) {
+            double over = 20 * std::log10(mBlockPeak) - mThresholdDb;
+            target = over > 0 ? over * (1 - 1 / mRatio) : 0;
+        }
+        mBlockPeak = 0;
+        mBlockFill = 0;
+
+        float coeff = target > mReduction ? mAttackCoeff : mReleaseCoeff;
+        mReduction += static_cast<float>(target - mReduction) * coeff;
+        mGainStep = (static_cast<float>(std::pow(10.0, -mReduction / 20)) - mGain) / CONTROL_BLOCK;
+    }
+}
+
+void XCompressorEffect::reset() {
+    mBlockPeak = 0;
+    mBlockFill = 0;
+    mReduction = 0;
+    mGain = 1.0f;
+    mGainStep = 0;
+}
@@ -0,0 +1,141 @@
+//
+// Created by Andy on 2020/7/14.
+//
+
+#ifndef MIXER_XAUDIOEFFECT_H
+#define MIXER_XAUDIOEFFECT_H
+
+#include <memory>
+#include <vector>
+
+/**
+ * 块处理的音效接口, 原地处理交错排列的 float 样本.
+ * 所有状态在构造时分配好, process 里不分配内存.
+ */
+class XAudioEffect {
+public:
+    virtual ~XAudioEffect() = default;
+
+    virtual void process(float* samples, int nbSamples) = 0;
+
+    virtual void reset() {}
+};
+
+/* 按顺序串联的音效链, 挂在每路输入和主总线上 */
+class XEffectChain {
+public:
+    void add(const std::shared_ptr<XAudioEffect>& effect);
+
+    void clear();
+
+    bool empty() const;
+
+    void process(float* samples, int nbSamples);
+
+    void reset();
+
+private:
+    std::vector<std::shared_ptr<XAudioEffect>> mEffects;
+};
+
+/* RBJ cookbook 二阶滤波器, 用于均衡和高通/低通 */
+class XBiquadEffect : public XAudioEffect {
+public:
+    enum Type {
+        LOW_PASS,
+        HIGH_PASS,
+        PEAK,
+        LOW_SHELF,
+        HIGH_SHELF
+    };
+
+    XBiquadEffect(int sampleRate, int channels, Type type, double frequency, double q = 0.7071, double gainDb = 0);
+
+    void process(float* samples, int nbSamples) override;
+
+    void reset() override;
+
+private:
+    template<int C>
+    void processChannels(float* samples, int nbSamples);
+
+    void processGeneric(float* samples, int nbSamples);
+
+private:
+    int mChannels;
+    float mB0, mB1, mB2, mA1, mA2;
+    std::vector<float> mState;            // 每个声道 2 个状态量(DF2T)
+};
+
+class XGainEffect : public XAudioEffect {
+public:
+    XGainEffect(int channels, double gainDb);
+
+    void process(float* samples, int nbSamples) override;
+
+    void setGain(double gainDb);
+
+private:
+    int mChannels;
+    float mGain;
+};
+
+/* 等功率声像, 只对立体声生效, pan 取值 [-1, 1] */
+class XPanEffect : public XAudioEffect {
+public:
+    XPanEffect(int channels, double pan);
+
+    void process(float* samples, int nbSamples) override;
+
+private:
+    int mChannels;
+    float mLeft;
+    float mRight;
+};
+
+/* 带反馈的延迟, mix 为湿声比例 */
+class XDelayEffect : public XAudioEffect {
+public:
+    XDelayEffect(int sampleRate, int channels, double delayMs, double feedback = 0.3, double mix = 0.3);
+
+    void process(float* samples, int nbSamples) override;
+
+    void reset() override;
+
+private:
+    int mChannels;
+    int mDelay;
+    float mFeedback;
+    float mMix;
+    std::vector<float> mBuffer;
+    int mPos;
+};
+
+/* 峰值压缩器, 检测和增益插值方式与 XDucker 相同, 按控制块计算 */
+class XCompressorEffect : public XAudioEffect {
+public:
+    XCompressorEffect(int sampleRate, int channels, double thresholdDb, double ratio, double attackMs = 10,
+                      double releaseMs = 150, double makeupDb = 0);
+
+    void process(float* samples, int nbSamples) override;
+
+    void reset() override;
+
+private:
+    static const int CONTROL_BLOCK = 32;
+
+    int mChannels;
+    double mThresholdDb;
+    double mRatio;
+    float mMakeup;
+    float mAttackCoeff;
+    float mReleaseCoeff;
+
+    float mBlockPeak;
+    int mBlockFill;
+    float mReduction;
+    float mGain;
+    float mGainStep;
+};
+
+#endif //MIXER_XAUDIOEFFECT_H
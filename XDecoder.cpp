@@ -3,20 +3,97 @@
 //
 
 #include "XDecoder.h"
+#include "XDemuxer.h"
 #include "XException.h"
+#include "XLog.h"
+#include "XMemoryBudget.h"
+#include "XMixKernels.h"
 #include "XPacketQueue.h"
+#include "XParallelDecoder.h"
+#include "XPlaylist.h"
+#include "XProbeCache.h"
+#include "XSharedSource.h"
 #include "XThreadUtils.h"
+#include "XTrace.h"
 
-XDecoder::XDecoder(const std::string &filename)
-        : mFilename(filename), mAudioIndex(-1), mEncodedSampleCount(0), mSampleBuffer(nullptr), mSeekToStartTime(false),
-          mAborted(false), mSampleQueue(nullptr) {
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+XDecoder::XDecoder(const std::string &filename, const XDecoderOptions &options)
+        : XDecoder(filename, options, nullptr, -1) {
+}
+
+XDecoder::XDecoder(const std::shared_ptr<XDemuxer> &demuxer, int streamIndex, const XDecoderOptions &options)
+        : XDecoder(demuxer->filename() + "#" + std::to_string(streamIndex), options, demuxer, streamIndex) {
+}
+
+XDecoder::XDecoder(const std::shared_ptr<XSharedSource> &source, const XDecoderOptions &options)
+        : XDecoder(source->filename(), options, nullptr, -1, source) {
+}
+
+XDecoder::XDecoder(const std::shared_ptr<XPlaylist> &playlist, const XDecoderOptions &options)
+        : XDecoder(playlist->name(), options, nullptr, -1, nullptr, playlist) {
+}
+
+XDecoder::XDecoder(const std::string &filename, const XDecoderOptions &options, std::shared_ptr<XDemuxer> demuxer,
+                   int streamIndex, std::shared_ptr<XSharedSource> source, std::shared_ptr<XPlaylist> playlist)
+        : mFilename(filename), mOptions(options), mDemuxer(std::move(demuxer)), mSource(std::move(source)),
+          mSourceReader(-1), mPlaylist(std::move(playlist)), mAudioIndex(-1), mEncodedSampleCount(0), mSampleBuffer(nullptr),
+          mSampleBufferSize(0), mSeekToStartTime(false), mAborted(false), mSampleQueue(nullptr), mBudgetId(-1), mBudgetFrames(0), mPeekedBytes(0), mRingLimit(0), mWritePos(0),
+          mReadPos(0), mAudibleEnd(0), mLastReadPos(0), mLastReadSize(0), mPassthroughCapable(false), mIoDeadline(0), mPipeFd(-1),
+          mNextPts(AV_NOPTS_VALUE), mSwrInSampleRate(0), mSwrInFormat(AV_SAMPLE_FMT_NONE), mSwrInChannelLayout(0), mConvert(nullptr),
+          mReconnectCount(0), mUnderrunCount(0), mInUnderrun(false), mFillAverage(-1), mDriftIntegral(0),
+          mDriftPpm(0), mDriftLogTime(0), mOpenUs(0), mProbe("full"), mDuration(AV_NOPTS_VALUE) {
 
     av_log_set_flags(AV_LOG_SKIP_REPEATED);
 
+    if (mSource) {
+        mOptions.live = false;
+        mSourceReader = mSource->open();
+        mDuration = mSource->duration();
+        mProbe = "shared";
+        return;
+    }
+
+    // 各首的时长只有打开之后才知道, 整个列表按未知处理
+    if (mPlaylist) {
+        mOptions.live = false;
+        mProbe = "playlist";
+        return;
+    }
+
+    // 共享解封装的分轨只来自本地文件
+    if (mDemuxer) {
+        mOptions.live = false;
+        int ret = openSharedStream(streamIndex);
+        if (ret < 0) {
+            throw XException(av_err2str(ret));
+        }
+        return;
+    }
+
+    if (!mOptions.live) {
+        mOptions.live = isLiveSource(mFilename);
+    }
+
+    if (mOptions.live) {
+        static std::once_flag networkInitFlag;
+        std::call_once(networkInitFlag, [] { avformat_network_init(); });
+    }
+
+    int64_t openTime = av_gettime_relative();
     int ret = openInFile();
     if (ret < 0) {
         throw XException(av_err2str(ret));
     }
+    mOpenUs = av_gettime_relative() - openTime;
+    XLOG(AV_LOG_VERBOSE, "XDecoder", "opened in %lld us, probe: %s: %s", static_cast<long long>(mOpenUs), mProbe,
+         mFilename.data());
 }
 
 XDecoder::~XDecoder() {
@@ -26,90 +103,420 @@ XDecoder::~XDecoder() {
 }
 
 void XDecoder::start() {
+    if (mSource || mPlaylist) {
+        return;
+    }
+
+    // 样本缓冲和包队列的大小由内存预算按输入路数和码率分配, 解码过程中再按等待情况调整;
+    // 直播输入需要足够的缓冲来吸收网络抖动和时钟漂移, 样本缓冲固定为目标延迟的两倍
+    if (mBudgetId < 0) {
+        int64_t bitRate = 0;
+        double packetRate = 0;
+        if (mFormatCtx && mAudioIndex >= 0) {
+            const AVCodecParameters *par = mFormatCtx->streams[mAudioIndex]->codecpar;
+            bitRate = par->bit_rate > 0 ? par->bit_rate : mFormatCtx->bit_rate;
+            if (par->frame_size > 0 && par->sample_rate > 0) {
+                packetRate = static_cast<double>(par->sample_rate) / par->frame_size;
+            }
+        }
+        int pcmBytesPerSecond = OUT_SAMPLE_RATE * OUT_BYTES_PER_SAMPLE;
+        int minSize = 16 * 1024;
+        if (mOptions.live) {
+            minSize = std::max(64 * 1024, static_cast<int>(static_cast<int64_t>(pcmBytesPerSecond) * mOptions.targetLatencyMs * 2 / 1000));
+        }
+        mBudgetId = XMemoryBudget::instance().addInput(pcmBytesPerSecond, bitRate / 8, packetRate, minSize,
+                                                       !mOptions.live);
+    }
+    XMemoryBudget::XPlan plan = XMemoryBudget::instance().plan(mBudgetId);
+
+    if (mAudioIndex >= 0 && !mAudioPacketQueue) {
+        mAudioPacketQueue = mDemuxer ? std::make_shared<XPacketQueue>(XDemuxer::STREAM_QUEUE_CAPACITY)
+                                     : std::make_shared<XPacketQueue>(plan.packetCapacity);
+    }
+
+    // 样本缓冲在启动时就建好, 混音线程取样本时要么等到样本, 要么看到结束状态
+    {
+        std::lock_guard<std::mutex> lock(mSampleMutex);
+        if (!mSampleQueue) {
+            // 镜像映射的缓冲区读写都不用拆成两段, 容量只影响内存占用, 不增加拷贝
+            int size = plan.ringBytes;
+            mSampleQueue = rbuf_create(size);
+            mRingCapacity = rbuf_size(mSampleQueue);
+            mRingLimit = mRingCapacity;
+            rbuf_set_mode(mSampleQueue, RBUF_MODE_BLOCKING);
+        }
+    }
+
+    // 长文件切段并行解码; 直通需要包和样本一一对应, 不能和并行解码同时使用. 启动失败时照常串行解码
+    if (mOptions.decodeThreads > 1 && !mOptions.live && !mOptions.keepPackets && !mParallel && !mDemuxer &&
+        XParallelDecoder::isSupported(mFormatCtx.get(), mAudioIndex, mOptions.segmentSeconds)) {
+        AVStream *stream = mFormatCtx->streams[mAudioIndex];
+        auto parallel = std::make_unique<XParallelDecoder>(mFilename, mAudioIndex, mOptions.decodeThreads,
+                                                           mOptions.segmentSeconds);
+        int ret = parallel->start(stream->codecpar, stream->time_base, mFormatCtx->duration);
+        if (ret >= 0) {
+            mParallel = std::move(parallel);
+        } else {
+            XLOG(AV_LOG_WARNING, "XDecoder", "parallel decode unavailable: %s, decode serially: %s",
+                 av_err2str(ret), mFilename.data());
+        }
+    }
+    // 分轨的包由共享的解封装线程送进来, 所有分轨都挂上队列之后它才开始读
+    if (mDemuxer && mAudioPacketQueue) {
+        mDemuxer->attach(mAudioIndex, mAudioPacketQueue);
+    }
     mReadTid = std::make_unique<std::thread>([this] { readWorkThread(this); });
 }
 
+bool XDecoder::isLive() const {
+    return mOptions.live;
+}
+
+const XDecoderOptions &XDecoder::options() const {
+    return mOptions;
+}
+
+bool XDecoder::isShared() const {
+    return mSource != nullptr;
+}
+
+int64_t XDecoder::duration() const {
+    return mDuration;
+}
+
+std::shared_ptr<Packet> XDecoder::passthroughPacket() {
+    std::lock_guard<std::mutex> lock(mSampleMutex);
+    if (mPacketSpans.empty() || mLastReadSize <= 0) {
+        return nullptr;
+    }
+
+    const XPacketSpan& span = mPacketSpans.front();
+    return span.pos == mLastReadPos && span.size == mLastReadSize ? span.packet : nullptr;
+}
+
+XDecoderStats XDecoder::stats() const {
+    // 共享素材的读取器报告背后那一路解码器的统计, 播放列表报告当前一首的统计, 读取次数是自己的
+    if (mSource || mPlaylist) {
+        XDecoderStats stats = mSource ? mSource->stats() : mPlaylist->stats();
+        stats.filename = mFilename;
+        stats.reads = mReads.value();
+        stats.silentReads = mSilentReads.value();
+        stats.probe = mProbe;
+        return stats;
+    }
+
+    XDecoderStats stats;
+    stats.filename = mFilename;
+    stats.demux = mDemuxHistogram.snapshot();
+    stats.decode = mDecodeHistogram.snapshot();
+    stats.resample = mResampleHistogram.snapshot();
+    if (mAudioPacketQueue) {
+        stats.packetQueue = mAudioPacketQueue->stats();
+    }
+    stats.sampleRing.depth = mRingDepth.snapshot();
+    stats.sampleRing.capacity = mRingCapacity;
+    stats.sampleRing.fullWaits.count = mRingFullWaits.value();
+    stats.sampleRing.fullWaits.waitNs = mRingFullWaitNs.value();
+    stats.sampleRing.emptyWaits.count = mRingEmptyWaits.value();
+    stats.sampleRing.emptyWaits.waitNs = mRingEmptyWaitNs.value();
+    stats.reads = mReads.value();
+    stats.silentReads = mSilentReads.value();
+    stats.openUs = mOpenUs;
+    stats.probe = mProbe;
+    return stats;
+}
+
+bool XDecoder::isLiveSource(const std::string &url) {
+    // http 也可能是普通的点播文件, 需要调用方显式指定 live
+    static const char *LIVE_PROTOCOLS[] = {"rtp:", "udp:", "tcp:", "rtmp:", "rtsp:", "srt:", "pipe:"};
+    for (auto protocol : LIVE_PROTOCOLS) {
+        if (url.compare(0, strlen(protocol), protocol) == 0) {
+            return true;
+        }
+    }
+
+    struct stat st;
+    return stat(url.data(), &st) == 0 && S_ISFIFO(st.st_mode);
+}
+
+/*
+ * 检查 AAC 包能否直接封装到输出: 没有 ADTS 头的原始包返回 0; ADTS 包要求是单个原始数据块的
+ * AAC-LC 44.1kHz 双声道, 返回头的长度, 其它情况返回负数
+ */
+static int adtsHeaderSize(const AVPacket *pkt) {
+    const uint8_t *p = pkt->data;
+    if (!p || pkt->size < 7 || p[0] != 0xff || (p[1] & 0xf6) != 0xf0) {
+        return 0;
+    }
+
+    int profile = p[2] >> 6;
+    int sampleRateIndex = (p[2] >> 2) & 0x0f;
+    int channels = ((p[2] & 0x01) << 2) | (p[3] >> 6);
+    int rawBlocks = p[6] & 0x03;
+    if (profile != 1 || sampleRateIndex != 4 || channels != 2 || rawBlocks != 0) {
+        return -1;
+    }
+
+    int size = (p[1] & 0x01) ? 7 : 9;
+    return pkt->size > size ? size : -1;
+}
+
+int XDecoder::interruptCallback(void *opaque) {
+    auto decoder = reinterpret_cast<XDecoder *>(opaque);
+    if (decoder->mAborted) {
+        return 1;
+    }
+
+    int64_t deadline = decoder->mIoDeadline;
+    return (deadline > 0 && av_gettime_relative() > deadline) ? 1 : 0;
+}
+
+int XDecoder::openSharedStream(int streamIndex) {
+    const AVStream *stream = mDemuxer->stream(streamIndex);
+    if (!stream || stream->codecpar->codec_type != AVMEDIA_TYPE_AUDIO) {
+        XLOG(AV_LOG_FATAL, "XDecoder", "stream %d is not an audio stream: %s", streamIndex, mFilename.data());
+        return AVERROR_STREAM_NOT_FOUND;
+    }
+
+    mAudioIndex = streamIndex;
+    mDuration = mDemuxer->duration();
+    mDemuxer->expect(streamIndex);
+    return openCodecContext(stream->codecpar, stream->time_base);
+}
+
 int XDecoder::openInFile() {
-    AVFormatContext *ic = nullptr;
-    int ret = avformat_open_input(&ic, mFilename.data(), nullptr, nullptr);
+    int ret = openInput();
     if (ret < 0) {
-        av_log(nullptr, AV_LOG_FATAL, "[XDecoder] avformat_open_input failed: %s\n", av_err2str(ret));
         return ret;
     }
-    mFormatCtx = std::unique_ptr<AVFormatContext, InputFormatDeleter>(ic);
+    mDuration = mOptions.live ? AV_NOPTS_VALUE : mFormatCtx->duration;
 
-    ret = avformat_find_stream_info(ic, nullptr);
+    return openCodecContext(mAudioIndex);
+}
+
+int XDecoder::openInput() {
+    AVFormatContext *ic = avformat_alloc_context();
+    if (!ic) {
+        return AVERROR(ENOMEM);
+    }
+    ic->interrupt_callback.callback = interruptCallback;
+    ic->interrupt_callback.opaque = this;
+
+    std::string url = mFilename;
+    AVDictionary *opts = nullptr;
+    if (mOptions.live) {
+        av_dict_set_int(&opts, "rw_timeout", static_cast<int64_t>(mOptions.ioTimeoutMs) * 1000, 0);
+        av_dict_set(&opts, "reconnect", "1", 0);
+        av_dict_set(&opts, "reconnect_streamed", "1", 0);
+        av_dict_set(&opts, "overrun_nonfatal", "1", 0);
+
+        struct stat st;
+        if (stat(mFilename.data(), &st) == 0 && S_ISFIFO(st.st_mode)) {
+            // 命名管道没有写端时 open 会一直阻塞且无法被中断, 这里用非阻塞方式打开后交给 pipe 协议读取
+            mPipeFd = open(mFilename.data(), O_RDONLY | O_NONBLOCK);
+            if (mPipeFd < 0) {
+                int ret = AVERROR(errno);
+                XLOG(AV_LOG_FATAL, "XDecoder", "open fifo failed: %s", av_err2str(ret));
+                av_dict_free(&opts);
+                avformat_free_context(ic);
+                return ret;
+            }
+            url = "pipe:" + std::to_string(mPipeFd);
+        }
+
+        mIoDeadline = av_gettime_relative() + static_cast<int64_t>(mOptions.ioTimeoutMs) * 1000;
+    }
+
+    // 缓存命中时按缓存的格式打开, 否则用调用方的提示; 直播输入的参数可能变化, 不使用缓存
+    XProbeInfo probe;
+    bool cached = !mOptions.live && mOptions.probeCache && mOptions.probeCache->lookup(mFilename, &probe);
+    const std::string &formatName = cached ? probe.formatName : mOptions.formatHint;
+    AVInputFormat *iformat = nullptr;
+    if (!formatName.empty()) {
+        iformat = av_find_input_format(formatName.data());
+        if (!iformat) {
+            XLOG(AV_LOG_WARNING, "XDecoder", "unknown format %s, probe instead: %s", formatName.data(),
+                 mFilename.data());
+        }
+    }
+
+    int ret = avformat_open_input(&ic, url.data(), iformat, &opts);
+    av_dict_free(&opts);
     if (ret < 0) {
-        av_log(nullptr, AV_LOG_FATAL, "[XDecoder] avformat_find_stream_info failed: %s\n", av_err2str(ret));
+        XLOG(AV_LOG_FATAL, "XDecoder", "avformat_open_input failed: %s", av_err2str(ret));
+        closeInput();
         return ret;
     }
+    mFormatCtx = std::unique_ptr<AVFormatContext, InputFormatDeleter>(ic);
 
-    mAudioIndex = av_find_best_stream(ic, AVMEDIA_TYPE_AUDIO, -1, -1, nullptr, 0);
-    if (mAudioIndex >= 0) {
-        ret = openCodecContext(mAudioIndex);
+    if (cached && applyProbeInfo(probe) >= 0) {
+        mProbe = "cache";
+    } else if (!cached && !mOptions.live && !mOptions.formatHint.empty() && findHeaderStream() >= 0) {
+        mProbe = "header";
+    } else {
+        if (cached) {
+            XLOG(AV_LOG_WARNING, "XDecoder", "stale probe cache entry, probe again: %s", mFilename.data());
+        }
+        mProbe = "full";
+        ret = avformat_find_stream_info(ic, nullptr);
         if (ret < 0) {
+            XLOG(AV_LOG_FATAL, "XDecoder", "avformat_find_stream_info failed: %s", av_err2str(ret));
             return ret;
         }
+
+        mAudioIndex = av_find_best_stream(ic, AVMEDIA_TYPE_AUDIO, -1, -1, nullptr, 0);
+        if (mAudioIndex < 0) {
+            XLOG(AV_LOG_FATAL, "XDecoder", "av_find_best_stream failed: audio stream not found");
+            return AVERROR_STREAM_NOT_FOUND;
+        }
+        if (!mOptions.live && mOptions.probeCache) {
+            mOptions.probeCache->store(mFilename, ic, mAudioIndex);
+        }
     }
+    mIoDeadline = 0;
 
-    if (mAudioIndex < 0) {
-        av_log(nullptr, AV_LOG_FATAL, "[XDecoder] av_find_best_stream failed: audio stream not found\n");
-        return AVERROR_STREAM_NOT_FOUND;
+    return 0;
+}
+
+int XDecoder::applyProbeInfo(const XProbeInfo &info) {
+    AVFormatContext *ic = mFormatCtx.get();
+    if (info.streamIndex < 0 || info.streamIndex >= static_cast<int>(ic->nb_streams) || !info.codecpar) {
+        return AVERROR_INVALIDDATA;
+    }
+
+    // 头部给出的编码和时间基和缓存不一致, 说明文件内容和缓存不是同一份
+    AVStream *stream = ic->streams[info.streamIndex];
+    if (stream->codecpar->codec_type != AVMEDIA_TYPE_AUDIO || stream->codecpar->codec_id != info.codecpar->codec_id ||
+        av_cmp_q(stream->time_base, info.timeBase) != 0) {
+        return AVERROR_INVALIDDATA;
+    }
+
+    int ret = avcodec_parameters_copy(stream->codecpar, info.codecpar.get());
+    if (ret < 0) {
+        return ret;
+    }
+    if (info.startTime != AV_NOPTS_VALUE) {
+        ic->start_time = info.startTime;
+    }
+    if (info.duration != AV_NOPTS_VALUE) {
+        ic->duration = info.duration;
+    }
+    if (ic->bit_rate <= 0) {
+        ic->bit_rate = info.bitRate;
+    }
+
+    mAudioIndex = info.streamIndex;
+    return 0;
+}
+
+int XDecoder::findHeaderStream() {
+    AVFormatContext *ic = mFormatCtx.get();
+    int index = av_find_best_stream(ic, AVMEDIA_TYPE_AUDIO, -1, -1, nullptr, 0);
+    if (index < 0) {
+        return index;
     }
 
+    // 只有头部就给出了采样率和声道数的格式(WAV, FLAC, MP4 等)才能跳过探测, ADTS 之类要解析数据才知道
+    AVStream *stream = ic->streams[index];
+    const AVCodecParameters *par = stream->codecpar;
+    if (par->codec_id == AV_CODEC_ID_NONE || par->sample_rate <= 0 || par->channels <= 0) {
+        return AVERROR(EAGAIN);
+    }
+
+    // 总时长本来由 avformat_find_stream_info 汇总, 这里用流自己的时长
+    if (ic->duration == AV_NOPTS_VALUE && stream->duration != AV_NOPTS_VALUE) {
+        ic->duration = av_rescale_q(stream->duration, stream->time_base, AV_TIME_BASE_Q);
+    }
+
+    mAudioIndex = index;
     return 0;
 }
 
+int XDecoder::reopenInFile() {
+    int delay = mOptions.reconnectDelayMs;
+    for (;;) {
+        closeInput();
+
+        // 退避等待, stop 时立即返回
+        {
+            std::unique_lock<std::mutex> lock(mMutex);
+            mAbortCond.wait_for(lock, std::chrono::milliseconds(delay), [this] { return mAborted.load(); });
+        }
+        if (mAborted) {
+            return AVERROR_EXIT;
+        }
+
+        int ret = openInput();
+        if (ret >= 0) {
+            ++mReconnectCount;
+            XLOG(AV_LOG_INFO, "XDecoder", "reconnected(%d): %s", mReconnectCount, mFilename.data());
+            return 0;
+        }
+
+        XLOG(AV_LOG_WARNING, "XDecoder", "reconnect failed: %s, retry in %d ms", av_err2str(ret), delay);
+        delay = std::min(delay * 2, mOptions.maxReconnectDelayMs);
+    }
+}
+
 int XDecoder::openCodecContext(int streamIndex) {
     if (streamIndex < 0) {
         return AVERROR(EINVAL);
     }
 
+    AVStream *stream = mFormatCtx->streams[streamIndex];
+    stream->discard = AVDISCARD_DEFAULT;
+    return openCodecContext(stream->codecpar, stream->time_base);
+}
+
+int XDecoder::openCodecContext(const AVCodecParameters *codecpar, AVRational timeBase) {
     AVCodecContext *avctx = avcodec_alloc_context3(nullptr);
     if (!avctx) {
         return AVERROR(ENOMEM);
     }
+    mAudioCodecCtx = std::unique_ptr<AVCodecContext, CodecDeleter>(avctx);
 
-    if (streamIndex == mAudioIndex) {
-        mAudioCodecCtx = std::unique_ptr<AVCodecContext, CodecDeleter>(avctx);
-    }
-
-    AVStream *stream = mFormatCtx->streams[streamIndex];
-    stream->discard = AVDISCARD_DEFAULT;
-    int ret = avcodec_parameters_to_context(avctx, stream->codecpar);
+    int ret = avcodec_parameters_to_context(avctx, codecpar);
     if (ret < 0) {
-        av_log(nullptr, AV_LOG_FATAL, "[XDecoder] avcodec_parameters_to_context failed: %s\n", av_err2str(ret));
+        XLOG(AV_LOG_FATAL, "XDecoder", "avcodec_parameters_to_context failed: %s", av_err2str(ret));
         return ret;
     }
+    avctx->pkt_timebase = timeBase;
+
     AVCodec *codec = avcodec_find_decoder(avctx->codec_id);
     if (!codec) {
-        av_log(nullptr, AV_LOG_FATAL, "[XDecoder] avcodec_find_decoder failed: decoder (%s) not found\n",
-               avcodec_get_name(avctx->codec_id));
+        XLOG(AV_LOG_FATAL, "XDecoder", "avcodec_find_decoder failed: decoder (%s) not found",
+             avcodec_get_name(avctx->codec_id));
         return AVERROR_DECODER_NOT_FOUND;
     }
 
     ret = avcodec_open2(avctx, codec, nullptr);
     if (ret < 0) {
-        av_log(nullptr, AV_LOG_FATAL, "[XDecoder] avcodec_open2 failed: %s\n", av_err2str(ret));
+        XLOG(AV_LOG_FATAL, "XDecoder", "avcodec_open2 failed: %s", av_err2str(ret));
         return ret;
     }
 
+    // 直通只支持和输出参数一致的 AAC-LC; 直播输入有漂移补偿和补静音, 样本和包对不上
+    mPassthroughCapable = mOptions.keepPackets && !mOptions.live && codecpar->codec_id == AV_CODEC_ID_AAC &&
+                          codecpar->profile == FF_PROFILE_AAC_LOW && codecpar->sample_rate == OUT_SAMPLE_RATE &&
+                          codecpar->channels == av_get_channel_layout_nb_channels(OUT_SAMPLE_CHANNEL_LAYOUT);
+    mSentPacket.reset();
+
     return 0;
 }
 
 void XDecoder::readWorkThread(void *opaque) {
     XThreadUtils::configThreadName("readWorkThread");
-    av_log(nullptr, AV_LOG_INFO, "[XDecoder] readWorkThread ++++++\n");
+    XTRACE_THREAD_NAME("readWorkThread " + mFilename);
+    XLOG(AV_LOG_INFO, "XDecoder", "readWorkThread ++++++");
     auto decoder = reinterpret_cast<XDecoder *>(opaque);
-    if (!decoder || !decoder->mFormatCtx) {
+    if (!decoder || (!decoder->mFormatCtx && !decoder->mDemuxer)) {
         return;
     }
 
     AVFormatContext *ic = decoder->mFormatCtx.get();
     int audioStreamIndex = -1;
     XPacketQueue *audioPktq = nullptr;
-    if (decoder->mAudioIndex >= 0 && !decoder->mAudioPacketQueue) {
-        decoder->mAudioPacketQueue = std::make_unique<XPacketQueue>();
+    if (decoder->mAudioIndex >= 0 && decoder->mAudioPacketQueue) {
         audioPktq = decoder->mAudioPacketQueue.get();
         audioStreamIndex = decoder->mAudioIndex;
         mAudioTid = std::make_unique<std::thread>([this, decoder] { audioWorkThread(decoder); });
@@ -117,14 +524,59 @@ void XDecoder::readWorkThread(void *opaque) {
 
     int ret;
     for (;;) {
-        if (decoder->mAborted) {
+        // 分轨由共享的解封装线程送包; 并行解码时各个解码线程自己解封装, 出错改回串行时从这里接着读包
+        if (decoder->mAborted || decoder->mDemuxer) {
             break;
         }
+        if (decoder->mParallel && !decoder->mSerialFallback) {
+            std::unique_lock<std::mutex> lock(decoder->mSampleMutex);
+            decoder->mSampleCond.wait(lock, [decoder] {
+                return decoder->mAborted || decoder->mSerialFallback ||
+                       (decoder->mStatus & decoder->S_AUDIO_END) == decoder->S_AUDIO_END;
+            });
+            if (!decoder->mSerialFallback || decoder->mAborted) {
+                break;
+            }
+            continue;
+        }
 
         auto pkt = std::make_shared<Packet>();
-        ret = av_read_frame(ic, pkt->avpkt);
+        if (decoder->mOptions.live) {
+            decoder->mIoDeadline = av_gettime_relative() + static_cast<int64_t>(decoder->mOptions.ioTimeoutMs) * 1000;
+        }
+        {
+            XTRACE_SCOPE("av_read_frame");
+            XScopedTimer timer(decoder->mDemuxHistogram);
+            ret = av_read_frame(ic, pkt->avpkt);
+        }
         if (ret < 0) {
-            if (ret == AVERROR_EOF && (decoder->mStatus & S_READ_END) != S_READ_END) {
+            if (decoder->mOptions.live && !decoder->mAborted) {
+                // 直播输入出错或断流: 重新打开, 并通知解码线程按新的流参数重建解码器
+                XLOG(AV_LOG_WARNING, "XDecoder", "live input interrupted: %s, reconnecting",
+                     av_err2str(ret));
+                XTRACE_INSTANT("reconnect");
+                if (decoder->reopenInFile() < 0) {
+                    break;
+                }
+                ic = decoder->mFormatCtx.get();
+                audioStreamIndex = decoder->mAudioIndex;
+
+                AVStream *stream = ic->streams[audioStreamIndex];
+                auto marker = std::make_shared<Packet>();
+                marker->codecpar = std::shared_ptr<AVCodecParameters>(avcodec_parameters_alloc(),
+                                                                      CodecParametersDeleter());
+                if (!marker->codecpar || avcodec_parameters_copy(marker->codecpar.get(), stream->codecpar) < 0) {
+                    break;
+                }
+                marker->timeBase = stream->time_base;
+                marker->avpkt->stream_index = audioStreamIndex;
+                if (audioPktq) {
+                    audioPktq->put(marker);
+                }
+                continue;
+            }
+
+            if ((decoder->mStatus & S_READ_END) != S_READ_END) {
                 decoder->mStatus |= S_READ_END;
                 if (audioPktq) {
                     audioPktq->putNullPacket(audioStreamIndex);
@@ -143,62 +595,114 @@ void XDecoder::readWorkThread(void *opaque) {
         mAudioTid->join();
     }
 
-    av_log(nullptr, AV_LOG_INFO, "[XDecoder] readWorkThread ------\n");
+    // 没有音频流或者解码线程没能启动时, 也要让混音线程看到结束状态
+    {
+        std::lock_guard<std::mutex> lock(mSampleMutex);
+        mStatus |= S_AUDIO_END;
+        mSampleCond.notify_all();
+    }
+
+    XLOG(AV_LOG_INFO, "XDecoder", "readWorkThread ------");
 }
 
 void XDecoder::audioWorkThread(void *opaque) {
     XThreadUtils::configThreadName("audioWorkThread");
-    av_log(nullptr, AV_LOG_INFO, "[XDecoder] audioWorkThread ++++++\n");
+    XTRACE_THREAD_NAME("audioWorkThread " + mFilename);
+    XLOG(AV_LOG_INFO, "XDecoder", "audioWorkThread ++++++");
     auto decoder = reinterpret_cast<XDecoder *>(opaque);
     if (!decoder || !decoder->mAudioCodecCtx) {
         return;
     }
 
-    if (!decoder->mSampleQueue) {
-        decoder->mSampleQueue = rbuf_create(4096);
-        rbuf_set_mode(decoder->mSampleQueue, RBUF_MODE_BLOCKING);
-    }
     int ret;
     for (;;) {
         if (decoder->mAborted) {
             break;
         }
 
-        if (rbuf_available(decoder->mSampleQueue) > 0) {
-            ret = decoder->decodeAudioFrame();
-            if (ret < 0) {
-                break;
-            }
+        ret = decoder->decodeAudioFrame();
+        if (ret < 0) {
+            break;
         }
     }
 
-    av_log(nullptr, AV_LOG_INFO, "[XDecoder] audioWorkThread ------\n");
+    // 唤醒等待样本的混音线程, 让它看到结束状态
+    {
+        std::lock_guard<std::mutex> lock(decoder->mSampleMutex);
+        decoder->mStatus |= S_AUDIO_END;
+        decoder->mSampleCond.notify_all();
+    }
+
+    XLOG(AV_LOG_INFO, "XDecoder", "audioWorkThread ------");
 }
 
 int XDecoder::decodeAudioFrame() {
+    if (mParallel && !mSerialFallback) {
+        auto frame = std::make_shared<Frame>();
+        int ret;
+        {
+            XTRACE_SCOPE("parallel receiveFrame");
+            ret = mParallel->receiveFrame(frame->avframe);
+        }
+        if (ret == AVERROR_EOF) {
+            flushConvert();
+        }
+        if (ret < 0 && ret != AVERROR_EOF && ret != AVERROR_EXIT && !mAborted) {
+            return fallbackToSerial(ret);
+        }
+        if (ret < 0) {
+            mStatus |= S_AUDIO_END;
+            return ret;
+        }
+        mParallelSamples += frame->avframe->nb_samples;
+        return sampleConvert(frame->avframe);
+    }
+
     int ret = AVERROR(EAGAIN);
     for (;;) {
 
         // receive frame
         do {
             auto frame = std::make_shared<Frame>();
-            ret = avcodec_receive_frame(mAudioCodecCtx.get(), frame->avframe);
+            {
+                XTRACE_SCOPE("avcodec_receive_frame");
+                XScopedTimer timer(mDecodeHistogram);
+                ret = avcodec_receive_frame(mAudioCodecCtx.get(), frame->avframe);
+            }
             if (ret < 0 && ret != AVERROR(EAGAIN) && ret != AVERROR_EOF) {
                 return ret;
             }
 
             if (ret == AVERROR_EOF) {
+                flushConvert();
                 mStatus |= S_AUDIO_END;
                 avcodec_flush_buffers(mAudioCodecCtx.get());
                 return ret;
             }
 
             if (ret >= 0) {
+                // 并行解码改回串行后, 丢掉之前已经输出过的样本
+                if (mDropSamples > 0) {
+                    AVFrame *src = frame->avframe;
+                    int drop = static_cast<int>(std::min<int64_t>(mDropSamples, src->nb_samples));
+                    mDropSamples -= drop;
+                    if (drop == src->nb_samples) {
+                        continue;
+                    }
+                    auto format = static_cast<AVSampleFormat>(src->format);
+                    int bytes = av_get_bytes_per_sample(format);
+                    int planes = av_sample_fmt_is_planar(format) ? src->channels : 1;
+                    int stride = av_sample_fmt_is_planar(format) ? bytes : bytes * src->channels;
+                    for (int i = 0; i < planes; ++i) {
+                        src->extended_data[i] += drop * stride;
+                    }
+                    src->nb_samples -= drop;
+                }
                 return sampleConvert(frame->avframe);
             }
 
             if (ret < 0 && ret != AVERROR(EAGAIN)) {
-                av_log(nullptr, AV_LOG_FATAL, "[XFFProducer] avcodec_receive_frame failed: %s\n", av_err2str(ret));
+                XLOG(AV_LOG_FATAL, "XDecoder", "avcodec_receive_frame failed: %s", av_err2str(ret));
                 return ret;
             }
 
@@ -211,8 +715,24 @@ int XDecoder::decodeAudioFrame() {
             return -1;
         }
 
+        // 输入重连过, 丢弃旧解码器里残留的数据, 时间戳重新开始对齐
+        if (pkt->codecpar) {
+            ret = openCodecContext(pkt->codecpar.get(), pkt->timeBase);
+            if (ret < 0) {
+                return ret;
+            }
+            mNextPts = AV_NOPTS_VALUE;
+            mFillAverage = -1;
+            continue;
+        }
+
         // send packet
-        ret = avcodec_send_packet(mAudioCodecCtx.get(), pkt->avpkt);
+        {
+            XTRACE_SCOPE("avcodec_send_packet");
+            XScopedTimer timer(mDecodeHistogram);
+            ret = avcodec_send_packet(mAudioCodecCtx.get(), pkt->avpkt);
+        }
+        mSentPacket = ret >= 0 && mPassthroughCapable ? pkt : nullptr;
         if (ret == AVERROR(EAGAIN)) {
             continue;
         }
@@ -228,85 +748,696 @@ void XDecoder::closeCodecCtx(int streamIndex) {
     }
 }
 
-void XDecoder::closeInFile() {
-    closeCodecCtx(mAudioIndex);
-
+void XDecoder::closeInput() {
     if (mFormatCtx) {
         mFormatCtx.reset();
     }
+
+    if (mPipeFd >= 0) {
+        close(mPipeFd);
+        mPipeFd = -1;
+    }
+}
+
+void XDecoder::closeInFile() {
+    closeCodecCtx(mAudioIndex);
+
+    closeInput();
 }
 
 
 int XDecoder::sampleConvert(AVFrame *src) {
+    applyBudget();
 
-    if (!mSwrContext) {
-        SwrContext *swr = swr_alloc();
-        if (!swr) {
-            return AVERROR(ENOMEM);
+    // 直播输入重连后输入格式可能变化, 需要重新选择转换方式
+    if ((mSwrContext || mConvert) && (mSwrInSampleRate != src->sample_rate || mSwrInFormat != src->format ||
+                                      mSwrInChannelLayout != src->channel_layout)) {
+        mSwrContext.reset();
+        mConvert = nullptr;
+    }
+
+    if (!mSwrContext && !mConvert) {
+        // 采样率和输出一致、声道布局和格式常见时用特化的转换内核, 其余情况交给 swr;
+        // 漂移补偿需要重采样器, 即使输入输出采样率相同也要提前打开, 避免中途 swr_set_compensation 重新初始化
+        uint64_t layout = src->channel_layout ? src->channel_layout : av_get_default_channel_layout(src->channels);
+        if (src->sample_rate == OUT_SAMPLE_RATE && !(mOptions.live && mOptions.driftCompensation)) {
+            mConvert = XMixKernels::findConverter(src->format, layout);
         }
 
-        av_opt_set_channel_layout(swr, "in_channel_layout", src->channel_layout, 0);
-        av_opt_set_int(swr, "in_sample_rate", src->sample_rate, 0);
-        av_opt_set_sample_fmt(swr, "in_sample_fmt", static_cast<AVSampleFormat>(src->format), 0);
+        if (!mConvert) {
+            SwrContext *swr = swr_alloc();
+            if (!swr) {
+                return AVERROR(ENOMEM);
+            }
+
+            av_opt_set_channel_layout(swr, "in_channel_layout", src->channel_layout, 0);
+            av_opt_set_int(swr, "in_sample_rate", src->sample_rate, 0);
+            av_opt_set_sample_fmt(swr, "in_sample_fmt", static_cast<AVSampleFormat>(src->format), 0);
+
+            av_opt_set_channel_layout(swr, "out_channel_layout", OUT_SAMPLE_CHANNEL_LAYOUT, 0);
+            av_opt_set_int(swr, "out_sample_rate", OUT_SAMPLE_RATE, 0);
+            av_opt_set_sample_fmt(swr, "out_sample_fmt", static_cast<AVSampleFormat >(OUT_SAMPLE_FMT), 0);
 
-        av_opt_set_channel_layout(swr, "out_channel_layout", OUT_SAMPLE_CHANNEL_LAYOUT, 0);
-        av_opt_set_int(swr, "out_sample_rate", OUT_SAMPLE_RATE, 0);
-        av_opt_set_sample_fmt(swr, "out_sample_fmt", static_cast<AVSampleFormat >(OUT_SAMPLE_FMT), 0);
+            if (mOptions.live && mOptions.driftCompensation) {
+                av_opt_set_int(swr, "flags", SWR_FLAG_RESAMPLE, 0);
+            }
 
-        if (swr && swr_init(swr) < 0) {
-            swr_free(&swr);
-            return AVERROR(EINVAL);
+            if (swr && swr_init(swr) < 0) {
+                swr_free(&swr);
+                return AVERROR(EINVAL);
+            }
+
+            mSwrContext = std::unique_ptr<SwrContext, SwrContextDeleter>(swr);
         }
+        mSwrInSampleRate = src->sample_rate;
+        mSwrInFormat = src->format;
+        mSwrInChannelLayout = src->channel_layout;
+    }
 
-        mSwrContext = std::unique_ptr<SwrContext, SwrContextDeleter>(swr);
+    // 时间戳连续性检查: 直播输入丢包造成的空洞用静音补齐
+    int64_t pts = src->best_effort_timestamp;
+    if (pts != AV_NOPTS_VALUE) {
+        pts = av_rescale_q(pts, mAudioCodecCtx->pkt_timebase, AVRational{1, OUT_SAMPLE_RATE});
+    }
+    if (mOptions.live && pts != AV_NOPTS_VALUE && mNextPts != AV_NOPTS_VALUE) {
+        int64_t gap = pts - mNextPts;
+        int64_t threshold = static_cast<int64_t>(mOptions.gapThresholdMs) * OUT_SAMPLE_RATE / 1000;
+        int64_t maxGap = static_cast<int64_t>(mOptions.ioTimeoutMs) * OUT_SAMPLE_RATE / 1000;
+        if (gap > threshold && gap <= maxGap) {
+            XLOG_EVERY(1000, AV_LOG_WARNING, "XDecoder", "timestamp gap %lld samples, insert silence: %s",
+                       static_cast<long long>(gap), mFilename.data());
+            int ret = writeSilence(gap);
+            if (ret < 0) {
+                return ret;
+            }
+        }
+    }
+
+    if (mOptions.live && mOptions.driftCompensation) {
+        compensateDrift();
     }
 
     const uint8_t** in = (const uint8_t **) src->extended_data;
+
+    // 转换内核不缓存样本, 输出和输入一样多; swr 可能带出上次缓存的样本, 多留一些
+    int out_count = mConvert ? src->nb_samples : src->nb_samples * OUT_SAMPLE_RATE / src->sample_rate + 256;
+    int out_size = out_count * OUT_BYTES_PER_SAMPLE;
+
+    // 缓冲区的连续空间放得下这一帧时直接重采样进去, 省掉一次拷贝; 只有解码线程写缓冲区,
+    // 拿到的空间在提交之前不会被占用. 放不下时写到暂存区, 再由 writeSamples 等空间分段写入
     uint8_t *data = nullptr;
-    unsigned int dataSize = 0;
+    bool direct = false;
+    {
+        std::lock_guard<std::mutex> lock(mSampleMutex);
+        int space = 0;
+        uint8_t *ptr = rbuf_peek_write(mSampleQueue, &space);
+        if (space >= out_size && ringLimit() - rbuf_used(mSampleQueue) >= out_size) {
+            data = ptr;
+            direct = true;
+        }
+    }
+    if (!direct) {
+        av_fast_malloc(&mSampleBuffer, &mSampleBufferSize, out_size);
+        if (!mSampleBuffer) {
+            return AVERROR(ENOMEM);
+        }
+        data = mSampleBuffer;
+    }
 
-    int out_count = src->nb_samples * OUT_SAMPLE_RATE / src->sample_rate + 256;
-    int out_size = av_samples_get_buffer_size(nullptr, av_get_channel_layout_nb_channels(OUT_SAMPLE_CHANNEL_LAYOUT), out_count, static_cast<AVSampleFormat >(OUT_SAMPLE_FMT), 1);
+    int len;
+    if (mConvert) {
+        XTRACE_SCOPE("convert");
+        XScopedTimer timer(mResampleHistogram);
+        mConvert(in, reinterpret_cast<int16_t *>(data), src->nb_samples);
+        len = src->nb_samples;
+    } else {
+        XTRACE_SCOPE("swr_convert");
+        XScopedTimer timer(mResampleHistogram);
+        len = swr_convert(mSwrContext.get(), &data, out_count, in, src->nb_samples);
+    }
+    if (len < 0) {
+        return len;
+    }
+    int size = len * OUT_BYTES_PER_SAMPLE;
 
-    av_fast_malloc(&data, &dataSize, out_size);
-    if (!data) {
-        return AVERROR(ENOMEM);
+    if (pts != AV_NOPTS_VALUE) {
+        mNextPts = pts + av_rescale(src->nb_samples, OUT_SAMPLE_RATE, src->sample_rate);
+    } else if (mNextPts != AV_NOPTS_VALUE) {
+        mNextPts += len;
+    }
+
+    // AAC 一个包解出一帧, 没有经过重采样时这一帧的样本和刚送进解码器的包一一对应, 记下包在缓冲里的位置
+    std::shared_ptr<Packet> packet = std::move(mSentPacket);
+    int header = packet && len == src->nb_samples ? adtsHeaderSize(packet->avpkt) : -1;
+    if (header >= 0) {
+        auto raw = std::make_shared<Packet>();
+        if (av_packet_ref(raw->avpkt, packet->avpkt) >= 0) {
+            raw->avpkt->data += header;
+            raw->avpkt->size -= header;
+            av_packet_free_side_data(raw->avpkt);
+
+            std::lock_guard<std::mutex> lock(mSampleMutex);
+            mPacketSpans.push_back(XPacketSpan{mWritePos, size, std::move(raw)});
+        }
+    }
+
+    // 整帧的峰值在这里算一次, 混音线程据此跳过静音段, 不用再逐块检查
+    bool audible = XMixKernels::peakS16(reinterpret_cast<const int16_t*>(data), size / 2) > mOptions.silencePeak;
+    return direct ? commitSamples(size, audible) : writeSamples(data, size, audible);
+}
+
+int XDecoder::flushConvert() {
+    // swr 按滤波器长度缓存了一部分输入, 不冲出来时重采样的素材结尾会少几毫秒, 首尾相接时就是一个空隙;
+    // 要在设置结束状态之前写进缓冲, 否则读取方可能已经按结尾处理
+    if (!mSwrContext || mOptions.live) {
+        return 0;
+    }
+
+    for (;;) {
+        int out_count = 1024;
+        av_fast_malloc(&mSampleBuffer, &mSampleBufferSize, out_count * OUT_BYTES_PER_SAMPLE);
+        if (!mSampleBuffer) {
+            return AVERROR(ENOMEM);
+        }
+        uint8_t *data = mSampleBuffer;
+        int len = swr_convert(mSwrContext.get(), &data, out_count, nullptr, 0);
+        if (len <= 0) {
+            return len;
+        }
+
+        int size = len * OUT_BYTES_PER_SAMPLE;
+        bool audible = XMixKernels::peakS16(reinterpret_cast<const int16_t*>(data), size / 2) > mOptions.silencePeak;
+        int ret = writeSamples(data, size, audible);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+}
+
+int XDecoder::fallbackToSerial(int error) {
+    XLOG(AV_LOG_WARNING, "XDecoder", "parallel decode failed: %s, decode serially from %lld samples: %s",
+         av_err2str(error), static_cast<long long>(mParallelSamples), mFilename.data());
+    mParallel->abort();
+
+    // 回到开头重新解码, 开头的编码延迟照常裁掉; 读线程还没有读过包, 定位后从头读
+    AVStream *stream = mFormatCtx->streams[mAudioIndex];
+    int64_t start = stream->start_time != AV_NOPTS_VALUE ? stream->start_time : 0;
+    int ret = av_seek_frame(mFormatCtx.get(), mAudioIndex, start, AVSEEK_FLAG_BACKWARD);
+    if (ret < 0) {
+        XLOG(AV_LOG_ERROR, "XDecoder", "seek for serial decode failed: %s: %s", av_err2str(ret),
+             mFilename.data());
+        mStatus |= S_AUDIO_END;
+        return ret;
+    }
+    avcodec_flush_buffers(mAudioCodecCtx.get());
+    mDropSamples = mParallelSamples;
+
+    std::lock_guard<std::mutex> lock(mSampleMutex);
+    mSerialFallback = true;
+    mSampleCond.notify_all();
+    return 0;
+}
+
+void XDecoder::applyBudget() {
+    if (mBudgetId < 0 || ++mBudgetFrames % 16 != 0) {
+        return;
     }
 
-    int len = swr_convert(mSwrContext.get(), &data, out_count, in, src->nb_samples);
-    int size = len * 2 * av_get_bytes_per_sample(static_cast<AVSampleFormat >(OUT_SAMPLE_FMT));
+    int64_t queueBytes = mAudioPacketQueue ? mAudioPacketQueue->bytes() : 0;
+    XMemoryBudget::XPlan plan = XMemoryBudget::instance().update(mBudgetId, mRingCapacity, queueBytes,
+                                                                 mRingEmptyWaits.value(), mRingFullWaits.value());
+    // 分轨的队列由共享的解封装线程写, 容量保持不变
+    if (mAudioPacketQueue && !mDemuxer && plan.packetCapacity > 0) {
+        mAudioPacketQueue->setCapacity(plan.packetCapacity);
+    }
+    if (mOptions.live || plan.ringBytes <= 0) {
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(mSampleMutex);
+    if (!mSampleQueue) {
+        return;
+    }
+
+    // 相差不到四分之一时不调整, 换缓冲区要拷贝已有的样本; 软上限立即生效, 解码线程之后只写到新的大小
+    if (std::abs(plan.ringBytes - mRingLimit) >= mRingLimit / 4) {
+        mRingLimit = plan.ringBytes;
+        mSampleCond.notify_all();
+    }
+
+    // 这里在两帧之间, 写侧没有借出的空间; 读侧借出的样本还没归还, 或者缩小时样本还没降到软上限以下, 下次再换
+    int capacity = rbuf_size(mSampleQueue);
+    int used = rbuf_used(mSampleQueue);
+    if (capacity == mRingLimit || mPeekedBytes > 0 || used > mRingLimit) {
+        return;
+    }
+    rbuf_t *ring = rbuf_create(mRingLimit);
+    if (!ring) {
+        return;
+    }
+    rbuf_set_mode(ring, RBUF_MODE_BLOCKING);
+    if (used > 0) {
+        std::vector<uint8_t> pending(used);
+        rbuf_read(mSampleQueue, pending.data(), used);
+        rbuf_write(ring, pending.data(), used);
+    }
+    rbuf_destroy(mSampleQueue);
+    mSampleQueue = ring;
+    mRingLimit = rbuf_size(ring);
+    mRingCapacity = mRingLimit;
+    mSampleCond.notify_all();
+    XLOG(AV_LOG_VERBOSE, "XDecoder", "sample ring %d -> %d bytes: %s", capacity, mRingLimit, mFilename.data());
+}
 
-    rbuf_write(mSampleQueue, data, size);
+int XDecoder::ringLimit() const {
+    return std::min(mRingLimit, rbuf_size(mSampleQueue));
+}
+
+void XDecoder::compensateDrift() {
+    double fill;
+    {
+        std::lock_guard<std::mutex> lock(mSampleMutex);
+        fill = static_cast<double>(rbuf_used(mSampleQueue)) / OUT_BYTES_PER_SAMPLE;
+    }
+
+    // 水位做指数平均, 时间常数大约是 100 帧, 过滤掉网络抖动只留下长期的漂移
+    mFillAverage = mFillAverage < 0 ? fill : mFillAverage + 0.01 * (fill - mFillAverage);
+
+    double target = static_cast<double>(OUT_SAMPLE_RATE) * mOptions.targetLatencyMs / 1000;
+    double error = (mFillAverage - target) / target;
+    double maxCorrection = mOptions.maxDriftPpm * 1e-6;
+
+    // PI 控制: 水位偏高说明输入时钟比混音时钟快, 需要少输出一些样本, 反之多输出
+    mDriftIntegral = std::max(-maxCorrection, std::min(maxCorrection, mDriftIntegral + error * 1e-5));
+    double correction = std::max(-maxCorrection, std::min(maxCorrection, error * 1e-3 + mDriftIntegral));
+
+    // 以 1 秒为补偿距离, 比例的分辨率约为 23ppm
+    int delta = static_cast<int>(-correction * OUT_SAMPLE_RATE);
+    if (swr_set_compensation(mSwrContext.get(), delta, OUT_SAMPLE_RATE) < 0) {
+        return;
+    }
+    mDriftPpm = static_cast<int>(-correction * 1e6);
 
+    int64_t now = av_gettime_relative();
+    if (now - mDriftLogTime > 10 * AV_TIME_BASE) {
+        mDriftLogTime = now;
+        XLOG(AV_LOG_VERBOSE, "XDecoder", "drift compensation: fill %.0f/%.0f samples, %d ppm",
+             mFillAverage, target, mDriftPpm);
+    }
+}
+
+int XDecoder::writeSamples(uint8_t *data, int size, bool audible) {
+    int written = 0;
+    std::unique_lock<std::mutex> lock(mSampleMutex);
+    if (audible) {
+        mAudibleEnd = mWritePos + size;
+    }
+    while (written < size) {
+        if (!mAborted && ringLimit() - rbuf_used(mSampleQueue) <= 0) {
+            // 缓冲区满(按软上限), 混音线程取样本慢于解码
+            XTRACE_SCOPE("sample ring full");
+            int64_t start = XTelemetry::isEnabled() ? XTelemetry::now() : 0;
+            mSampleCond.wait(lock, [this] { return mAborted || ringLimit() - rbuf_used(mSampleQueue) > 0; });
+            mRingFullWaits.add();
+            if (start > 0) {
+                mRingFullWaitNs.add(static_cast<uint64_t>(XTelemetry::now() - start));
+            }
+        }
+        if (mAborted) {
+            return AVERROR_EXIT;
+        }
+
+        int n = rbuf_write(mSampleQueue, data + written,
+                           std::min(size - written, ringLimit() - rbuf_used(mSampleQueue)));
+        written += n;
+        mWritePos += n;
+        mSampleCond.notify_all();
+    }
+
+    return written;
+}
+
+int XDecoder::commitSamples(int size, bool audible) {
+    std::lock_guard<std::mutex> lock(mSampleMutex);
+    if (mAborted) {
+        return AVERROR_EXIT;
+    }
+    if (audible) {
+        mAudibleEnd = mWritePos + size;
+    }
+    rbuf_commit_write(mSampleQueue, size);
+    mWritePos += size;
+    mSampleCond.notify_all();
     return size;
 }
 
-int XDecoder::getSamples(uint8_t *out, int length) {
+int XDecoder::writeSilence(int64_t nbSamples) {
+    static uint8_t silence[4096] = {0};
+    int64_t bytes = nbSamples * OUT_BYTES_PER_SAMPLE;
+    while (bytes > 0) {
+        int chunk = static_cast<int>(std::min<int64_t>(bytes, sizeof(silence)));
+        int ret = writeSamples(silence, chunk, false);
+        if (ret < 0) {
+            return ret;
+        }
+        bytes -= chunk;
+    }
+
+    return 0;
+}
+
+int XDecoder::getSamples(uint8_t *out, int length, bool *silent) {
+    if (silent) {
+        *silent = false;
+    }
+
+    if (mSource) {
+        int readed = mSource->read(mSourceReader, out, length, silent);
+        if (readed > 0) {
+            mReads.add();
+            if (silent && *silent) {
+                mSilentReads.add();
+            }
+        }
+        return readed;
+    }
+
+    if (mPlaylist) {
+        int readed = mPlaylist->read(out, length);
+        if (readed > 0) {
+            mReads.add();
+        }
+        return readed;
+    }
+
+    std::unique_lock<std::mutex> lock(mSampleMutex);
     if (!mSampleQueue) {
-        return AVERROR(ENOMEM);
+        // 还没有调用 start
+        return AVERROR(EINVAL);
+    }
+
+    bool telemetry = XTelemetry::isEnabled();
+    if (telemetry) {
+        mRingDepth.sample(rbuf_used(mSampleQueue));
+    }
+
+    if (mOptions.live) {
+        return getLiveSamples(lock, out, length, silent);
+    }
+
+    while (!mPacketSpans.empty() && mPacketSpans.front().pos < mReadPos) {
+        mPacketSpans.pop_front();
+    }
+
+    // 要取的样本可能比缓冲区还大, 分几次取满; 只有读到结尾时才会取不满
+    int64_t startPos = mReadPos;
+    int readed = 0;
+    int skipped = 0;
+    bool allSilent = silent != nullptr;
+    while (readed < length) {
+        int wanted = std::min(length - readed, ringLimit());
+        auto ready = [this, wanted] {
+            // 解码线程可能在等待期间缩小缓冲区, 按当时的容量判断
+            return mAborted || (mStatus & S_AUDIO_END) == S_AUDIO_END ||
+                   rbuf_used(mSampleQueue) >= std::min(wanted, ringLimit());
+        };
+
+        // 缓冲区里的样本不够, 混音线程要等解码
+        if (!ready()) {
+            mRingEmptyWaits.add();
+            int64_t waitStart = telemetry ? XTelemetry::now() : 0;
+            mSampleCond.wait(lock, ready);
+            if (waitStart > 0) {
+                mRingEmptyWaitNs.add(static_cast<uint64_t>(XTelemetry::now() - waitStart));
+            }
+        }
+
+        int used = rbuf_used(mSampleQueue);
+        if (used <= 0) {
+            break;
+        }
+
+        int n = std::min(length - readed, used);
+        if (allSilent && mReadPos >= mAudibleEnd) {
+            // 读位置之后没有非静音帧, 先只跳过, 后面遇到非静音数据再把这部分补零
+            rbuf_skip(mSampleQueue, n);
+            skipped += n;
+        } else {
+            if (allSilent && skipped > 0) {
+                memset(out, 0, skipped);
+            }
+            allSilent = false;
+            n = rbuf_read(mSampleQueue, out + readed, n);
+        }
+        mReadPos += n;
+        readed += n;
+
+        // 解码线程可能在等缓冲区的空间
+        mSampleCond.notify_all();
     }
 
+    if (readed <= 0) {
+        return -1;
+    }
+
+    if (allSilent) {
+        *silent = true;
+        mSilentReads.add();
+    }
+    mLastReadPos = startPos;
+    mLastReadSize = readed;
+    mReads.add();
+    return readed;
+}
+
+int XDecoder::peekSamples(const uint8_t **data, int length, bool *silent) {
+    *data = nullptr;
+    if (silent) {
+        *silent = false;
+    }
+
+    if (mSource || mPlaylist) {
+        return AVERROR(ENOSYS);
+    }
+
+    std::unique_lock<std::mutex> lock(mSampleMutex);
+    if (!mSampleQueue) {
+        return AVERROR(EINVAL);
+    }
+    if (mOptions.live || !rbuf_is_mirrored(mSampleQueue) || length > ringLimit()) {
+        return AVERROR(ENOSYS);
+    }
+
+    bool telemetry = XTelemetry::isEnabled();
+    if (telemetry) {
+        mRingDepth.sample(rbuf_used(mSampleQueue));
+    }
+
+    while (!mPacketSpans.empty() && mPacketSpans.front().pos < mReadPos) {
+        mPacketSpans.pop_front();
+    }
+
+    auto ready = [this, length] {
+        return mAborted || (mStatus & S_AUDIO_END) == S_AUDIO_END ||
+               rbuf_used(mSampleQueue) >= std::min(length, ringLimit());
+    };
+    if (!ready()) {
+        mRingEmptyWaits.add();
+        int64_t waitStart = telemetry ? XTelemetry::now() : 0;
+        mSampleCond.wait(lock, ready);
+        if (waitStart > 0) {
+            mRingEmptyWaitNs.add(static_cast<uint64_t>(XTelemetry::now() - waitStart));
+        }
+    }
+
+    // 等待期间缓冲区被内存预算缩小到放不下 length 时, 取到的不满不代表结尾, 改由 getSamples 分次取满
+    if (length > ringLimit() && (mStatus & S_AUDIO_END) != S_AUDIO_END) {
+        return AVERROR(ENOSYS);
+    }
+
+    int used = 0;
+    const uint8_t *ptr = rbuf_peek_read(mSampleQueue, &used);
+    if (used <= 0) {
+        return -1;
+    }
+
+    int readed = std::min(length, used);
+    if (silent && mReadPos >= mAudibleEnd) {
+        *silent = true;
+        mSilentReads.add();
+    }
+    *data = ptr;
+    mPeekedBytes = readed;
+    mLastReadPos = mReadPos;
+    mLastReadSize = readed;
+    mReads.add();
+    return readed;
+}
+
+void XDecoder::releaseSamples(int size) {
+    std::lock_guard<std::mutex> lock(mSampleMutex);
+    if (!mSampleQueue) {
+        return;
+    }
+    rbuf_commit_read(mSampleQueue, size);
+    mPeekedBytes = 0;
+    mReadPos += size;
+
+    // 解码线程可能在等缓冲区的空间
+    mSampleCond.notify_all();
+}
+
+int64_t XDecoder::skipSamples(int64_t length) {
+    if (mSource) {
+        return mSource->skip(mSourceReader, length);
+    }
+
+    // 按块读出丢掉; 能零拷贝时不经过暂存区
+    std::vector<uint8_t> scratch;
+    int64_t skipped = 0;
+    while (skipped < length) {
+        int chunk = static_cast<int>(std::min<int64_t>(length - skipped, 16 * 1024));
+        const uint8_t *data = nullptr;
+        int readed = peekSamples(&data, chunk);
+        if (readed == AVERROR(ENOSYS)) {
+            scratch.resize(chunk);
+            bool silent;
+            readed = getSamples(scratch.data(), chunk, &silent);
+        } else if (readed > 0) {
+            releaseSamples(readed);
+        }
+        if (readed <= 0) {
+            break;
+        }
+        skipped += readed;
+        if (readed < chunk && !mOptions.live) {
+            break;
+        }
+    }
+    return skipped;
+}
+
+int XDecoder::getLiveSamples(std::unique_lock<std::mutex> &lock, uint8_t *out, int length, bool *silent) {
+    int wanted = std::min(length, rbuf_size(mSampleQueue));
+    auto ready = [this, wanted] {
+        return mAborted || (mStatus & S_AUDIO_END) == S_AUDIO_END || rbuf_used(mSampleQueue) >= wanted;
+    };
+
+    // 缓冲区里的样本不够, 混音线程要等解码
+    int64_t waitStart = 0;
+    if (!ready()) {
+        mRingEmptyWaits.add();
+        waitStart = XTelemetry::isEnabled() ? XTelemetry::now() : 0;
+    }
+
+    bool ok = mSampleCond.wait_for(lock, std::chrono::milliseconds(mOptions.underrunWaitMs), ready);
+    if (waitStart > 0) {
+        mRingEmptyWaitNs.add(static_cast<uint64_t>(XTelemetry::now() - waitStart));
+    }
+    if (!ok) {
+        // 直播断流: 有多少取多少, 不足的部分补静音, 混音继续进行
+        if (!mInUnderrun) {
+            XTRACE_INSTANT("underrun");
+            mInUnderrun = true;
+            ++mUnderrunCount;
+            XLOG_EVERY(1000, AV_LOG_WARNING, "XDecoder", "underrun(%d): %s", mUnderrunCount, mFilename.data());
+        }
+        mLastReadSize = 0;
+        if (silent && mReadPos >= mAudibleEnd) {
+            mReadPos += rbuf_used(mSampleQueue);
+            rbuf_skip(mSampleQueue, rbuf_used(mSampleQueue));
+            *silent = true;
+            mSilentReads.add();
+        } else {
+            int readed = rbuf_read(mSampleQueue, out, length);
+            mReadPos += readed;
+            memset(out + readed, 0, length - readed);
+        }
+        mReads.add();
+        mSampleCond.notify_all();
+        return length;
+    }
+    mInUnderrun = false;
+
     if ((mStatus & S_AUDIO_END) == S_AUDIO_END && rbuf_used(mSampleQueue) <= 0) {
         return -1;
     }
 
-    return rbuf_read(mSampleQueue, out, length);
+    int readed;
+    if (silent && mReadPos >= mAudibleEnd) {
+        // 读位置之后没有非静音帧
+        readed = std::min(length, rbuf_used(mSampleQueue));
+        rbuf_skip(mSampleQueue, readed);
+        *silent = true;
+        mSilentReads.add();
+    } else {
+        readed = rbuf_read(mSampleQueue, out, length);
+    }
+    mLastReadPos = mReadPos;
+    mLastReadSize = readed;
+    mReadPos += readed;
+    mReads.add();
+    mSampleCond.notify_all();
+    return readed;
 }
 
 void XDecoder::stop() {
+    if (mSource) {
+        if (!mAborted) {
+            mAborted = true;
+            mSource->close(mSourceReader);
+        }
+        return;
+    }
+
+    if (mPlaylist) {
+        if (!mAborted) {
+            mAborted = true;
+            mPlaylist->stop();
+        }
+        return;
+    }
+
     {
         std::lock_guard<std::mutex> lock(mMutex);
         mAborted = true;
     }
+    mAbortCond.notify_all();
+
+    {
+        std::lock_guard<std::mutex> lock(mSampleMutex);
+        mSampleCond.notify_all();
+    }
+
+    if (mAudioPacketQueue) {
+        mAudioPacketQueue->abort();
+    }
+
+    if (mDemuxer) {
+        mDemuxer->detach(mAudioIndex);
+    }
+
+    if (mParallel) {
+        mParallel->abort();
+    }
 
     if (mReadTid && mReadTid->joinable()) {
         mReadTid->join();
     }
+    mParallel.reset();
 
     closeInFile();
 
+    if (mBudgetId >= 0) {
+        XMemoryBudget::instance().removeInput(mBudgetId);
+        mBudgetId = -1;
+    }
+
+    std::lock_guard<std::mutex> lock(mSampleMutex);
     if (mSampleQueue) {
         rbuf_destroy(mSampleQueue);
         mSampleQueue = nullptr;
     }
-}
\ No newline at end of file
+    av_freep(&mSampleBuffer);
+    mSampleBufferSize = 0;
+}
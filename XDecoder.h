@@ -6,48 +6,199 @@
 #define NATIVECODE_XAUDIODECODER_H
 
 #include "XFFHeader.h"
+#include <deque>
 #include <vector>
 #include <string>
 #include <thread>
 #include <mutex>
+#include <atomic>
 #include <condition_variable>
+#include "XMixKernels.h"
 #include "XSampleQueue.h"
+#include "XTelemetry.h"
 
+class XDemuxer;
 class XPacketQueue;
+class XParallelDecoder;
+class XProbeCache;
+class XSharedSource;
+class XPlaylist;
+struct XProbeInfo;
+
+struct XDecoderOptions {
+    /* 直播输入(RTP/UDP/TCP/HTTP/命名管道): 出错自动重连, 断流时补静音而不是结束 */
+    bool live = false;
+
+    /* 单次 IO 阻塞的超时时间, 超时后中断并触发重连 */
+    int ioTimeoutMs = 5000;
+
+    /* 重连的退避间隔, 每失败一次翻倍直到 maxReconnectDelayMs */
+    int reconnectDelayMs = 200;
+    int maxReconnectDelayMs = 5000;
+
+    /* 直播输入取样本时最多等待的时间, 超时不足的部分补静音 */
+    int underrunWaitMs = 40;
+
+    /* 时间戳跳变超过该值时认为丢了数据, 补上对应长度的静音 */
+    int gapThresholdMs = 20;
+
+    /* 直播输入的样本缓冲目标水位, 缓冲区大小为它的两倍 */
+    int targetLatencyMs = 200;
+
+    /* 根据缓冲水位微调重采样比例, 抵消输入时钟和混音时钟之间的漂移 */
+    bool driftCompensation = true;
+    int maxDriftPpm = 2000;
+
+    /* 峰值(S16)不超过该值的解码帧当作静音, 混音时直接跳过; 0 表示只跳过数字静音 */
+    int silencePeak = 0;
+
+    /* 保留和输出参数一致的 AAC 原始包, 供混音器在只有这一路发声时直接封装, 由 XMixer 根据直通选项设置 */
+    bool keepPackets = false;
+
+    /* 大于 1 时, 足够长的本地 MP3/ADTS AAC/FLAC/WAV 按字节范围切段, 用这么多个线程并行解码 */
+    int decodeThreads = 0;
+    int segmentSeconds = 20;
+
+    /*
+     * 封装格式提示(如 "mp3", "mov"), 非空时跳过格式探测; 打开后头部已经给出了完整的音频参数时,
+     * 也不再调用 avformat_find_stream_info
+     */
+    std::string formatHint;
+
+    /* 探测结果缓存, 命中时按缓存的格式和参数直接打开, 未命中时把这次的探测结果写进去; 可以多个解码器共用 */
+    std::shared_ptr<XProbeCache> probeCache;
+};
 
 class XDecoder {
 public:
-    XDecoder(const std::string& filename);
+    XDecoder(const std::string& filename, const XDecoderOptions& options = XDecoderOptions());
+
+    /* 多轨文件里的一路音频流, 和同一文件的其它分轨共用 demuxer 的解封装线程 */
+    XDecoder(const std::shared_ptr<XDemuxer>& demuxer, int streamIndex,
+             const XDecoderOptions& options = XDecoderOptions());
+
+    /* 共享素材的一个读取器: 不打开文件也没有线程, 从 source 解好的块里按自己的读位置取样本 */
+    XDecoder(const std::shared_ptr<XSharedSource>& source, const XDecoderOptions& options = XDecoderOptions());
+
+    /* 播放列表输入: 自己不打开文件, 样本由 playlist 里依次解码的各首提供 */
+    XDecoder(const std::shared_ptr<XPlaylist>& playlist, const XDecoderOptions& options = XDecoderOptions());
 
     ~XDecoder();
 
     void start();
 
-    int getSamples(uint8_t* out, int length);
-    
+    /*
+     * 点播输入总是取满 length 字节, 只有读到结尾时才会不足; 直播输入最多取一个缓冲区, 断流时补静音.
+     * silent 不为空时, 如果取出的这段样本全部来自静音帧, 只前移读位置不拷贝, out 的内容不变,
+     * 并把 *silent 置为 true; 为空时总是拷贝
+     */
+    int getSamples(uint8_t* out, int length, bool* silent = nullptr);
+
+    /*
+     * 零拷贝地取样本: 和 getSamples 一样等到 length 字节(或读到结尾), 但不拷贝, *data 指向样本缓冲内部,
+     * 用完后调用 releaseSamples 归还; 归还之前解码线程不会覆盖这段数据. 直播输入、缓冲区没有镜像映射
+     * 或者 length 超过缓冲区大小时返回 AVERROR(ENOSYS), 调用方改用 getSamples
+     */
+    int peekSamples(const uint8_t** data, int length, bool* silent = nullptr);
+
+    void releaseSamples(int size);
+
+    /* 丢掉接下来的 length 字节, 用于裁剪素材开头; 共享素材的读取器只移动读位置. 返回实际丢掉的字节数 */
+    int64_t skipSamples(int64_t length);
+
     void stop();
 
+    bool isLive() const;
+
+    const XDecoderOptions& options() const;
+
+    /* 共享素材的读取器 */
+    bool isShared() const;
+
+    /* 探测到的时长(AV_TIME_BASE), 直播输入或未知时为 AV_NOPTS_VALUE */
+    int64_t duration() const;
+
+    /*
+     * 上一次 getSamples 取出的样本正好是一个 AAC 原始包解码的结果时返回这个包(已去掉 ADTS 头), 否则返回空;
+     * 只在 keepPackets 打开时有效
+     */
+    std::shared_ptr<Packet> passthroughPacket();
+
+    /* 各阶段耗时和队列占用的快照, 可以在任意线程调用 */
+    XDecoderStats stats() const;
+
+    /* 根据 url 的协议或文件类型判断是否为直播输入 */
+    static bool isLiveSource(const std::string& url);
+
+private:
+    friend class XMixerBench;
+
 private:
+    XDecoder(const std::string& filename, const XDecoderOptions& options, std::shared_ptr<XDemuxer> demuxer,
+             int streamIndex, std::shared_ptr<XSharedSource> source = nullptr,
+             std::shared_ptr<XPlaylist> playlist = nullptr);
+
+    int openSharedStream(int streamIndex);
+
     int openInFile();
 
+    int openInput();
+
+    /* 不调用 avformat_find_stream_info, 用缓存的结果或头部的参数确定音频流, 参数不可用时返回负数 */
+    int applyProbeInfo(const XProbeInfo& info);
+
+    int findHeaderStream();
+
+    int reopenInFile();
+
     int openCodecContext(int streamIndex);
 
+    int openCodecContext(const AVCodecParameters* codecpar, AVRational timeBase);
+
     void closeCodecCtx(int streamIndex);
 
     void closeInFile();
 
+    void closeInput();
+
+    static int interruptCallback(void* opaque);
+
 private:
     int decodeAudioFrame();
 
     int sampleConvert(AVFrame* src);
 
+    /* 输入结束时冲出 swr 里缓存的样本 */
+    int flushConvert();
+
+    /* 并行解码出错, 改为从头串行解码, 在解码线程调用 */
+    int fallbackToSerial(int error);
+
+    /* 解码线程里两帧之间调用: 向内存预算报告占用, 按分配的大小调整包队列和样本缓冲 */
+    void applyBudget();
+
+    /* 样本缓冲当前可用的容量, 调用时持有 mSampleMutex */
+    int ringLimit() const;
+
+    int writeSamples(uint8_t* data, int size, bool audible);
+
+    /* sampleConvert 直接写进缓冲区的样本在这里提交 */
+    int commitSamples(int size, bool audible);
+
+    int writeSilence(int64_t nbSamples);
+
+    /* 直播输入取样本: 最多等待 underrunWaitMs, 不足的部分补静音 */
+    int getLiveSamples(std::unique_lock<std::mutex>& lock, uint8_t* out, int length, bool* silent);
+
+    void compensateDrift();
+
 private:
     void readWorkThread(void* opaque);
 
     void audioWorkThread(void* opaque);
 
 private:
-    unsigned int mStatus = 0;
+    std::atomic<unsigned int> mStatus{0};
     const int S_READ_END = 1 << 0;
     const int S_AUDIO_END = 1 << 1;
 
@@ -56,20 +207,45 @@ private:
     const int OUT_SAMPLE_RATE = 44100;
     const uint64_t OUT_SAMPLE_CHANNEL_LAYOUT = AV_CH_LAYOUT_STEREO;
 
+    /* S16 立体声一个采样点的字节数, 热路径上不再逐帧查询 */
+    const int OUT_BYTES_PER_SAMPLE = 2 * static_cast<int>(sizeof(int16_t));
+
 private:
     int mAudioIndex;
     std::unique_ptr<AVFormatContext, InputFormatDeleter> mFormatCtx;
     std::unique_ptr<AVCodecContext, CodecDeleter> mAudioCodecCtx;
     std::unique_ptr<SwrContext, SwrContextDeleter> mSwrContext;
 
-    std::unique_ptr<XPacketQueue> mAudioPacketQueue;
+    std::shared_ptr<XPacketQueue> mAudioPacketQueue;
+
+    /* 分轨共用的解封装, 为空时自己打开文件和读包 */
+    std::shared_ptr<XDemuxer> mDemuxer;
+
+    /* 共享素材, 不为空时这个解码器只是它的一个读取器 */
+    std::shared_ptr<XSharedSource> mSource;
+    int mSourceReader;
+
+    /* 播放列表, 不为空时样本都从它取 */
+    std::shared_ptr<XPlaylist> mPlaylist;
 
     std::unique_ptr<std::thread> mReadTid;
     std::mutex mMutex;
+    std::condition_variable mAbortCond;
 
     std::unique_ptr<std::thread> mAudioTid;
 
+    /*
+     * 并行解码时由它解封装和解码, 读线程不再读包. 并行解码出错时 mSerialFallback 置位, 读线程从头读包,
+     * 串行解码丢掉已经由并行解码交出的 mDropSamples 个样本后接着输出
+     */
+    std::unique_ptr<XParallelDecoder> mParallel;
+    std::atomic<bool> mSerialFallback{false};
+    int64_t mParallelSamples = 0;
+    int64_t mDropSamples = 0;
+
+    /* 缓冲区剩余的连续空间放不下一帧时, 重采样先写到这里 */
     uint8_t* mSampleBuffer;
+    unsigned int mSampleBufferSize;
 
     int mEncodedSampleCount;
 
@@ -77,9 +253,80 @@ private:
 
     std::string mFilename;
 
-    bool mAborted;
+    XDecoderOptions mOptions;
+
+    int64_t mDuration;
+
+    std::atomic<bool> mAborted;
 
     rbuf_t* mSampleQueue;
+    std::mutex mSampleMutex;
+    std::condition_variable mSampleCond;
+
+    /* 内存预算里的编号, 没有登记时为 -1; mPeekedBytes 为 peekSamples 借出还没归还的字节数, 这时不能换缓冲区 */
+    int mBudgetId;
+    int mBudgetFrames;
+    int mPeekedBytes;
+
+    /*
+     * 样本缓冲的软上限: 解码线程最多写到这么多字节. 内存预算缩小时先降低软上限, 缓冲区里的样本降到它以下后
+     * 再换成小的缓冲区; 不超过实际大小. 持有 mSampleMutex 时访问
+     */
+    int mRingLimit;
+
+    /* 样本缓冲的累计写入/读取字节数, 以及最后一个非静音帧的结束位置, 读位置到达它之后的数据都是静音 */
+    int64_t mWritePos;
+    int64_t mReadPos;
+    int64_t mAudibleEnd;
+
+    /* 直通用的原始包和它解码出的样本在缓冲里的位置, 读位置越过之后丢掉 */
+    struct XPacketSpan {
+        int64_t pos;
+        int size;
+        std::shared_ptr<Packet> packet;
+    };
+    std::deque<XPacketSpan> mPacketSpans;
+    int64_t mLastReadPos;
+    int mLastReadSize;
+    bool mPassthroughCapable;
+    std::shared_ptr<Packet> mSentPacket;
+
+private:
+    /* 直播输入相关状态 */
+    std::atomic<int64_t> mIoDeadline;
+    int mPipeFd;
+    int64_t mNextPts;
+    int mSwrInSampleRate;
+    int mSwrInFormat;
+    uint64_t mSwrInChannelLayout;
+
+    /* 输入打开后按第一帧的格式选出的特化转换内核, 为空时用 mSwrContext */
+    XMixKernels::ConvertFunc mConvert;
+    int mReconnectCount;
+    int mUnderrunCount;
+    bool mInUnderrun;
+
+    /* 时钟漂移补偿状态 */
+    double mFillAverage;
+    double mDriftIntegral;
+    int mDriftPpm;
+    int64_t mDriftLogTime;
+
+private:
+    /* 性能统计: 解封装在读线程, 解码/重采样/写缓冲在解码线程, 取样本在混音线程 */
+    XHistogram mDemuxHistogram;
+    XHistogram mDecodeHistogram;
+    XHistogram mResampleHistogram;
+    std::atomic<int> mRingCapacity{0};
+    XGauge mRingDepth;
+    XCounter mRingFullWaits;
+    XCounter mRingFullWaitNs;
+    XCounter mRingEmptyWaits;
+    XCounter mRingEmptyWaitNs;
+    XCounter mReads;
+    XCounter mSilentReads;
+    int64_t mOpenUs;
+    const char* mProbe;
 };
 
 
@@ -0,0 +1,190 @@
+//
+// Created by Andy on 2020/7/30.
+//
+
+#include "XDemuxer.h"
+#include "XException.h"
+#include "XLog.h"
+#include "XPacketQueue.h"
+#include "XThreadUtils.h"
+#include "XTrace.h"
+
+XDemuxer::XDemuxer(const std::string &filename, const std::string &formatHint)
+        : mFilename(filename), mAborted(false) {
+    AVInputFormat *iformat = formatHint.empty() ? nullptr : av_find_input_format(formatHint.data());
+    AVFormatContext *ic = nullptr;
+    int ret = avformat_open_input(&ic, mFilename.data(), iformat, nullptr);
+    if (ret < 0) {
+        XLOG(AV_LOG_FATAL, "XDemuxer", "avformat_open_input failed: %s", av_err2str(ret));
+        throw XException(av_err2str(ret));
+    }
+    mFormatCtx = std::unique_ptr<AVFormatContext, InputFormatDeleter>(ic);
+
+    ret = avformat_find_stream_info(ic, nullptr);
+    if (ret < 0) {
+        XLOG(AV_LOG_FATAL, "XDemuxer", "avformat_find_stream_info failed: %s", av_err2str(ret));
+        throw XException(av_err2str(ret));
+    }
+
+    for (unsigned int i = 0; i < ic->nb_streams; ++i) {
+        ic->streams[i]->discard = AVDISCARD_ALL;
+    }
+}
+
+XDemuxer::~XDemuxer() {
+    mAborted = true;
+    if (mReadTid && mReadTid->joinable()) {
+        mReadTid->join();
+    }
+}
+
+const std::string &XDemuxer::filename() const {
+    return mFilename;
+}
+
+std::vector<int> XDemuxer::audioStreams() const {
+    std::vector<int> streams;
+    for (unsigned int i = 0; i < mFormatCtx->nb_streams; ++i) {
+        if (mFormatCtx->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_AUDIO) {
+            streams.push_back(static_cast<int>(i));
+        }
+    }
+    return streams;
+}
+
+const AVStream *XDemuxer::stream(int streamIndex) const {
+    if (streamIndex < 0 || streamIndex >= static_cast<int>(mFormatCtx->nb_streams)) {
+        return nullptr;
+    }
+    return mFormatCtx->streams[streamIndex];
+}
+
+int64_t XDemuxer::duration() const {
+    return mFormatCtx->duration;
+}
+
+void XDemuxer::expect(int streamIndex) {
+    std::lock_guard<std::mutex> lock(mMutex);
+    mExpected.insert(streamIndex);
+}
+
+void XDemuxer::attach(int streamIndex, const std::shared_ptr<XPacketQueue> &queue) {
+    std::lock_guard<std::mutex> lock(mMutex);
+    if (mReadTid) {
+        XLOG(AV_LOG_ERROR, "XDemuxer", "stream %d attached after demuxing started: %s", streamIndex,
+             mFilename.data());
+        queue->putNullPacket(streamIndex);
+        return;
+    }
+
+    mExpected.insert(streamIndex);
+    mQueues[streamIndex] = queue;
+    mFormatCtx->streams[streamIndex]->discard = AVDISCARD_DEFAULT;
+    if (mQueues.size() == mExpected.size()) {
+        mReadTid = std::make_unique<std::thread>([this] { readWorkThread(); });
+    }
+}
+
+void XDemuxer::detach(int streamIndex) {
+    std::lock_guard<std::mutex> lock(mMutex);
+    mQueues.erase(streamIndex);
+    mExpected.erase(streamIndex);
+    if (mQueues.empty()) {
+        mAborted = true;
+    }
+}
+
+void XDemuxer::readWorkThread() {
+    XThreadUtils::configThreadName("demuxThread");
+    XTRACE_THREAD_NAME("demuxThread " + mFilename);
+    XLOG(AV_LOG_INFO, "XDemuxer", "readWorkThread ++++++");
+
+    AVFormatContext *ic = mFormatCtx.get();
+    int ret = 0;
+    while (!mAborted) {
+        auto pkt = std::make_shared<Packet>();
+        {
+            XTRACE_SCOPE("av_read_frame");
+            ret = av_read_frame(ic, pkt->avpkt);
+        }
+        if (ret < 0) {
+            break;
+        }
+
+        // 队列在锁外写入, 解码器 stop 时先中止自己的队列, put 立即返回
+        std::shared_ptr<XPacketQueue> queue;
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            auto it = mQueues.find(pkt->avpkt->stream_index);
+            if (it != mQueues.end()) {
+                queue = it->second;
+            }
+        }
+        if (queue) {
+            ret = dispatch(pkt->avpkt->stream_index, queue, pkt);
+            if (ret < 0) {
+                break;
+            }
+        }
+    }
+
+    if (ret == AVERROR(ENOBUFS)) {
+        XLOG(AV_LOG_ERROR, "XDemuxer", "streams interleaved too coarsely, more than %lld bytes queued on one "
+             "stream: %s", static_cast<long long>(STREAM_QUEUE_MAX_BYTES), mFilename.data());
+    } else if (ret < 0 && ret != AVERROR_EOF) {
+        XLOG(AV_LOG_ERROR, "XDemuxer", "av_read_frame failed: %s: %s", av_err2str(ret), mFilename.data());
+    }
+
+    // 读完或出错都给每一路送一个空包, 各自的解码线程冲洗解码器后结束
+    std::map<int, std::shared_ptr<XPacketQueue>> queues;
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        queues = mQueues;
+    }
+    for (auto &it : queues) {
+        if (ret == AVERROR(ENOBUFS)) {
+            // 满的队列放不下空包, 直接中止, 解码线程取不到包就结束
+            it.second->abort();
+        } else {
+            it.second->putNullPacket(it.first);
+        }
+    }
+
+    XLOG(AV_LOG_INFO, "XDemuxer", "readWorkThread ------");
+}
+
+int XDemuxer::dispatch(int streamIndex, const std::shared_ptr<XPacketQueue> &queue,
+                       const std::shared_ptr<Packet> &pkt) {
+    // 队列满时定时醒来检查: 别的流在等包说明它的包在这一路的后面, 只有加大这一路才能继续
+    const int stallCheckMs = 100;
+    for (;;) {
+        int ret = queue->put(pkt, stallCheckMs);
+        if (ret != AVERROR(EAGAIN)) {
+            // 队列已中止(解码器 stop)时丢掉这个包, 继续给其它流读
+            return 0;
+        }
+        if (mAborted) {
+            return 0;
+        }
+        if (!otherStarved(streamIndex)) {
+            continue;
+        }
+        if (queue->bytes() >= STREAM_QUEUE_MAX_BYTES) {
+            return AVERROR(ENOBUFS);
+        }
+        int capacity = queue->capacity() * 2;
+        queue->setCapacity(capacity);
+        XLOG(AV_LOG_WARNING, "XDemuxer", "stream %d queue grown to %d packets, other streams starved: %s",
+             streamIndex, capacity, mFilename.data());
+    }
+}
+
+bool XDemuxer::otherStarved(int streamIndex) {
+    std::lock_guard<std::mutex> lock(mMutex);
+    for (auto &it : mQueues) {
+        if (it.first != streamIndex && it.second->isStarved()) {
+            return true;
+        }
+    }
+    return false;
+}
@@ -0,0 +1,79 @@
+//
+// Created by Andy on 2020/7/30.
+//
+
+#ifndef MIXER_XDEMUXER_H
+#define MIXER_XDEMUXER_H
+
+#include "XFFHeader.h"
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+class XPacketQueue;
+
+/**
+ * 多轨文件(MOV/MKV 分轨)的共享解封装: 文件只打开和读取一次, 每路音频流的包分发给各自解码器的包队列.
+ *
+ * - 解码器构造时登记要用的流(expect), start 时挂上包队列(attach); 登记过的流都挂上之后才开始读,
+ *   所以需要先把所有流的解码器都构造出来, 再依次 start
+ * - 没有登记的流设为 AVDISCARD_ALL, 解封装器可以直接跳过它们的数据
+ * - 解码器 stop 时摘下自己的队列, 全部摘下后读线程结束
+ * - 只用于本地文件, 不支持直播输入的重连
+ */
+class XDemuxer {
+public:
+    /*
+     * 混音器按块同步地从各路取样本, 某一路的包要等其它路的包解出来才会被取走; 交错粒度内的包都要放得下,
+     * 否则读线程阻塞在这一路的队列上, 其它路拿不到包, 混音线程又在等其它路, 形成死锁. 256 个 AAC 包约 6 秒.
+     * 交错更粗的文件: 读线程等满队列时发现有别的流在等包, 就把满的队列加倍, 直到单路超过
+     * STREAM_QUEUE_MAX_BYTES, 这时报错并结束所有流, 不会一直卡住
+     */
+    static const int STREAM_QUEUE_CAPACITY = 256;
+    static const int64_t STREAM_QUEUE_MAX_BYTES = 64 * 1024 * 1024;
+
+    XDemuxer(const std::string& filename, const std::string& formatHint = std::string());
+
+    ~XDemuxer();
+
+    const std::string& filename() const;
+
+    /* 文件里全部音频流的序号 */
+    std::vector<int> audioStreams() const;
+
+    /* 读线程启动之前只读访问 */
+    const AVStream* stream(int streamIndex) const;
+
+    int64_t duration() const;
+
+    void expect(int streamIndex);
+
+    void attach(int streamIndex, const std::shared_ptr<XPacketQueue>& queue);
+
+    void detach(int streamIndex);
+
+private:
+    void readWorkThread();
+
+    /* 把包放进 streamIndex 的队列; 交错太粗、队列放不下时返回 AVERROR(ENOBUFS) */
+    int dispatch(int streamIndex, const std::shared_ptr<XPacketQueue>& queue, const std::shared_ptr<Packet>& pkt);
+
+    /* 除 streamIndex 以外有解码线程在等包的流 */
+    bool otherStarved(int streamIndex);
+
+private:
+    std::string mFilename;
+    std::unique_ptr<AVFormatContext, InputFormatDeleter> mFormatCtx;
+
+    std::mutex mMutex;
+    std::set<int> mExpected;
+    std::map<int, std::shared_ptr<XPacketQueue>> mQueues;
+    std::unique_ptr<std::thread> mReadTid;
+    std::atomic<bool> mAborted;
+};
+
+#endif //MIXER_XDEMUXER_H
@@ -0,0 +1,76 @@
+//
+// Created by Andy on 2020/7/8.
+//
+
+#include "XDucker.h"
+#include "XMixKernels.h"
+
+#include <algorithm>
+#include <cmath>
+
+XDucker::XDucker(int sampleRate, int channels, const XDuckingOptions &options)
+        : mChannels(channels), mOptions(options), mDelayPos(0), mBlockPeak(0), mBlockFill(0), mReduction(0),
+          mGain(1.0f), mGainStep(0) {
+    // 包络按控制块更新, 系数也按控制块的速率计算
+    double blockRate = static_cast<double>(sampleRate) / CONTROL_BLOCK;
+    mAttackCoeff = static_cast<float>(1.0 - std::exp(-1.0 / (blockRate * mOptions.attackMs / 1000)));
+    mReleaseCoeff = static_cast<float>(1.0 - std::exp(-1.0 / (blockRate * mOptions.releaseMs / 1000)));
+
+    mDelay = std::max(1, static_cast<int>(sampleRate * mOptions.lookaheadMs / 1000));
+    mMixDelay.assign(static_cast<size_t>(mDelay) * channels, 0.0f);
+    mBedDelay.assign(static_cast<size_t>(mDelay) * channels, 0.0f);
+}
+
+void XDucker::process(const float *voice, const float *bed, float *mix, int nbSamples) {
+    int i = 0;
+    while (i < nbSamples) {
+        int count = std::min(nbSamples - i, CONTROL_BLOCK - mBlockFill);
+        mBlockPeak = std::max(mBlockPeak, XMixKernels::peak(voice + i * mChannels, count * mChannels));
+
+        for (int n = i; n < i + count; ++n) {
+            float *mixDelayed = &mMixDelay[static_cast<size_t>(mDelayPos) * mChannels];
+            float *bedDelayed = &mBedDelay[static_cast<size_t>(mDelayPos) * mChannels];
+            for (int c = 0; c < mChannels; ++c) {
+                int index = n * mChannels + c;
+                float in = mix[index];
+                mix[index] = mixDelayed[c] + bedDelayed[c] * mGain;
+                mixDelayed[c] = in;
+                bedDelayed[c] = bed[index];
+            }
+            mDelayPos = mDelayPos + 1 == mDelay ? 0 : mDelayPos + 1;
+            mGain += mGainStep;
+        }
+
+        mBlockFill += count;
+        i += count;
+        if (mBlockFill == CONTROL_BLOCK) {
+            updateGain();
+        }
+    }
+}
+
+void XDucker::updateGain() {
+    // 先由块峰值算出需要的衰减量, 再在 dB 域做 attack/release 平滑, 释放时间与侧链电平无关
+    double target = 0;
+    if (mBlockPeak > 0) {
+        double over = 20 * std::log10(mBlockPeak) - mOptions.thresholdDb;
+        target = std::max(0.0, std::min(1.0, over / mOptions.kneeDb)) * mOptions.rangeDb;
+    }
+    mBlockPeak = 0;
+    mBlockFill = 0;
+
+    float coeff = target > mReduction ? mAttackCoeff : mReleaseCoeff;
+    mReduction += static_cast<float>(target - mReduction) * coeff;
+
+    // 下一个控制块内线性过渡到新的增益, 避免增益阶跃产生的咔哒声
+    float gain = static_cast<float>(std::pow(10.0, -mReduction / 20));
+    mGainStep = (gain - mGain) / CONTROL_BLOCK;
+}
+
+int XDucker::latency() const {
+    return mDelay;
+}
+
+double XDucker::gainReductionDb() const {
+    return mGain > 0 ? -20 * std::log10(mGain) : 0;
+}
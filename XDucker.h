@@ -0,0 +1,67 @@
+//
+// Created by Andy on 2020/7/8.
+//
+
+#ifndef MIXER_XDUCKER_H
+#define MIXER_XDUCKER_H
+
+#include <vector>
+
+struct XDuckingOptions {
+    bool enabled = false;
+
+    /* 人声侧链电平超过门限后开始压低背景, 超过 kneeDb 后达到最大衰减 rangeDb */
+    double thresholdDb = -36.0;
+    double kneeDb = 10.0;
+    double rangeDb = 12.0;
+
+    double attackMs = 15.0;
+    double releaseMs = 400.0;
+
+    /* 前瞻时间: 背景提前开始压低, 整个总线因此延迟同样的时间 */
+    double lookaheadMs = 10.0;
+};
+
+/**
+ * 侧链闪避(ducking): 人声轨道之和作为侧链, 控制背景轨道之和的增益
+ *
+ * 包络检测在控制块(64 个采样点)上进行: 先对侧链做块内峰值(可向量化的归约), 再按块做
+ * attack/release 平滑, 块内对增益线性插值. 开销与轨道数无关, 只和总线长度有关.
+ * 唯一的额外缓冲是两条前瞻长度的延迟线.
+ */
+class XDucker {
+public:
+    XDucker(int sampleRate, int channels, const XDuckingOptions& options);
+
+    /* voice: 侧链; bed: 被压低的轨道之和; mix: 其余轨道之和, 结果(延迟后)写回 mix */
+    void process(const float* voice, const float* bed, float* mix, int nbSamples);
+
+    int latency() const;
+
+    /* 当前的衰减量(dB, 正数) */
+    double gainReductionDb() const;
+
+private:
+    void updateGain();
+
+private:
+    static const int CONTROL_BLOCK = 64;
+
+    int mChannels;
+    XDuckingOptions mOptions;
+    float mAttackCoeff;
+    float mReleaseCoeff;
+
+    int mDelay;
+    std::vector<float> mMixDelay;
+    std::vector<float> mBedDelay;
+    int mDelayPos;
+
+    float mBlockPeak;
+    int mBlockFill;
+    float mReduction;
+    float mGain;
+    float mGainStep;
+};
+
+#endif //MIXER_XDUCKER_H
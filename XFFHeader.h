@@ -16,6 +16,8 @@ extern "C" {
 #include <libavutil/opt.h>
 }
 
+#include <memory>
+
 struct InputFormatDeleter {
     void operator()(AVFormatContext* ic) {
         avformat_close_input(&ic);
@@ -34,6 +36,12 @@ struct CodecDeleter {
     }
 };
 
+struct CodecParametersDeleter {
+    void operator()(AVCodecParameters* par) {
+        avcodec_parameters_free(&par);
+    }
+};
+
 struct SwsContextDeleter {
     void operator()(SwsContext* sws) {
         sws_freeContext(sws);
@@ -51,6 +59,10 @@ struct Packet {
     AVPacket* avpkt = nullptr;
     int flag;
 
+    /* 非空时表示输入在此处重新打开过(直播断线重连), 解码线程需要按新的参数重建解码器 */
+    std::shared_ptr<AVCodecParameters> codecpar;
+    AVRational timeBase = {0, 1};
+
     Packet() {
         this->avpkt = av_packet_alloc();
         av_init_packet(this->avpkt);
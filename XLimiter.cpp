@@ -0,0 +1,84 @@
+//
+// Created by Andy on 2020/7/3.
+//
+
+#include "XLimiter.h"
+
+#include <algorithm>
+#include <cmath>
+
+XLimiter::XLimiter(int sampleRate, int channels, double ceilingDb, double lookaheadMs, double releaseMs)
+        : mChannels(channels), mPeakFilter(channels) {
+    int lookahead = std::max(1, static_cast<int>(sampleRate * lookaheadMs / 1000));
+    mWindow = lookahead + 1;
+    mDelay = lookahead + XTruePeakFilter::DELAY;
+    mCeiling = static_cast<float>(std::pow(10.0, ceilingDb / 20.0));
+    mReleaseCoeff = static_cast<float>(1.0 - std::exp(-1.0 / (sampleRate * releaseMs / 1000)));
+
+    mDelayLine.resize(static_cast<size_t>(mDelay) * channels);
+    mMinValue.resize(mWindow);
+    mMinIndex.resize(mWindow);
+    mBox.resize(mWindow);
+    reset();
+}
+
+void XLimiter::process(const float *in, float *out, int nbSamples) {
+    for (int i = 0; i < nbSamples; ++i, ++mIndex) {
+        const float *frame = in + i * mChannels;
+
+        // 当前点(插值延迟之后)需要的增益
+        float peak = mPeakFilter.push(frame);
+        float required = peak > mCeiling ? mCeiling / peak : 1.0f;
+
+        // 前瞻窗口内的最小增益
+        while (mMinSize > 0 && mMinValue[(mMinHead + mMinSize - 1) % mWindow] >= required) {
+            --mMinSize;
+        }
+        int tail = (mMinHead + mMinSize) % mWindow;
+        mMinValue[tail] = required;
+        mMinIndex[tail] = mIndex;
+        ++mMinSize;
+        if (mMinIndex[mMinHead] <= mIndex - mWindow) {
+            mMinHead = (mMinHead + 1) % mWindow;
+            --mMinSize;
+        }
+        float minimum = mMinValue[mMinHead];
+
+        // 压下去立即生效, 恢复时按释放时间平滑
+        if (minimum < mEnvelope) {
+            mEnvelope = minimum;
+        } else {
+            mEnvelope += (minimum - mEnvelope) * mReleaseCoeff;
+        }
+
+        mBoxSum += mEnvelope - mBox[mBoxPos];
+        mBox[mBoxPos] = mEnvelope;
+        mBoxPos = (mBoxPos + 1) % mWindow;
+        float gain = static_cast<float>(mBoxSum / mWindow);
+
+        float *delayed = &mDelayLine[static_cast<size_t>(mDelayPos) * mChannels];
+        for (int c = 0; c < mChannels; ++c) {
+            float x = frame[c];
+            out[i * mChannels + c] = delayed[c] * gain;
+            delayed[c] = x;
+        }
+        mDelayPos = (mDelayPos + 1) % mDelay;
+    }
+}
+
+int XLimiter::latency() const {
+    return mDelay;
+}
+
+void XLimiter::reset() {
+    mPeakFilter.reset();
+    std::fill(mDelayLine.begin(), mDelayLine.end(), 0.0f);
+    std::fill(mBox.begin(), mBox.end(), 1.0f);
+    mDelayPos = 0;
+    mMinHead = 0;
+    mMinSize = 0;
+    mBoxSum = mWindow;
+    mBoxPos = 0;
+    mEnvelope = 1.0f;
+    mIndex = 0;
+}
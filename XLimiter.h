@@ -0,0 +1,57 @@
+//
+// Created by Andy on 2020/7/3.
+//
+
+#ifndef MIXER_XLIMITER_H
+#define MIXER_XLIMITER_H
+
+#include <vector>
+#include <cstdint>
+#include "XLoudnessMeter.h"
+
+/**
+ * 真峰值限幅器, 放在编码之前保护输出不过载
+ *
+ * 以过采样估算的真峰值计算每个点需要的增益, 在前瞻窗口内取最小值, 经过释放平滑后
+ * 再做一次与前瞻等长的滑动平均, 保证峰值到达时增益已经降到位且没有突变.
+ * 输出相对输入固定延迟 latency() 个采样点, 运行期间不分配内存.
+ */
+class XLimiter {
+public:
+    XLimiter(int sampleRate, int channels, double ceilingDb, double lookaheadMs = 5.0, double releaseMs = 80.0);
+
+    /* 交错排列的 float 样本, in 和 out 可以指向同一块内存 */
+    void process(const float* in, float* out, int nbSamples);
+
+    int latency() const;
+
+    void reset();
+
+private:
+    int mChannels;
+    int mWindow;                          // 前瞻窗口(采样点) + 1
+    int mDelay;                           // 前瞻 + 真峰值插值延迟
+    float mCeiling;
+    float mReleaseCoeff;
+
+    XTruePeakFilter mPeakFilter;
+
+    std::vector<float> mDelayLine;
+    int mDelayPos;
+
+    // 滑动窗口最小值, 单调队列
+    std::vector<float> mMinValue;
+    std::vector<int64_t> mMinIndex;
+    int mMinHead;
+    int mMinSize;
+
+    // 增益的滑动平均
+    std::vector<float> mBox;
+    double mBoxSum;
+    int mBoxPos;
+
+    float mEnvelope;
+    int64_t mIndex;
+};
+
+#endif //MIXER_XLIMITER_H
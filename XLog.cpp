@@ -0,0 +1,133 @@
+//
+// Created by Andy on 2020/7/27.
+//
+
+#include "XLog.h"
+#include "XTelemetry.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdarg>
+#include <cstdio>
+#include <cstring>
+#include <unistd.h>
+
+std::atomic<int> XLog::sLevel(AV_LOG_INFO);
+
+namespace {
+
+    const int64_t FLUSH_DELAY_NS = 200 * 1000000LL;
+    const int64_t START_TIME = XTelemetry::now();
+
+    void writeAll(const char* data, size_t size) {
+        while (size > 0) {
+            ssize_t n = ::write(STDERR_FILENO, data, size);
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return;
+            }
+            data += n;
+            size -= static_cast<size_t>(n);
+        }
+    }
+
+    struct XLogBuffer {
+        char data[8192];
+        size_t size = 0;
+        int64_t firstTime = 0;
+
+        ~XLogBuffer() {
+            flush();
+        }
+
+        void flush() {
+            if (size > 0) {
+                writeAll(data, size);
+                size = 0;
+            }
+        }
+    };
+
+    XLogBuffer& threadBuffer() {
+        static thread_local XLogBuffer buffer;
+        return buffer;
+    }
+
+    char levelChar(int level) {
+        if (level <= AV_LOG_FATAL) {
+            return 'F';
+        } else if (level <= AV_LOG_ERROR) {
+            return 'E';
+        } else if (level <= AV_LOG_WARNING) {
+            return 'W';
+        } else if (level <= AV_LOG_INFO) {
+            return 'I';
+        } else if (level <= AV_LOG_VERBOSE) {
+            return 'V';
+        }
+        return 'D';
+    }
+}
+
+void XLog::setLevel(int level) {
+    sLevel.store(level, std::memory_order_relaxed);
+    av_log_set_level(level);
+}
+
+void XLog::log(int level, const char* tag, uint64_t suppressed, const char* format, ...) {
+    int64_t now = XTelemetry::now();
+    char line[1024];
+    int size = snprintf(line, sizeof(line), "[%9.3f][%c][%s] ", (now - START_TIME) / 1e9, levelChar(level), tag);
+
+    va_list args;
+    va_start(args, format);
+    int n = vsnprintf(line + size, sizeof(line) - size, format, args);
+    va_end(args);
+    size = n < 0 ? size : std::min<int>(size + n, sizeof(line) - 1);
+
+    // 调用方沿用 av_log 的习惯可能自带换行, 统一去掉再补上
+    while (size > 0 && line[size - 1] == '\n') {
+        --size;
+    }
+    if (suppressed > 0) {
+        n = snprintf(line + size, sizeof(line) - size, " (%llu suppressed)", static_cast<unsigned long long>(suppressed));
+        size = n < 0 ? size : std::min<int>(size + n, sizeof(line) - 2);
+    }
+    line[size++] = '\n';
+
+    XLogBuffer& buffer = threadBuffer();
+    if (buffer.size + size > sizeof(buffer.data)) {
+        buffer.flush();
+    }
+    if (buffer.size == 0) {
+        buffer.firstTime = now;
+    }
+    memcpy(buffer.data + buffer.size, line, static_cast<size_t>(size));
+    buffer.size += size;
+
+    if (level <= AV_LOG_INFO || now - buffer.firstTime >= FLUSH_DELAY_NS) {
+        buffer.flush();
+    }
+}
+
+void XLog::flush() {
+    threadBuffer().flush();
+}
+
+XLogRateLimit::XLogRateLimit(int intervalMs)
+        : mInterval(static_cast<int64_t>(intervalMs) * 1000000), mNext(0), mSuppressed(0) {
+}
+
+bool XLogRateLimit::allow(uint64_t* suppressed) {
+    int64_t now = XTelemetry::now();
+    int64_t next = mNext.load(std::memory_order_relaxed);
+    if (now < next || !mNext.compare_exchange_strong(next, now + mInterval, std::memory_order_relaxed)) {
+        mSuppressed.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    *suppressed = mSuppressed.exchange(0, std::memory_order_relaxed);
+    return true;
+}
@@ -0,0 +1,79 @@
+//
+// Created by Andy on 2020/7/27.
+//
+
+#ifndef MIXER_XLOG_H
+#define MIXER_XLOG_H
+
+extern "C" {
+#include <libavutil/log.h>
+}
+
+#include <atomic>
+#include <cstdint>
+
+/**
+ * 日志: 级别沿用 av_log 的 AV_LOG_*, 输出格式为
+ *   [   12.345][W][XDecoder] underrun(3): udp://... (5 suppressed)
+ *
+ * - 编译期级别: 比 XLOG_MIN_LEVEL 更详细的日志整句编译掉(cmake -DMIXER_LOG_LEVEL=48 可以打开 debug)
+ * - 运行期级别: XLog::setLevel, 关闭的级别只多一次 relaxed load, 参数不会被求值
+ * - 每个线程先格式化到自己的缓冲里, 再用一次 write 输出, 不经过 stdio 和 av_log 的锁;
+ *   INFO 及以上立即输出, VERBOSE 以下攒满缓冲或超过 200ms 再输出
+ * - XLOG_EVERY 按调用点限频, 被丢掉的条数附在下一条输出后面
+ */
+#ifndef XLOG_MIN_LEVEL
+#define XLOG_MIN_LEVEL AV_LOG_VERBOSE
+#endif
+
+class XLog {
+public:
+    static bool isEnabled(int level) {
+        return level <= sLevel.load(std::memory_order_relaxed);
+    }
+
+    /* 同时设置 FFmpeg 自己的日志级别 */
+    static void setLevel(int level);
+
+    static void log(int level, const char* tag, uint64_t suppressed, const char* format, ...)
+            __attribute__((format(printf, 4, 5)));
+
+    /* 输出当前线程缓冲里的日志 */
+    static void flush();
+
+private:
+    static std::atomic<int> sLevel;
+};
+
+/* 调用点级别的限频, 多个线程同时调用时只有一个能通过 */
+class XLogRateLimit {
+public:
+    explicit XLogRateLimit(int intervalMs);
+
+    bool allow(uint64_t* suppressed);
+
+private:
+    int64_t mInterval;
+    std::atomic<int64_t> mNext;
+    std::atomic<uint64_t> mSuppressed;
+};
+
+#define XLOG(level, tag, ...) \
+    do { \
+        if ((level) <= XLOG_MIN_LEVEL && XLog::isEnabled(level)) { \
+            XLog::log(level, tag, 0, __VA_ARGS__); \
+        } \
+    } while (0)
+
+#define XLOG_EVERY(intervalMs, level, tag, ...) \
+    do { \
+        if ((level) <= XLOG_MIN_LEVEL && XLog::isEnabled(level)) { \
+            static XLogRateLimit xlogLimit(intervalMs); \
+            uint64_t xlogSuppressed = 0; \
+            if (xlogLimit.allow(&xlogSuppressed)) { \
+                XLog::log(level, tag, xlogSuppressed, __VA_ARGS__); \
+            } \
+        } \
+    } while (0)
+
+#endif //MIXER_XLOG_H
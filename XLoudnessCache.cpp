@@ -0,0 +1,110 @@
+//
+// Created by Andy on 2020/7/3.
+//
+
+#include "XLoudnessCache.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cerrno>
+#include <fstream>
+#include <sstream>
+#include <sys/stat.h>
+#include <unistd.h>
+
+XLoudnessCache::XLoudnessCache(const std::string &path)
+        : mPath(path), mDirty(false) {
+    std::ifstream in(mPath);
+    std::string line;
+    while (std::getline(in, line)) {
+        std::istringstream fields(line);
+        Entry entry;
+        std::string filename;
+        if (!(fields >> entry.size >> entry.mtime >> entry.lufs)) {
+            continue;
+        }
+        fields.get();
+        std::getline(fields, filename);
+        if (!filename.empty()) {
+            mEntries[filename] = entry;
+        }
+    }
+}
+
+bool XLoudnessCache::fileKey(const std::string &filename, int64_t *size, int64_t *mtime) {
+    struct stat st;
+    if (stat(filename.data(), &st) != 0 || !S_ISREG(st.st_mode)) {
+        return false;
+    }
+
+    *size = st.st_size;
+    *mtime = st.st_mtime;
+    return true;
+}
+
+bool XLoudnessCache::lookup(const std::string &filename, double *lufs) const {
+    int64_t size, mtime;
+    auto it = mEntries.find(filename);
+    if (it == mEntries.end() || !fileKey(filename, &size, &mtime)) {
+        return false;
+    }
+
+    if (it->second.size != size || it->second.mtime != mtime) {
+        return false;
+    }
+
+    *lufs = it->second.lufs;
+    return true;
+}
+
+void XLoudnessCache::store(const std::string &filename, double lufs) {
+    Entry entry;
+    if (!fileKey(filename, &entry.size, &entry.mtime)) {
+        return;
+    }
+
+    entry.lufs = lufs;
+    mEntries[filename] = entry;
+    mDirty = true;
+}
+
+int XLoudnessCache::save() {
+    if (!mDirty) {
+        return 0;
+    }
+
+    // 先写临时文件再改名, 避免多个任务同时写坏缓存; 临时文件名每次唯一, 同时保存的任务各写各的
+    std::string tmpPath = mPath + ".XXXXXX";
+    int fd = mkstemp(&tmpPath[0]);
+    if (fd < 0) {
+        return -errno;
+    }
+    fchmod(fd, 0644);
+    close(fd);
+    {
+        std::ofstream out(tmpPath, std::ios::trunc);
+        if (!out) {
+            int ret = -errno;
+            unlink(tmpPath.data());
+            return ret;
+        }
+        out.precision(4);
+        for (auto &it : mEntries) {
+            out << it.second.size << ' ' << it.second.mtime << ' ' << std::fixed << it.second.lufs << ' '
+                << it.first << '\n';
+        }
+        if (!out) {
+            unlink(tmpPath.data());
+            return -EIO;
+        }
+    }
+
+    if (rename(tmpPath.data(), mPath.data()) != 0) {
+        int ret = -errno;
+        unlink(tmpPath.data());
+        return ret;
+    }
+
+    mDirty = false;
+    return 0;
+}
@@ -0,0 +1,41 @@
+//
+// Created by Andy on 2020/7/3.
+//
+
+#ifndef MIXER_XLOUDNESSCACHE_H
+#define MIXER_XLOUDNESSCACHE_H
+
+#include <map>
+#include <string>
+#include <cstdint>
+
+/**
+ * 素材积分响度的持久化缓存, 以路径 + 文件大小 + 修改时间为键,
+ * 文件被改动后自动失效. 每行一条: "<size> <mtime> <lufs> <path>"
+ */
+class XLoudnessCache {
+public:
+    explicit XLoudnessCache(const std::string& path);
+
+    bool lookup(const std::string& filename, double* lufs) const;
+
+    void store(const std::string& filename, double lufs);
+
+    int save();
+
+private:
+    static bool fileKey(const std::string& filename, int64_t* size, int64_t* mtime);
+
+private:
+    struct Entry {
+        int64_t size;
+        int64_t mtime;
+        double lufs;
+    };
+
+    std::string mPath;
+    std::map<std::string, Entry> mEntries;
+    bool mDirty;
+};
+
+#endif //MIXER_XLOUDNESSCACHE_H
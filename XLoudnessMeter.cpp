@@ -0,0 +1,268 @@
+//
+// Created by Andy on 2020/7/2.
+//
+
+#include "XLoudnessMeter.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace {
+
+    struct TruePeakCoefficients {
+        // 每个相位按时间顺序(最旧的样本在前)排列, 直接和历史窗口做点积
+        float taps[XTruePeakFilter::PHASES][XTruePeakFilter::TAPS];
+
+        TruePeakCoefficients() {
+            const int length = XTruePeakFilter::PHASES * XTruePeakFilter::TAPS;
+            const double center = (length - 1) / 2.0;
+            for (int p = 0; p < XTruePeakFilter::PHASES; ++p) {
+                double sum = 0;
+                for (int k = 0; k < XTruePeakFilter::TAPS; ++k) {
+                    int n = k * XTruePeakFilter::PHASES + p;
+                    double x = (n - center) / XTruePeakFilter::PHASES;
+                    double sinc = x == 0 ? 1.0 : std::sin(M_PI * x) / (M_PI * x);
+                    double window = 0.5 - 0.5 * std::cos(2 * M_PI * (n + 0.5) / length);
+                    taps[p][XTruePeakFilter::TAPS - 1 - k] = static_cast<float>(sinc * window);
+                    sum += sinc * window;
+                }
+                for (int k = 0; k < XTruePeakFilter::TAPS; ++k) {
+                    taps[p][k] = static_cast<float>(taps[p][k] / sum);
+                }
+            }
+        }
+    };
+
+    const TruePeakCoefficients &truePeakCoefficients() {
+        static const TruePeakCoefficients coefficients;
+        return coefficients;
+    }
+}
+
+XTruePeakFilter::XTruePeakFilter(int channels)
+        : mChannels(channels), mPos(0), mHistory(static_cast<size_t>(channels) * TAPS * 2, 0.0f) {
+}
+
+float XTruePeakFilter::push(const float *frame) {
+    const TruePeakCoefficients &coefficients = truePeakCoefficients();
+    float peak = 0;
+    for (int c = 0; c < mChannels; ++c) {
+        float *history = &mHistory[c * TAPS * 2];
+        history[mPos] = frame[c];
+        history[mPos + TAPS] = frame[c];
+
+        const float *window = history + mPos + 1;
+        for (int p = 0; p < PHASES; ++p) {
+            float y = 0;
+            for (int k = 0; k < TAPS; ++k) {
+                y += coefficients.taps[p][k] * window[k];
+            }
+            peak = std::max(peak, std::fabs(y));
+        }
+        peak = std::max(peak, std::fabs(window[TAPS - 1 - DELAY]));
+    }
+    mPos = (mPos + 1) % TAPS;
+    return peak;
+}
+
+void XTruePeakFilter::reset() {
+    std::fill(mHistory.begin(), mHistory.end(), 0.0f);
+    mPos = 0;
+}
+
+XLoudnessMeter::XLoudnessMeter(int sampleRate, int channels)
+        : mSampleRate(sampleRate), mChannels(channels), mState(static_cast<size_t>(channels) * 4, 0.0),
+          mSubBlockSize(sampleRate / 10), mSubBlockFill(0), mSubBlockEnergy(0), mRecentEnergy{0, 0, 0, 0},
+          mRecentCount(0), mRecentIndex(0), mHistogramCount(HISTOGRAM_BINS, 0),
+          mHistogramEnergy(HISTOGRAM_BINS, 0.0), mPeakFilter(channels), mTruePeak(0) {
+
+    // BS.1770 K 计权系数, 按采样率重新推导(与 libebur128 相同的参数)
+    double f0 = 1681.974450955533;
+    double G = 3.999843853973347;
+    double Q = 0.7071752369554196;
+    double K = std::tan(M_PI * f0 / sampleRate);
+    double Vh = std::pow(10.0, G / 20.0);
+    double Vb = std::pow(Vh, 0.4996667741545416);
+    double a0 = 1.0 + K / Q + K * K;
+    mShelf.b0 = (Vh + Vb * K / Q + K * K) / a0;
+    mShelf.b1 = 2.0 * (K * K - Vh) / a0;
+    mShelf.b2 = (Vh - Vb * K / Q + K * K) / a0;
+    mShelf.a1 = 2.0 * (K * K - 1.0) / a0;
+    mShelf.a2 = (1.0 - K / Q + K * K) / a0;
+
+    f0 = 38.13547087602444;
+    Q = 0.5003270373238773;
+    K = std::tan(M_PI * f0 / sampleRate);
+    a0 = 1.0 + K / Q + K * K;
+    mHighPass.b0 = 1.0;
+    mHighPass.b1 = -2.0;
+    mHighPass.b2 = 1.0;
+    mHighPass.a1 = 2.0 * (K * K - 1.0) / a0;
+    mHighPass.a2 = (1.0 - K / Q + K * K) / a0;
+}
+
+template<int C>
+double XLoudnessMeter::filterBlock(const float *samples, int nbSamples) {
+    // 声道数是编译期常量, 内层循环展开后各声道的滤波互不依赖, 可以并行计算
+    double s[C][4];
+    for (int c = 0; c < C; ++c) {
+        for (int k = 0; k < 4; ++k) {
+            s[c][k] = mState[c * 4 + k];
+        }
+    }
+
+    const Biquad f1 = mShelf;
+    const Biquad f2 = mHighPass;
+    double energy[C] = {0};
+    for (int i = 0; i < nbSamples; ++i) {
+        for (int c = 0; c < C; ++c) {
+            double x = samples[i * C + c];
+            double y1 = f1.b0 * x + s[c][0];
+            s[c][0] = f1.b1 * x - f1.a1 * y1 + s[c][1];
+            s[c][1] = f1.b2 * x - f1.a2 * y1;
+            double y2 = f2.b0 * y1 + s[c][2];
+            s[c][2] = f2.b1 * y1 - f2.a1 * y2 + s[c][3];
+            s[c][3] = f2.b2 * y1 - f2.a2 * y2;
+            energy[c] += y2 * y2;
+        }
+    }
+
+    double total = 0;
+    for (int c = 0; c < C; ++c) {
+        for (int k = 0; k < 4; ++k) {
+            mState[c * 4 + k] = s[c][k];
+        }
+        total += energy[c];
+    }
+    return total;
+}
+
+double XLoudnessMeter::filterBlockGeneric(const float *samples, int nbSamples) {
+    double total = 0;
+    for (int c = 0; c < mChannels; ++c) {
+        double *s = &mState[c * 4];
+        for (int i = 0; i < nbSamples; ++i) {
+            double x = samples[i * mChannels + c];
+            double y1 = mShelf.b0 * x + s[0];
+            s[0] = mShelf.b1 * x - mShelf.a1 * y1 + s[1];
+            s[1] = mShelf.b2 * x - mShelf.a2 * y1;
+            double y2 = mHighPass.b0 * y1 + s[2];
+            s[2] = mHighPass.b1 * y1 - mHighPass.a1 * y2 + s[3];
+            s[3] = mHighPass.b2 * y1 - mHighPass.a2 * y2;
+            total += y2 * y2;
+        }
+    }
+    return total;
+}
+
+void XLoudnessMeter::process(const float *samples, int nbSamples) {
+    for (int i = 0; i < nbSamples; ++i) {
+        mTruePeak = std::max(mTruePeak, mPeakFilter.push(samples + i * mChannels));
+    }
+
+    while (nbSamples > 0) {
+        int count = std::min(nbSamples, mSubBlockSize - mSubBlockFill);
+        switch (mChannels) {
+            case 1:
+                mSubBlockEnergy += filterBlock<1>(samples, count);
+                break;
+            case 2:
+                mSubBlockEnergy += filterBlock<2>(samples, count);
+                break;
+            default:
+                mSubBlockEnergy += filterBlockGeneric(samples, count);
+                break;
+        }
+
+        mSubBlockFill += count;
+        samples += count * mChannels;
+        nbSamples -= count;
+
+        if (mSubBlockFill == mSubBlockSize) {
+            finishSubBlock();
+        }
+    }
+}
+
+void XLoudnessMeter::finishSubBlock() {
+    mRecentEnergy[mRecentIndex] = mSubBlockEnergy / mSubBlockSize;
+    mRecentIndex = (mRecentIndex + 1) % 4;
+    mRecentCount = std::min(mRecentCount + 1, 4);
+    mSubBlockEnergy = 0;
+    mSubBlockFill = 0;
+
+    if (mRecentCount < 4) {
+        return;
+    }
+
+    // 400ms 门限块, 每 100ms 出一个
+    double energy = (mRecentEnergy[0] + mRecentEnergy[1] + mRecentEnergy[2] + mRecentEnergy[3]) / 4;
+    if (energy <= 0) {
+        return;
+    }
+
+    double loudness = -0.691 + 10 * std::log10(energy);
+    if (loudness < -70.0) {
+        return;
+    }
+
+    int bin = std::min(HISTOGRAM_BINS - 1, static_cast<int>((loudness + 70.0) * 10));
+    mHistogramCount[bin]++;
+    mHistogramEnergy[bin] += energy;
+}
+
+double XLoudnessMeter::integratedLoudness() const {
+    uint64_t count = 0;
+    double energy = 0;
+    for (int i = 0; i < HISTOGRAM_BINS; ++i) {
+        count += mHistogramCount[i];
+        energy += mHistogramEnergy[i];
+    }
+    if (count == 0) {
+        return -HUGE_VAL;
+    }
+
+    double relativeGate = -0.691 + 10 * std::log10(energy / count) - 10.0;
+    int first = std::max(0, static_cast<int>((relativeGate + 70.0) * 10));
+
+    count = 0;
+    energy = 0;
+    for (int i = first; i < HISTOGRAM_BINS; ++i) {
+        count += mHistogramCount[i];
+        energy += mHistogramEnergy[i];
+    }
+    if (count == 0) {
+        return -HUGE_VAL;
+    }
+
+    return -0.691 + 10 * std::log10(energy / count);
+}
+
+double XLoudnessMeter::momentaryLoudness() const {
+    if (mRecentCount == 0) {
+        return -HUGE_VAL;
+    }
+
+    double energy = 0;
+    for (int i = 0; i < mRecentCount; ++i) {
+        energy += mRecentEnergy[i];
+    }
+    energy /= mRecentCount;
+    return energy > 0 ? -0.691 + 10 * std::log10(energy) : -HUGE_VAL;
+}
+
+double XLoudnessMeter::truePeak() const {
+    return mTruePeak > 0 ? 20 * std::log10(mTruePeak) : -HUGE_VAL;
+}
+
+void XLoudnessMeter::reset() {
+    std::fill(mState.begin(), mState.end(), 0.0);
+    std::fill(mHistogramCount.begin(), mHistogramCount.end(), 0);
+    std::fill(mHistogramEnergy.begin(), mHistogramEnergy.end(), 0.0);
+    mSubBlockFill = 0;
+    mSubBlockEnergy = 0;
+    mRecentCount = 0;
+    mRecentIndex = 0;
+    mPeakFilter.reset();
+    mTruePeak = 0;
+}
@@ -0,0 +1,94 @@
+//
+// Created by Andy on 2020/7/2.
+//
+
+#ifndef MIXER_XLOUDNESSMETER_H
+#define MIXER_XLOUDNESSMETER_H
+
+#include <vector>
+#include <cstdint>
+
+/**
+ * 4 倍过采样的真峰值(inter-sample peak)估算, 48 阶加窗 sinc 多相插值
+ */
+class XTruePeakFilter {
+public:
+    static const int TAPS = 12;           // 每个相位的阶数
+    static const int PHASES = 4;
+    static const int DELAY = TAPS / 2;    // 插值结果相对输入的延迟(采样点)
+
+    explicit XTruePeakFilter(int channels);
+
+    /* 输入一个采样点的所有声道, 返回该点附近过采样后所有声道的最大绝对值 */
+    float push(const float* frame);
+
+    void reset();
+
+private:
+    int mChannels;
+    int mPos;
+    std::vector<float> mHistory;          // 每个声道 2 * TAPS, 同一个样本写两份, 读取时总是连续的
+};
+
+/**
+ * ITU-R BS.1770-4 / EBU R128 响度测量
+ *
+ * K 计权(高架 + 高通两级 biquad) 后按 100ms 子块累计能量, 400ms 门限块 75% 重叠,
+ * 绝对门限 -70 LUFS, 相对门限 -10 LU. 门限块能量按 0.1 LU 分桶统计, 内存占用与时长无关.
+ * 所有声道权重为 1.0, 适用于单声道/立体声总线.
+ */
+class XLoudnessMeter {
+public:
+    XLoudnessMeter(int sampleRate, int channels);
+
+    /* 输入交错排列的 float 样本, nbSamples 为采样点个数 */
+    void process(const float* samples, int nbSamples);
+
+    /* 积分响度(LUFS), 没有有效门限块时返回 -HUGE_VAL */
+    double integratedLoudness() const;
+
+    /* 最近 400ms 的瞬时响度(LUFS) */
+    double momentaryLoudness() const;
+
+    /* 真峰值(dBTP) */
+    double truePeak() const;
+
+    void reset();
+
+private:
+    struct Biquad {
+        double b0, b1, b2, a1, a2;
+    };
+
+    template<int C>
+    double filterBlock(const float* samples, int nbSamples);
+
+    double filterBlockGeneric(const float* samples, int nbSamples);
+
+    void finishSubBlock();
+
+private:
+    static const int HISTOGRAM_BINS = 1000;   // [-70, +30) LUFS, 0.1 LU 一个桶
+
+    int mSampleRate;
+    int mChannels;
+
+    Biquad mShelf;
+    Biquad mHighPass;
+    std::vector<double> mState;           // 每个声道 4 个状态量(两级 biquad, DF2T)
+
+    int mSubBlockSize;
+    int mSubBlockFill;
+    double mSubBlockEnergy;
+    double mRecentEnergy[4];
+    int mRecentCount;
+    int mRecentIndex;
+
+    std::vector<uint64_t> mHistogramCount;
+    std::vector<double> mHistogramEnergy;
+
+    XTruePeakFilter mPeakFilter;
+    float mTruePeak;
+};
+
+#endif //MIXER_XLOUDNESSMETER_H
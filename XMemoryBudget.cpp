@@ -0,0 +1,199 @@
+//
+// Created by Andy on 2020/8/12.
+//
+
+#include "XMemoryBudget.h"
+#include "XLog.h"
+#include "XSampleQueue.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace {
+    /* 不设上限时每路的默认大小, 和原来固定的 64KB 样本缓冲一致 */
+    const int DEFAULT_RING_BYTES = 64 * 1024;
+
+    const double MIN_SECONDS = 0.1;
+    const double MAX_SECONDS = 4.0;
+    const double MIN_WEIGHT = 0.25;
+    const double MAX_WEIGHT = 8.0;
+
+    const int MIN_PACKETS = 4;
+    const int MAX_PACKETS = 512;
+
+    /* 码率和包率未知时按 320kbps、每秒 50 包估算 */
+    const int64_t DEFAULT_BYTES_PER_SECOND = 40000;
+    const double DEFAULT_PACKETS_PER_SECOND = 50;
+
+    const int64_t REBALANCE_INTERVAL_NS = 1000000000LL;
+
+    /* 和 rbuf_create 一样按页取整, 分配和统计的大小就是实际缓冲区的大小 */
+    int roundToPage(double bytes) {
+        const int page = rbuf_page_size();
+        return static_cast<int>(std::ceil(bytes / page)) * page;
+    }
+}
+
+XMemoryBudget& XMemoryBudget::instance() {
+    static XMemoryBudget budget;
+    return budget;
+}
+
+XMemoryBudget::XMemoryBudget()
+        : mNextId(0), mLimit(0), mCache(0), mUsed(0), mPeak(0), mGrows(0), mShrinks(0), mLastRebalance(0) {
+}
+
+void XMemoryBudget::setLimit(int64_t bytes) {
+    std::lock_guard<std::mutex> lock(mMutex);
+    mLimit = std::max<int64_t>(0, bytes);
+    rebalance(false);
+}
+
+int XMemoryBudget::addInput(int pcmBytesPerSecond, int64_t bytesPerSecond, double packetsPerSecond,
+                            int minRingBytes, bool resizable) {
+    std::lock_guard<std::mutex> lock(mMutex);
+    int id = mNextId++;
+    XInput& input = mInputs[id];
+    input.pcmBytesPerSecond = pcmBytesPerSecond;
+    input.bytesPerSecond = bytesPerSecond > 0 ? bytesPerSecond : DEFAULT_BYTES_PER_SECOND;
+    input.packetsPerSecond = packetsPerSecond > 0 ? packetsPerSecond : DEFAULT_PACKETS_PER_SECOND;
+    input.minRingBytes = minRingBytes;
+    input.resizable = resizable;
+    rebalance(false);
+    return id;
+}
+
+void XMemoryBudget::removeInput(int id) {
+    std::lock_guard<std::mutex> lock(mMutex);
+    mInputs.erase(id);
+    rebalance(false);
+    updateUsage();
+}
+
+XMemoryBudget::XPlan XMemoryBudget::plan(int id) const {
+    std::lock_guard<std::mutex> lock(mMutex);
+    auto it = mInputs.find(id);
+    return it != mInputs.end() ? it->second.plan : XPlan();
+}
+
+XMemoryBudget::XPlan XMemoryBudget::update(int id, int64_t ringBytes, int64_t queueBytes, uint64_t starved,
+                                           uint64_t idle) {
+    std::lock_guard<std::mutex> lock(mMutex);
+    auto it = mInputs.find(id);
+    if (it == mInputs.end()) {
+        return XPlan();
+    }
+    XInput& input = it->second;
+    // 解码器真正换了缓冲区时才计数, 分配变了但还没换(样本没降下来)的不算
+    if (input.ringBytes > 0 && ringBytes > input.ringBytes) {
+        ++mGrows;
+    } else if (input.ringBytes > 0 && ringBytes < input.ringBytes) {
+        ++mShrinks;
+    }
+    input.ringBytes = ringBytes;
+    input.queueBytes = queueBytes;
+    input.starved = starved;
+    input.idle = idle;
+    updateUsage();
+
+    int64_t now = XTelemetry::now();
+    if (now - mLastRebalance >= REBALANCE_INTERVAL_NS) {
+        mLastRebalance = now;
+        rebalance(true);
+    }
+    return input.plan;
+}
+
+void XMemoryBudget::addCache(int64_t bytes) {
+    std::lock_guard<std::mutex> lock(mMutex);
+    mCache += bytes;
+    updateUsage();
+}
+
+XMemoryBudgetStats XMemoryBudget::stats() const {
+    std::lock_guard<std::mutex> lock(mMutex);
+    XMemoryBudgetStats stats;
+    stats.limit = mLimit;
+    stats.used = mUsed;
+    stats.peak = mPeak;
+    stats.cache = mCache;
+    stats.inputs = static_cast<int>(mInputs.size());
+    stats.grows = mGrows;
+    stats.shrinks = mShrinks;
+    for (auto& it : mInputs) {
+        stats.planned += it.second.plan.ringBytes +
+                         static_cast<int64_t>(it.second.plan.packetCapacity * it.second.bytesPerSecond /
+                                              it.second.packetsPerSecond);
+    }
+    return stats;
+}
+
+void XMemoryBudget::rebalance(bool adjust) {
+    // 等过样本的输入加大, 只在等缓冲区空间的输入慢慢减小
+    if (adjust) {
+        for (auto& it : mInputs) {
+            XInput& input = it.second;
+            if (input.starved > input.lastStarved) {
+                input.weight = std::min(MAX_WEIGHT, input.weight * 2);
+            } else if (input.idle > input.lastIdle) {
+                input.weight = std::max(MIN_WEIGHT, input.weight * 0.8);
+            }
+            input.lastStarved = input.starved;
+            input.lastIdle = input.idle;
+        }
+    }
+
+    // 每单位权重分到的秒数: 有上限时固定大小的输入和共享素材缓存先扣掉, 剩下的按权重和每秒成本分摊;
+    // 不设上限时每路按自己的 PCM 字节率换算出默认大小
+    double secondsPerWeight = 0;
+    if (mLimit > 0) {
+        double available = static_cast<double>(mLimit - mCache);
+        double cost = 0;
+        for (auto& it : mInputs) {
+            const XInput& input = it.second;
+            if (input.resizable) {
+                cost += input.weight * (input.pcmBytesPerSecond + input.bytesPerSecond);
+            } else {
+                available -= roundToPage(input.minRingBytes);
+            }
+        }
+        secondsPerWeight = cost > 0 ? std::max(0.0, available) / cost : MAX_SECONDS;
+    }
+
+    bool overBudget = false;
+    for (auto& it : mInputs) {
+        XInput& input = it.second;
+        double baseSeconds = DEFAULT_RING_BYTES / input.pcmBytesPerSecond;
+        XPlan plan;
+        if (input.resizable) {
+            double seconds = mLimit > 0 ? secondsPerWeight * input.weight : baseSeconds * input.weight;
+            seconds = std::min(MAX_SECONDS, std::max(MIN_SECONDS, seconds));
+            if (mLimit <= 0) {
+                seconds = std::max(seconds, baseSeconds);
+            }
+            overBudget = overBudget || (mLimit > 0 && seconds <= MIN_SECONDS);
+            plan.ringBytes = roundToPage(std::max<double>(input.minRingBytes, seconds * input.pcmBytesPerSecond));
+            plan.packetCapacity = std::min(MAX_PACKETS, std::max(MIN_PACKETS,
+                    static_cast<int>(std::ceil(seconds * input.packetsPerSecond))));
+        } else {
+            plan.ringBytes = roundToPage(input.minRingBytes);
+            plan.packetCapacity = input.plan.packetCapacity > 0 ? input.plan.packetCapacity :
+                                  static_cast<int>(std::ceil(baseSeconds * input.packetsPerSecond));
+        }
+        input.plan = plan;
+    }
+
+    if (overBudget) {
+        XLOG_EVERY(10000, AV_LOG_WARNING, "XMemoryBudget", "budget %lld bytes too small for %zu inputs, "
+                   "buffers at minimum", static_cast<long long>(mLimit), mInputs.size());
+    }
+}
+
+void XMemoryBudget::updateUsage() {
+    int64_t used = mCache;
+    for (auto& it : mInputs) {
+        used += it.second.ringBytes + it.second.queueBytes;
+    }
+    mUsed = used;
+    mPeak = std::max(mPeak, used);
+}
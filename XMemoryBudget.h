@@ -0,0 +1,97 @@
+//
+// Created by Andy on 2020/8/12.
+//
+
+#ifndef MIXER_XMEMORYBUDGET_H
+#define MIXER_XMEMORYBUDGET_H
+
+#include "XTelemetry.h"
+#include <cstdint>
+#include <map>
+#include <mutex>
+
+/**
+ * 进程内的内存预算: 按输入路数、各路码率和等待情况分配每个解码器的样本缓冲和包队列.
+ *
+ * - 每路输入按"缓冲多少秒"分配, 一秒的成本是一秒 PCM 加一秒压缩数据; 有上限时按权重分摊上限减去共享素材缓存后的部分
+ * - 混音线程等过某一路样本时这一路权重翻倍, 解码线程总在等缓冲区空间(跑在前面)时权重慢慢降低
+ * - 不设上限时各路不低于默认大小, 只有等样本的输入会加大
+ * - 直播输入的缓冲由目标延迟决定, 只计入占用, 不参与调整
+ * - 解码线程定期调用 update 报告占用并取回自己的大小, 两帧之间按它调整, 重新分配最多每秒一次;
+ *   缩小时解码器先按新的大小限制写入, 样本降下来后才换缓冲区, 统计里的加大/缩小次数按实际换的次数计
+ */
+class XMemoryBudget {
+public:
+    struct XPlan {
+        int ringBytes = 0;
+        int packetCapacity = 0;
+    };
+
+    static XMemoryBudget& instance();
+
+    /* 0 表示不限制 */
+    void setLimit(int64_t bytes);
+
+    /*
+     * 登记一路输入, 返回编号. pcmBytesPerSecond 为样本缓冲里每秒 PCM 的字节数, bytesPerSecond 为压缩码率,
+     * packetsPerSecond 为每秒的包数, 后两个未知时给 0; minRingBytes 为样本缓冲的下限;
+     * resizable 为 false 时大小固定为 minRingBytes. 分配的样本缓冲大小按 rbuf_page_size 取整, 和实际创建的一致
+     */
+    int addInput(int pcmBytesPerSecond, int64_t bytesPerSecond, double packetsPerSecond, int minRingBytes,
+                 bool resizable);
+
+    void removeInput(int id);
+
+    /* 登记时分配的大小 */
+    XPlan plan(int id) const;
+
+    /*
+     * 报告这一路当前的占用和累计等待次数, 返回它现在应该用的大小.
+     * starved 为混音线程等这一路样本的次数, idle 为解码线程等缓冲区空间的次数
+     */
+    XPlan update(int id, int64_t ringBytes, int64_t queueBytes, uint64_t starved, uint64_t idle);
+
+    /* 共享素材缓存的增减, 只计入占用, 从可分配的预算里扣除 */
+    void addCache(int64_t bytes);
+
+    XMemoryBudgetStats stats() const;
+
+private:
+    XMemoryBudget();
+
+    struct XInput {
+        double pcmBytesPerSecond = 0;
+        int64_t bytesPerSecond = 0;
+        double packetsPerSecond = 0;
+        int minRingBytes = 0;
+        bool resizable = true;
+
+        int64_t ringBytes = 0;
+        int64_t queueBytes = 0;
+        uint64_t starved = 0;
+        uint64_t idle = 0;
+        uint64_t lastStarved = 0;
+        uint64_t lastIdle = 0;
+        double weight = 1.0;
+        XPlan plan;
+    };
+
+    /* 调用时持有 mMutex; adjust 为 true 时先按这段时间的等待情况调整权重 */
+    void rebalance(bool adjust);
+
+    void updateUsage();
+
+private:
+    mutable std::mutex mMutex;
+    std::map<int, XInput> mInputs;
+    int mNextId;
+    int64_t mLimit;
+    int64_t mCache;
+    int64_t mUsed;
+    int64_t mPeak;
+    uint64_t mGrows;
+    uint64_t mShrinks;
+    int64_t mLastRebalance;
+};
+
+#endif //MIXER_XMEMORYBUDGET_H
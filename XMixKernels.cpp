@@ -0,0 +1,221 @@
+//
+// Created by Andy on 2020/7/2.
+//
+
+#include "XMixKernels.h"
+#include "XFFHeader.h"
+
+#include <cfloat>
+#include <cmath>
+#include <cstring>
+#include <type_traits>
+
+namespace {
+
+    inline float toFloat(int16_t v) {
+        return v * (1.0f / 32768.0f);
+    }
+
+    inline float toFloat(int32_t v) {
+        return v * (1.0f / 2147483648.0f);
+    }
+
+    inline float toFloat(float v) {
+        return v;
+    }
+
+    inline int16_t toS16(float v) {
+        v = v * 32768.0f;
+        v = v > 32767.0f ? 32767.0f : (v < -32768.0f ? -32768.0f : v);
+        return static_cast<int16_t>(v + (v < 0 ? -0.5f : 0.5f));
+    }
+
+    /* 各声道布局到立体声的缩混, 声道顺序和 FFmpeg 一致: FL FR FC LFE SL/BL SR/BR */
+    template<int Channels>
+    struct XDownmix;
+
+    template<>
+    struct XDownmix<1> {
+        static void apply(const float* in, float* left, float* right) {
+            *left = *right = in[0] * static_cast<float>(M_SQRT1_2);
+        }
+    };
+
+    template<>
+    struct XDownmix<2> {
+        static void apply(const float* in, float* left, float* right) {
+            *left = in[0];
+            *right = in[1];
+        }
+    };
+
+    template<>
+    struct XDownmix<6> {
+        static void apply(const float* in, float* left, float* right) {
+            // 低音声道不参与缩混, 每边的系数和为 1 + 2 * 0.7071, 归一化避免削波
+            const float mix = static_cast<float>(M_SQRT1_2);
+            const float norm = 1.0f / (1.0f + 2 * mix);
+            *left = (in[0] + mix * in[2] + mix * in[4]) * norm;
+            *right = (in[1] + mix * in[2] + mix * in[5]) * norm;
+        }
+    };
+
+    template<typename T, bool Planar, int Channels>
+    void convertFrame(const uint8_t* const* src, int16_t* dst, int nbSamples) {
+        // 交错的 S16 立体声和输出格式相同, 直接拷贝
+        if (std::is_same<T, int16_t>::value && !Planar && Channels == 2) {
+            memcpy(dst, src[0], static_cast<size_t>(nbSamples) * 2 * sizeof(int16_t));
+            return;
+        }
+
+        for (int i = 0; i < nbSamples; ++i) {
+            float in[Channels];
+            for (int c = 0; c < Channels; ++c) {
+                in[c] = Planar ? toFloat(reinterpret_cast<const T*>(src[c])[i])
+                               : toFloat(reinterpret_cast<const T*>(src[0])[i * Channels + c]);
+            }
+            float left, right;
+            XDownmix<Channels>::apply(in, &left, &right);
+            dst[i * 2] = toS16(left);
+            dst[i * 2 + 1] = toS16(right);
+        }
+    }
+
+    struct XConverterEntry {
+        int format;
+        int channels;
+        XMixKernels::ConvertFunc func;
+    };
+
+#define XCONVERTER_ENTRIES(format, type, planar) \
+    {format, 1, &convertFrame<type, planar, 1>}, \
+    {format, 2, &convertFrame<type, planar, 2>}, \
+    {format, 6, &convertFrame<type, planar, 6>}
+
+    const XConverterEntry CONVERTERS[] = {
+            XCONVERTER_ENTRIES(AV_SAMPLE_FMT_S16, int16_t, false),
+            XCONVERTER_ENTRIES(AV_SAMPLE_FMT_S16P, int16_t, true),
+            XCONVERTER_ENTRIES(AV_SAMPLE_FMT_S32, int32_t, false),
+            XCONVERTER_ENTRIES(AV_SAMPLE_FMT_S32P, int32_t, true),
+            XCONVERTER_ENTRIES(AV_SAMPLE_FMT_FLT, float, false),
+            XCONVERTER_ENTRIES(AV_SAMPLE_FMT_FLTP, float, true),
+    };
+
+#undef XCONVERTER_ENTRIES
+}
+
+namespace XMixKernels {
+
+    void s16ToFloat(const int16_t* src, float* dst, int count) {
+        const float scale = 1.0f / 32768.0f;
+        for (int i = 0; i < count; ++i) {
+            dst[i] = src[i] * scale;
+        }
+    }
+
+    void floatToS16(const float* src, int16_t* dst, int count) {
+        for (int i = 0; i < count; ++i) {
+            float v = src[i] * 32768.0f;
+            v = v > 32767.0f ? 32767.0f : (v < -32768.0f ? -32768.0f : v);
+            dst[i] = static_cast<int16_t>(v);
+        }
+    }
+
+    void accumulate(float* dst, const float* src, float gain, int count) {
+        for (int i = 0; i < count; ++i) {
+            dst[i] += src[i] * gain;
+        }
+    }
+
+    void applyGain(float* buf, float gain, int count) {
+        for (int i = 0; i < count; ++i) {
+            buf[i] *= gain;
+        }
+    }
+
+    float peak(const float* src, int count) {
+        // 去掉符号位后, 非负 float 的位模式和数值大小顺序一致, 按整数取最大值可以直接向量化
+        uint32_t result = 0;
+        for (int i = 0; i < count; ++i) {
+            uint32_t bits;
+            memcpy(&bits, &src[i], sizeof(bits));
+            bits &= 0x7fffffffu;
+            result = bits > result ? bits : result;
+        }
+
+        float value;
+        memcpy(&value, &result, sizeof(value));
+        return value;
+    }
+
+    int peakS16(const int16_t* src, int count) {
+        int result = 0;
+        for (int i = 0; i < count; ++i) {
+            int v = src[i];
+            v = v < 0 ? -v : v;
+            result = v > result ? v : result;
+        }
+        return result;
+    }
+
+    void summarizeStereo(const float* src, int nbSamples, float* mins, float* maxs, float* sumSqs) {
+        // 部分结果的路数是声道数的整数倍, 第 j 路始终对应声道 j % 2
+        const int lanes = 8;
+        float lo[lanes];
+        float hi[lanes];
+        float sq[lanes];
+        for (int j = 0; j < lanes; ++j) {
+            lo[j] = FLT_MAX;
+            hi[j] = -FLT_MAX;
+            sq[j] = 0.0f;
+        }
+
+        int count = nbSamples * 2;
+        int i = 0;
+        for (; i + lanes <= count; i += lanes) {
+            for (int j = 0; j < lanes; ++j) {
+                float v = src[i + j];
+                lo[j] = v < lo[j] ? v : lo[j];
+                hi[j] = v > hi[j] ? v : hi[j];
+                sq[j] += v * v;
+            }
+        }
+        for (int j = 0; i < count; ++i, ++j) {
+            float v = src[i];
+            lo[j] = v < lo[j] ? v : lo[j];
+            hi[j] = v > hi[j] ? v : hi[j];
+            sq[j] += v * v;
+        }
+
+        for (int c = 0; c < 2; ++c) {
+            mins[c] = FLT_MAX;
+            maxs[c] = -FLT_MAX;
+            sumSqs[c] = 0.0f;
+            for (int j = c; j < lanes; j += 2) {
+                mins[c] = lo[j] < mins[c] ? lo[j] : mins[c];
+                maxs[c] = hi[j] > maxs[c] ? hi[j] : maxs[c];
+                sumSqs[c] += sq[j];
+            }
+        }
+    }
+
+    ConvertFunc findConverter(int format, uint64_t channelLayout) {
+        int channels;
+        if (channelLayout == AV_CH_LAYOUT_MONO) {
+            channels = 1;
+        } else if (channelLayout == AV_CH_LAYOUT_STEREO) {
+            channels = 2;
+        } else if (channelLayout == AV_CH_LAYOUT_5POINT1 || channelLayout == AV_CH_LAYOUT_5POINT1_BACK) {
+            channels = 6;
+        } else {
+            return nullptr;
+        }
+
+        for (auto& entry : CONVERTERS) {
+            if (entry.format == format && entry.channels == channels) {
+                return entry.func;
+            }
+        }
+        return nullptr;
+    }
+}
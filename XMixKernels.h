@@ -0,0 +1,53 @@
+//
+// Created by Andy on 2020/7/2.
+//
+
+#ifndef MIXER_XMIXKERNELS_H
+#define MIXER_XMIXKERNELS_H
+
+#include <cstdint>
+
+/*
+ * 混音热路径上的样本处理函数, 都按交错(interleaved)排列的样本处理,
+ * count 为样本个数(采样点 * 声道数), 循环体保持简单, 便于编译器自动向量化
+ */
+namespace XMixKernels {
+
+    /* S16 -> float, 范围 [-1, 1) */
+    void s16ToFloat(const int16_t* src, float* dst, int count);
+
+    /* float -> S16, 超出范围的部分截断 */
+    void floatToS16(const float* src, int16_t* dst, int count);
+
+    /* dst += src * gain */
+    void accumulate(float* dst, const float* src, float gain, int count);
+
+    /* buf *= gain */
+    void applyGain(float* buf, float gain, int count);
+
+    /* max(|src[i]|) */
+    float peak(const float* src, int count);
+
+    /* max(|src[i]|), 返回 int, -32768 的绝对值不会溢出; 0 表示数字静音 */
+    int peakS16(const int16_t* src, int count);
+
+    /*
+     * 交错立体声的最小值、最大值和平方和, nbSamples 为采样点数, 结果按声道写到 mins/maxs/sumSqs 的 [0] 和 [1].
+     * 按 8 路部分结果(4 个采样点 x 2 声道)分别归约, 不需要 -ffast-math 也能向量化
+     */
+    void summarizeStereo(const float* src, int nbSamples, float* mins, float* maxs, float* sumSqs);
+
+    /*
+     * 把一帧解码输出转成交错的 S16 立体声, 不做重采样. src 为各声道平面(交错格式只用 src[0]),
+     * nbSamples 为采样点数; 缩混系数和 swr 的默认矩阵一致: 单声道每边 -3dB, 5.1 的中置和环绕 -3dB 后归一化
+     */
+    typedef void (*ConvertFunc)(const uint8_t* const* src, int16_t* dst, int nbSamples);
+
+    /*
+     * 按输入的样本格式(AVSampleFormat)和声道布局选出编译期特化的内核: 单声道/立体声/5.1 x S16/S32/FLT 的
+     * 交错和平面格式. 其它组合返回空, 调用方改用 swr
+     */
+    ConvertFunc findConverter(int format, uint64_t channelLayout);
+}
+
+#endif //MIXER_XMIXKERNELS_H
@@ -0,0 +1,114 @@
+//
+// Created by Andy on 2020/8/3.
+//
+
+#include "XMixPool.h"
+#include "XThreadUtils.h"
+#include "XTrace.h"
+
+#include <algorithm>
+
+XMixPool::XMixPool(int threads)
+        : mThreads(std::max(1, threads)), mNext(0), mPending(0), mGeneration(0), mCount(0), mTask(nullptr),
+          mAborted(false) {
+    for (int i = 1; i < mThreads; ++i) {
+        mWorkers.emplace_back([this] { workThread(); });
+    }
+}
+
+XMixPool::~XMixPool() {
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mAborted = true;
+    }
+    mCond.notify_all();
+    for (auto& worker : mWorkers) {
+        if (worker.joinable()) {
+            worker.join();
+        }
+    }
+}
+
+int XMixPool::threads() const {
+    return mThreads;
+}
+
+void XMixPool::run(int count, const std::function<void(int)>& task) {
+    if (count <= 0) {
+        return;
+    }
+    if (mWorkers.empty() || count == 1) {
+        for (int i = 0; i < count; ++i) {
+            task(i);
+        }
+        return;
+    }
+
+    uint32_t generation;
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        generation = ++mGeneration;
+        mCount = count;
+        mTask = &task;
+        mPending.store(count);
+        mNext.store(static_cast<uint64_t>(generation) << 32);
+    }
+    mCond.notify_all();
+
+    drain(generation, count, &task);
+
+    // 其它线程手上的任务通常很快做完, 先让出时间片等一会; 任务阻塞在取样本上(输入跟不上)时改为睡眠,
+    // 由做完最后一个任务的线程唤醒, 不空转占满一个核
+    for (int spin = 0; spin < SPIN_LIMIT && mPending.load() > 0; ++spin) {
+        std::this_thread::yield();
+    }
+    if (mPending.load() > 0) {
+        XTRACE_SCOPE("wait mix workers");
+        std::unique_lock<std::mutex> lock(mDoneMutex);
+        mDoneCond.wait(lock, [this] { return mPending.load() <= 0; });
+    }
+}
+
+void XMixPool::drain(uint32_t generation, int count, const std::function<void(int)>* task) {
+    uint64_t next = mNext.load();
+    for (;;) {
+        if (static_cast<uint32_t>(next >> 32) != generation || static_cast<int>(next & 0xffffffff) >= count) {
+            return;
+        }
+        if (!mNext.compare_exchange_weak(next, next + 1)) {
+            continue;
+        }
+
+        (*task)(static_cast<int>(next & 0xffffffff));
+        if (mPending.fetch_sub(1) == 1) {
+            // 加锁后再通知, 调用线程在检查计数和睡眠之间不会错过
+            std::lock_guard<std::mutex> lock(mDoneMutex);
+            mDoneCond.notify_one();
+        }
+        next = mNext.load();
+    }
+}
+
+void XMixPool::workThread() {
+    XThreadUtils::configThreadName("mixWorker");
+    XTRACE_THREAD_NAME("mixWorker");
+
+    uint32_t seen = 0;
+    for (;;) {
+        uint32_t generation;
+        int count;
+        const std::function<void(int)>* task;
+        {
+            std::unique_lock<std::mutex> lock(mMutex);
+            mCond.wait(lock, [this, seen] { return mAborted || mGeneration != seen; });
+            if (mAborted) {
+                return;
+            }
+            generation = mGeneration;
+            count = mCount;
+            task = mTask;
+        }
+        seen = generation;
+        drain(generation, count, task);
+    }
+}
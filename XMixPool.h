@@ -0,0 +1,65 @@
+//
+// Created by Andy on 2020/8/3.
+//
+
+#ifndef MIXER_XMIXPOOL_H
+#define MIXER_XMIXPOOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * 混音块的并行执行: 每个混音块的任务由工作线程和调用线程一起领取.
+ *
+ * - 任务序号和块的代数打包在一个原子量里, 领取时比较代数, 上一块醒得晚的线程不会领到这一块的任务
+ * - 每完成一个任务把剩余计数减一, 调用线程做完自己领到的任务后等计数归零, 块内不加锁也没有屏障;
+ *   短时间没有归零时调用线程睡眠, 由把计数减到零的线程唤醒
+ * - 工作线程只在两个块之间用条件变量睡眠
+ */
+class XMixPool {
+public:
+    /* threads 包含调用线程, 为 1 时不创建工作线程, 任务全部在调用线程里执行 */
+    explicit XMixPool(int threads);
+
+    ~XMixPool();
+
+    int threads() const;
+
+    /* 执行 task(0) ... task(count - 1), 全部完成后返回 */
+    void run(int count, const std::function<void(int)>& task);
+
+private:
+    void workThread();
+
+    /* 领取并执行当前块的任务, 直到领完或者块已经换代 */
+    void drain(uint32_t generation, int count, const std::function<void(int)>* task);
+
+private:
+    /* 调用线程等其它线程时先让出时间片的次数, 之后睡眠 */
+    static const int SPIN_LIMIT = 64;
+
+    int mThreads;
+    std::vector<std::thread> mWorkers;
+
+    /* 高 32 位为块的代数, 低 32 位为下一个待领取的任务序号 */
+    std::atomic<uint64_t> mNext;
+    std::atomic<int> mPending;
+
+    std::mutex mMutex;
+    std::condition_variable mCond;
+    uint32_t mGeneration;
+    int mCount;
+    const std::function<void(int)>* mTask;
+    bool mAborted;
+
+    /* 剩余计数归零的通知 */
+    std::mutex mDoneMutex;
+    std::condition_variable mDoneCond;
+};
+
+#endif //MIXER_XMIXPOOL_H
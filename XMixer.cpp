@@ -4,10 +4,40 @@
 
 #include "XMixer.h"
 #include "XDecoder.h"
+#include "XDemuxer.h"
 #include "XException.h"
+#include "XLog.h"
+#include "XMixKernels.h"
+#include "XMixPool.h"
+#include "XLoudnessMeter.h"
+#include "XLoudnessCache.h"
+#include "XLimiter.h"
+#include "XMemoryBudget.h"
+#include "XProbeCache.h"
+#include "XSharedSource.h"
+#include "XTrace.h"
+#include "XWaveform.h"
+
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <cstring>
+
+namespace {
+    /* 两次加入的解码选项解出的样本相同, 可以共用一路解码器; 直播相关的选项对点播文件不起作用 */
+    bool sameDecoding(const XDecoderOptions& a, const XDecoderOptions& b) {
+        return a.silencePeak == b.silencePeak && a.keepPackets == b.keepPackets &&
+               a.decodeThreads == b.decodeThreads && a.segmentSeconds == b.segmentSeconds &&
+               a.formatHint == b.formatHint;
+    }
+}
 
 XMixer::XMixer()
-        : mAudioIndex(-1), mEncodeSampleCount(0), mDuration(0) {
+        : mAudioIndex(-1), mEncodeSampleCount(0), mDuration(0), mAborted(false), mOutputSkip(0), mStartTime(0),
+          mMixedSamples(0), mLastDumpTime(0), mEncodeNs(0), mPassthrough(false), mPassthroughRun(0),
+          mEncodeValidFrom(INT64_MIN), mEncodeValidTo(INT64_MAX), mBlockSize(DEFAULT_BLOCK_SIZE),
+          mMixThreads(1), mIoOpen(nullptr), mIoClose(nullptr), mSegmentIndex(0), mPictureStart(0),
+          mPictureEnd(false) {
 #if OUT_TO_FILE
     mFile = fopen("/Users/andy/Desktop/output.pcm", "wb+");
 #endif
@@ -17,17 +47,248 @@ XMixer::~XMixer() {
 
 }
 
-void XMixer::add(const std::string& filename) {
+std::shared_ptr<XMixTrack> XMixer::add(const std::string& filename, const XDecoderOptions& options) {
+    try {
+        XDecoderOptions decoderOptions = options;
+        decoderOptions.keepPackets = decoderOptions.keepPackets || mPassthroughOptions.enabled;
+        if (!decoderOptions.probeCache) {
+            decoderOptions.probeCache = mProbeCache;
+        }
+        std::shared_ptr<XDecoder> decoder = sharedDecoder(filename, decoderOptions);
+        if (!decoder) {
+            decoder = std::make_shared<XDecoder>(filename, decoderOptions);
+            decoder->start();
+        }
+
+        auto track = std::make_shared<XMixTrack>();
+        track->decoder = decoder;
+        track->filename = filename;
+        mTrackList.emplace_back(track);
+        return track;
+    } catch (std::exception& e) {
+        throw XException("添加素材失败: 创建解码器失败!");
+    }
+}
+
+std::vector<std::shared_ptr<XMixTrack>> XMixer::addStreams(const std::string& filename, const std::vector<int>& streams,
+                                                           const XDecoderOptions& options) {
+    try {
+        auto demuxer = std::make_shared<XDemuxer>(filename, options.formatHint);
+        std::vector<int> indexes = streams.empty() ? demuxer->audioStreams() : streams;
+        if (indexes.empty()) {
+            throw XException("no audio stream");
+        }
+
+        // 先把所有分轨的解码器都建好再启动, 解封装线程要等所有分轨都挂上队列才开始读
+        XDecoderOptions decoderOptions = options;
+        decoderOptions.keepPackets = decoderOptions.keepPackets || mPassthroughOptions.enabled;
+        std::vector<std::shared_ptr<XMixTrack>> tracks;
+        for (int index : indexes) {
+            auto track = std::make_shared<XMixTrack>();
+            track->decoder = std::make_shared<XDecoder>(demuxer, index, decoderOptions);
+            track->filename = filename + "#" + std::to_string(index);
+            tracks.emplace_back(track);
+        }
+        for (auto& track : tracks) {
+            track->decoder->start();
+            mTrackList.emplace_back(track);
+        }
+        XLOG(AV_LOG_INFO, "XMixer", "%zu streams share one demuxer: %s", tracks.size(), filename.data());
+        return tracks;
+    } catch (std::exception& e) {
+        throw XException("添加素材失败: 创建解码器失败!");
+    }
+}
+
+std::shared_ptr<XMixTrack> XMixer::addPlaylist(const std::vector<std::string>& files, const XPlaylistOptions& options,
+                                               const XDecoderOptions& decoderOptions) {
     try {
-        auto decoder = std::make_shared<XDecoder>(filename);
-        decoder->start();
-        mDecoderList.emplace_back(decoder);
+        XDecoderOptions playlistDecoderOptions = decoderOptions;
+        if (!playlistDecoderOptions.probeCache) {
+            playlistDecoderOptions.probeCache = mProbeCache;
+        }
+        auto playlist = std::make_shared<XPlaylist>(files, playlistDecoderOptions, options);
+
+        auto track = std::make_shared<XMixTrack>();
+        track->decoder = std::make_shared<XDecoder>(playlist, playlistDecoderOptions);
+        track->decoder->start();
+        track->filename = playlist->name();
+        mTrackList.emplace_back(track);
+        XLOG(AV_LOG_INFO, "XMixer", "playlist: %zu files, crossfade %d ms", files.size(), options.crossfadeMs);
+        return track;
     } catch (std::exception& e) {
         throw XException("添加素材失败: 创建解码器失败!");
     }
 }
 
+std::shared_ptr<XDecoder> XMixer::sharedDecoder(const std::string& filename, const XDecoderOptions& options) {
+    if (options.live || mPassthroughOptions.enabled || XDecoder::isLiveSource(filename)) {
+        return nullptr;
+    }
+
+    auto range = mSources.equal_range(filename);
+    for (auto it = range.first; it != range.second; ++it) {
+        if (sameDecoding(it->second->options(), options)) {
+            return std::make_shared<XDecoder>(it->second, options);
+        }
+    }
+
+    // 第二次加入: 第一次建好的解码器交给共享素材, 原来的输入改为它的读取器; 混音开始前还没有取过样本
+    for (auto& track : mTrackList) {
+        if (track->filename != filename || track->decoder->isLive() || track->decoder->isShared() ||
+            !sameDecoding(track->decoder->options(), options)) {
+            continue;
+        }
+        auto source = std::make_shared<XSharedSource>(filename, track->decoder);
+        mSources.emplace(filename, source);
+        track->decoder = std::make_shared<XDecoder>(source, source->options());
+        XLOG(AV_LOG_INFO, "XMixer", "decode once, shared by placements: %s", filename.data());
+        return std::make_shared<XDecoder>(source, options);
+    }
+    return nullptr;
+}
+
+void XMixer::setLoudness(const XLoudnessOptions& options) {
+    mLoudnessOptions = options;
+}
+
+void XMixer::setDucking(const XDuckingOptions& options) {
+    mDuckingOptions = options;
+}
+
+XEffectChain& XMixer::masterEffects() {
+    return mMasterEffects;
+}
+
+void XMixer::setTelemetry(const XTelemetryOptions& options) {
+    mTelemetryOptions = options;
+    XTelemetry::setEnabled(options.enabled);
+}
+
+void XMixer::setPassthrough(const XPassthroughOptions& options) {
+    mPassthroughOptions = options;
+}
+
+void XMixer::setBlockSize(int nbSamples) {
+    mBlockSize = nbSamples > 0 ? nbSamples : DEFAULT_BLOCK_SIZE;
+}
+
+void XMixer::setWaveform(const XWaveformOptions& options) {
+    mWaveformOptions = options;
+}
+
+void XMixer::setMemoryBudget(const XMemoryOptions& options) {
+    XMemoryBudget::instance().setLimit(options.limitBytes);
+}
+
+void XMixer::setSegments(const XSegmentOptions& options) {
+    mSegmentOptions = options;
+}
+
+void XMixer::setRemux(const XRemuxOptions& options) {
+    mRemuxOptions = options;
+}
+
+void XMixer::setProbeCache(const std::string& path) {
+    mProbeCache = path.empty() ? nullptr : std::make_shared<XProbeCache>(path);
+}
+
+std::shared_ptr<XSubmixBus> XMixer::addBus(const std::string& name, const std::string& parent) {
+    for (auto& bus : mBuses) {
+        if (bus->name == name) {
+            return bus;
+        }
+    }
+
+    auto bus = std::make_shared<XSubmixBus>();
+    bus->name = name;
+    bus->parent = parent;
+    mBuses.push_back(bus);
+    return bus;
+}
+
+void XMixer::setMixThreads(int threads) {
+    mMixThreads = threads > 0 ? threads : std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+}
+
+XMixerStats XMixer::stats() const {
+    XMixerStats stats;
+    int64_t startTime = mStartTime;
+    stats.elapsedUs = startTime > 0 ? av_gettime_relative() - startTime : 0;
+    stats.mixedSamples = mMixedSamples;
+    stats.mix = mMixHistogram.snapshot();
+    stats.encode = mEncodeHistogram.snapshot();
+    stats.write = mWriteHistogram.snapshot();
+    stats.zeroFrames = mZeroFrames.value();
+    stats.passthroughFrames = mPassthroughFrames.value();
+    for (auto& track : mTrackList) {
+        stats.inputs.emplace_back(track->decoder->stats());
+    }
+    stats.memory = XMemoryBudget::instance().stats();
+    return stats;
+}
+
+void XMixer::dumpStats() {
+    if (!mTelemetryOptions.enabled || mTelemetryOptions.dumpPath.empty()) {
+        return;
+    }
+
+    // 先写临时文件再改名, 外部读取时不会读到写了一半的内容
+    std::string json = stats().toJson();
+    std::string tmpPath = mTelemetryOptions.dumpPath + ".tmp";
+    FILE* file = fopen(tmpPath.data(), "w");
+    if (!file) {
+        XLOG(AV_LOG_WARNING, "XMixer", "cannot write stats: %s", tmpPath.data());
+        return;
+    }
+    bool ok = fwrite(json.data(), 1, json.size(), file) == json.size();
+    ok = fclose(file) == 0 && ok;
+    if (!ok || rename(tmpPath.data(), mTelemetryOptions.dumpPath.data()) != 0) {
+        XLOG(AV_LOG_WARNING, "XMixer", "cannot write stats: %s", mTelemetryOptions.dumpPath.data());
+        remove(tmpPath.data());
+    }
+}
+
 void XMixer::mix(const std::string& outPath) {
+    XTRACE_THREAD_NAME("mix");
+#if XTRACE_ENABLED
+    int64_t traceStart = XTelemetry::now();
+#endif
+
+    // 输入在 add 时都已经打开过, 新的探测结果现在就可以写回
+    if (mProbeCache && mProbeCache->save() < 0) {
+        XLOG(AV_LOG_WARNING, "XMixer", "save probe cache failed: %s", mProbeCache->path().data());
+    }
+
+    // 时间线长度: 每路输入的起始位置加上探测到的时长, 取最大值, 输出流的时长按它预先设置;
+    // 实际解码比探测的长时(时长是估算的)以实际读到的结尾为准
+    mDuration = 0;
+    for (auto& track : mTrackList) {
+        track->finished = false;
+        track->endSample = -1;
+        track->consumed = -1;
+
+        // 共享素材的读取器现在就移到裁剪起点: 还没轮到的位置停在素材开头的话, 之后解出的块都释放不掉
+        if (track->decoder->isShared()) {
+            track->consumed = 0;
+            if (track->trimStartMs > 0) {
+                track->decoder->skipSamples(av_rescale(track->trimStartMs, OUT_SAMPLE_RATE, 1000) *
+                                            OUT_SAMPLE_CHANNELS * static_cast<int64_t>(sizeof(int16_t)));
+            }
+        }
+        int64_t duration = track->decoder->duration();
+        if (duration != AV_NOPTS_VALUE && duration > 0) {
+            int64_t length = av_rescale(duration, OUT_SAMPLE_RATE, AV_TIME_BASE) -
+                             av_rescale(track->trimStartMs, OUT_SAMPLE_RATE, 1000);
+            if (track->trimLengthMs > 0) {
+                length = std::min(length, av_rescale(track->trimLengthMs, OUT_SAMPLE_RATE, 1000));
+            }
+            mDuration = std::max(mDuration, av_rescale(track->offsetMs, OUT_SAMPLE_RATE, 1000) +
+                                            std::max<int64_t>(0, length));
+        }
+    }
+    XLOG(AV_LOG_INFO, "XMixer", "timeline: %.3f s, %zu inputs", static_cast<double>(mDuration) / OUT_SAMPLE_RATE,
+         mTrackList.size());
 
     int ret = openOutFile(outPath);
     if (ret < 0) {
@@ -44,41 +305,260 @@ void XMixer::mix(const std::string& outPath) {
 
     avcodec_fill_audio_frame(mAudioFrame->avframe, mAudioCodecCtx->channels, mAudioCodecCtx->sample_fmt, buffer, bufferSize, 1);
 
-    int size = mDecoderList.size();
-    int readed = 0;
+    mZeroFrame = std::make_unique<Frame>();
+    mZeroFrame->avframe->nb_samples = mAudioCodecCtx->frame_size;
+    mZeroFrame->avframe->format = mAudioCodecCtx->sample_fmt;
+    uint8_t* zeroBuffer = reinterpret_cast<uint8_t*>(av_mallocz(bufferSize));
+    avcodec_fill_audio_frame(mZeroFrame->avframe, mAudioCodecCtx->channels, mAudioCodecCtx->sample_fmt, zeroBuffer, bufferSize, 1);
+
+    // 混音总线为 float, 每路输入先转成 float 再按增益累加; 混音块的大小和编码帧无关, 总线输出先放进
+    // mOutPending, 攒够一帧再编码. 直通按包切换, 打开时混音块和编码帧对齐
+    int frameSize = mAudioCodecCtx->frame_size;
+    int blockSize = mPassthroughOptions.enabled ? frameSize : std::max(1, mBlockSize);
+    int busCount = blockSize * OUT_SAMPLE_CHANNELS;
+    mBus.assign(busCount, 0.0f);
+    mVoiceBus.assign(busCount, 0.0f);
+    mBedBus.assign(busCount, 0.0f);
+    mOutPending.clear();
+    mOutPending.reserve(static_cast<size_t>(blockSize + frameSize) * OUT_SAMPLE_CHANNELS);
+    for (auto& track : mTrackList) {
+        track->pcm.assign(busCount, 0);
+        track->samples.assign(busCount, 0.0f);
+    }
+    prepareBuses(busCount);
+    mPool = std::make_unique<XMixPool>(mMixThreads);
+    prepareLoudness();
+    prepareWaveform();
+
+    mPassthrough = false;
+    mPassthroughRun = 0;
+    mEncodeValidFrom = INT64_MIN;
+    mEncodeValidTo = INT64_MAX;
+    mPreroll.assign(static_cast<size_t>(PREROLL_FRAMES) * frameSize * OUT_SAMPLE_CHANNELS, 0);
+
+    // 同时有人声和背景时才需要闪避; 只看直接接到主总线的输入和总线
+    mDucker.reset();
+    bool hasVoice = false;
+    bool hasBed = false;
+    for (auto& work : mWorks) {
+        for (auto* track : work->tracks) {
+            hasVoice = hasVoice || (!work->bus && track->role == XTrackRole::VOICE);
+            hasBed = hasBed || (!work->bus && track->role == XTrackRole::BED);
+        }
+    }
+    for (auto* bus : mBusOrder) {
+        hasVoice = hasVoice || (!bus->parentBus && bus->role == XTrackRole::VOICE);
+        hasBed = hasBed || (!bus->parentBus && bus->role == XTrackRole::BED);
+    }
+    if (mDuckingOptions.enabled && hasVoice && hasBed) {
+        mDucker = std::make_unique<XDucker>(OUT_SAMPLE_RATE, OUT_SAMPLE_CHANNELS, mDuckingOptions);
+    }
+
+    // 闪避和限幅都有固定延迟, 输出时把开头的这部分丢掉, 结束时再把尾巴冲出来
+    mOutputSkip = (mDucker ? mDucker->latency() : 0) + (mLimiter ? mLimiter->latency() : 0);
+
+    // 两遍模式下第一遍的总线先缓存到临时文件
+    FILE* spill = nullptr;
+    if (mLoudnessOptions.enabled && mLoudnessOptions.twoPass) {
+        spill = tmpfile();
+        if (!spill) {
+            XLOG(AV_LOG_WARNING, "XMixer", "cannot create spill file, fall back to single pass");
+        }
+    }
+
+    // 有直播输入时以系统时钟作为混音时钟, 按实时速度取样本, 各路输入的漂移补偿都以它为基准
+    bool realtime = std::any_of(mTrackList.begin(), mTrackList.end(),
+                                [](const std::shared_ptr<XMixTrack>& track) { return track->decoder->isLive(); });
+    int64_t startTime = av_gettime_relative();
+    mStartTime = startTime;
+    mMixedSamples = 0;
+    mLastDumpTime = XTelemetry::now();
+    int64_t lastProgressTime = startTime;
+
     for (;;) {
-        for (int i = 0; i < size; ++i) {
-            auto decoder = mDecoderList.at(i);
-            readed = decoder->getSamples(buffer, bufferSize);
+        if (mAborted) {
+            break;
         }
 
-        if (readed < 0 && readed != AVERROR(ENOMEM)) {
+        if (realtime) {
+            int64_t due = startTime + av_rescale(mMixedSamples, AV_TIME_BASE, OUT_SAMPLE_RATE);
+            int64_t now = av_gettime_relative();
+            if (due > now) {
+                XTRACE_SCOPE("realtime pacing");
+                av_usleep(static_cast<unsigned>(due - now));
+            }
+        }
+
+        XTRACE_SCOPE("mix block");
+
+        // 混音块耗时不包含等待解码和编码的时间, 这两部分分别由样本缓冲的等待统计和编码直方图记录
+        int64_t blockStart = XTelemetry::isEnabled() ? XTelemetry::now() : 0;
+        int64_t waitNs = 0;
+        int64_t encodeNs = mEncodeNs;
+
+        std::fill(mBus.begin(), mBus.end(), 0.0f);
+        if (mDucker) {
+            std::fill(mVoiceBus.begin(), mVoiceBus.end(), 0.0f);
+            std::fill(mBedBus.begin(), mBedBus.end(), 0.0f);
+        }
+        int64_t blockPos = mMixedSamples;
+        bool telemetry = blockStart > 0;
+        mPool->run(static_cast<int>(mWorks.size()),
+                   [&](int i) { renderWork(*mWorks[i], blockPos, blockSize, telemetry); });
+        bool busSilent = reduceBuses(busCount);
+
+        // 多线程时各任务等待解码的时间互相重叠, 取最长的一个
+        int audibleTracks = 0;
+        XMixTrack* soloTrack = nullptr;
+        for (auto& work : mWorks) {
+            audibleTracks += work->audibleTracks;
+            soloTrack = work->soloTrack ? work->soloTrack : soloTrack;
+            waitNs = mPool->threads() > 1 ? std::max(waitNs, work->waitNs) : waitNs + work->waitNs;
+        }
+
+        // 所有输入都结束后, 最后一块只输出到时间线长度和最晚结束的输入两者中较晚的位置, 不足的部分是静音
+        int nbSamples = blockSize;
+        bool allFinished = std::all_of(mTrackList.begin(), mTrackList.end(),
+                                       [](const std::shared_ptr<XMixTrack>& track) { return track->finished; });
+        if (allFinished) {
+            int64_t end = mDuration;
+            for (auto& track : mTrackList) {
+                end = std::max(end, track->endSample);
+            }
+            nbSamples = static_cast<int>(std::min<int64_t>(blockSize, std::max<int64_t>(0, end - blockPos)));
+        }
+        if (nbSamples <= 0) {
             break;
         }
 
-        if (readed > 0) {
-#if OUT_TO_FILE
-            fwrite(buffer, 1, bufferSize, mFile);
-#else
-            ret = encodeAudioFrame();
-#endif
-            av_log(nullptr, AV_LOG_INFO, "[XMixer] encode samples: %d\n", readed);
+        mMixedSamples += nbSamples;
+
+        // 只有一路发声并且拿得到对应的原始包时直通, 否则走编码
+        std::shared_ptr<Packet> packet =
+                audibleTracks == 1 && nbSamples == frameSize ? passthroughPacket(*soloTrack, spill) : nullptr;
+        if (packet) {
+            int frameCount = frameSize * OUT_SAMPLE_CHANNELS;
+            std::copy(mPreroll.begin() + frameCount, mPreroll.end(), mPreroll.begin());
+            std::copy(soloTrack->view, soloTrack->view + frameCount, mPreroll.end() - frameCount);
+        }
+        mPassthroughRun = packet ? mPassthroughRun + 1 : 0;
+        if (packet && (mPassthrough || mPassthroughRun >= std::max(PREROLL_FRAMES, mPassthroughOptions.minFrames))) {
+            ret = writePassthrough(*packet, soloTrack->view);
+        } else {
+            ret = mPassthrough ? leavePassthrough() : 0;
+            if (ret >= 0) {
+                ret = processBus(nbSamples, spill, busSilent);
+            }
+        }
+
+        // 这一块的样本已经转换或直通完, 归还解码器缓冲里借出的部分
+        for (auto& track : mTrackList) {
+            if (track->peeked > 0) {
+                track->decoder->releaseSamples(track->peeked);
+                track->peeked = 0;
+            }
+        }
+        if (ret < 0) {
+            XLOG(AV_LOG_FATAL, "XMixer", "encode audio frame ret: %d, str: %s", ret, av_err2str(ret));
+            break;
+        }
+
+        // 每 5 秒输出一行进度, 代替逐帧日志
+        if (XLog::isEnabled(AV_LOG_INFO)) {
+            int64_t now = av_gettime_relative();
+            if (now - lastProgressTime >= 5 * AV_TIME_BASE) {
+                lastProgressTime = now;
+                double mixed = static_cast<double>(mMixedSamples) / OUT_SAMPLE_RATE;
+                XLOG(AV_LOG_INFO, "XMixer", "progress: %.1f s mixed, %.1fx realtime, %zu inputs", mixed,
+                     mixed * AV_TIME_BASE / std::max<int64_t>(1, now - startTime), mTrackList.size());
+            }
+        }
+
+        if (blockStart > 0) {
+            int64_t now = XTelemetry::now();
+            int64_t mixNs = now - blockStart - waitNs - (mEncodeNs - encodeNs);
+            mMixHistogram.record(static_cast<uint64_t>(std::max<int64_t>(0, mixNs)));
+
+            if (now - mLastDumpTime >= static_cast<int64_t>(mTelemetryOptions.dumpIntervalMs) * 1000000) {
+                mLastDumpTime = now;
+                dumpStats();
+            }
+        }
+    }
+
+    mPool.reset();
+
+    // 冲出闪避延迟线里剩下的数据
+    if (mDucker) {
+        std::fill(mBus.begin(), mBus.end(), 0.0f);
+        std::fill(mVoiceBus.begin(), mVoiceBus.end(), 0.0f);
+        std::fill(mBedBus.begin(), mBedBus.end(), 0.0f);
+        for (int left = mDucker->latency(); left > 0 && ret >= 0; left -= blockSize) {
+            ret = processBus(std::min(left, blockSize), spill, false);
+        }
+    }
+
+    // 第二遍: 用第一遍测得的总线响度计算增益, 直接从缓存的总线数据编码
+    if (spill) {
+        double measured = mBusMeter->integratedLoudness();
+        float gain = 1.0f;
+        if (std::isfinite(measured)) {
+            gain = static_cast<float>(std::pow(10.0, (mLoudnessOptions.targetLufs - measured) / 20.0));
+        }
+        XLOG(AV_LOG_INFO, "XMixer", "first pass loudness: %.1f LUFS, gain: %.2f dB", measured,
+             20 * std::log10(gain));
+
+        rewind(spill);
+        size_t count;
+        while ((count = fread(mBus.data(), sizeof(float), busCount, spill)) > 0) {
+            XMixKernels::applyGain(mBus.data(), gain, static_cast<int>(count));
+            ret = writeBus(mBus.data(), static_cast<int>(count) / OUT_SAMPLE_CHANNELS);
             if (ret < 0) {
-                av_log(nullptr, AV_LOG_FATAL, "[XMixer] encode audio frame ret: %d, str: %s\n", ret, av_err2str(ret));
+                XLOG(AV_LOG_FATAL, "XMixer", "encode audio frame ret: %d, str: %s", ret, av_err2str(ret));
                 break;
             }
         }
+        fclose(spill);
+    }
+
+    ret = flushBus();
+    if (ret < 0) {
+        XLOG(AV_LOG_FATAL, "XMixer", "flush bus failed: %s", av_err2str(ret));
     }
+    finishLoudness();
+    finishWaveform(outPath);
+    dumpStats();
+
+#if XTRACE_ENABLED
+    std::string tracePath = mTelemetryOptions.tracePath.empty() ? outPath + ".trace.json" : mTelemetryOptions.tracePath;
+    if (XTrace::write(tracePath, traceStart) < 0) {
+        XLOG(AV_LOG_WARNING, "XMixer", "write trace failed: %s", tracePath.data());
+    }
+#endif
 
     if (buffer) {
         av_free(buffer);
         buffer = nullptr;
     }
+    av_free(zeroBuffer);
+    mZeroFrame.reset();
+
+    // 画面比混音结果长的部分也照样复制
+    if (mPictureCtx) {
+        if (!mAborted && writePicture(INT64_MAX) < 0) {
+            XLOG(AV_LOG_ERROR, "XMixer", "copy picture source failed: %s", mRemuxOptions.pictureSource.data());
+        }
+        XLOG(AV_LOG_VERBOSE, "XMixer", "picture packets copied: %llu",
+             static_cast<unsigned long long>(mPicturePackets.value()));
+        mPicturePending.reset();
+        mPictureCtx.reset();
+    }
 
     ret = av_write_trailer(mFormatCtx.get());
     if (ret < 0) {
-        av_log(nullptr, AV_LOG_FATAL, "[XMixer] av_write_trailer failed: %s\n", av_err2str(ret));
+        XLOG(AV_LOG_FATAL, "XMixer", "av_write_trailer failed: %s", av_err2str(ret));
     }
+    publishSegments();
 
     if (mAudioCodecCtx) {
         mAudioCodecCtx.reset();
@@ -93,52 +573,672 @@ void XMixer::mix(const std::string& outPath) {
     fclose(mFile);
 #endif
 
-    av_log(nullptr, AV_LOG_INFO, "[XMixer] 合成完成: %s\n", outPath.data());
+    if (XLog::isEnabled(AV_LOG_VERBOSE)) {
+        for (auto& track : mTrackList) {
+            XDecoderStats input = track->decoder->stats();
+            XLOG(AV_LOG_VERBOSE, "XMixer", "silent blocks: %llu/%llu: %s", static_cast<unsigned long long>(input.silentReads),
+                 static_cast<unsigned long long>(input.reads), track->filename.data());
+        }
+        XLOG(AV_LOG_VERBOSE, "XMixer", "zero frames: %llu, passthrough frames: %llu",
+             static_cast<unsigned long long>(mZeroFrames.value()),
+             static_cast<unsigned long long>(mPassthroughFrames.value()));
+    }
+
+    double mixed = static_cast<double>(mMixedSamples) / OUT_SAMPLE_RATE;
+    double elapsed = static_cast<double>(av_gettime_relative() - startTime) / AV_TIME_BASE;
+    XLOG(AV_LOG_INFO, "XMixer", "合成完成: %s, %.1f s mixed in %.1f s (%.1fx realtime)", outPath.data(), mixed, elapsed,
+         elapsed > 0 ? mixed / elapsed : 0);
+    XLog::flush();
+}
+
+void XMixer::stop() {
+    mAborted = true;
+}
+
+void XMixer::prepareLoudness() {
+    mBusMeter.reset();
+    mLimiter.reset();
+    for (auto& track : mTrackList) {
+        track->normGain = 1.0f;
+    }
+    if (!mLoudnessOptions.enabled) {
+        return;
+    }
+
+    mBusMeter = std::make_unique<XLoudnessMeter>(OUT_SAMPLE_RATE, OUT_SAMPLE_CHANNELS);
+    mLimiter = std::make_unique<XLimiter>(OUT_SAMPLE_RATE, OUT_SAMPLE_CHANNELS, mLoudnessOptions.truePeakDb);
+
+    if (!mLoudnessOptions.cachePath.empty() && !mLoudnessCache) {
+        mLoudnessCache = std::make_unique<XLoudnessCache>(mLoudnessOptions.cachePath);
+    }
+
+    for (auto& track : mTrackList) {
+        track->meter = std::make_unique<XLoudnessMeter>(OUT_SAMPLE_RATE, OUT_SAMPLE_CHANNELS);
+
+        // 命中缓存的素材先归一化到目标响度, 用户设置的 gain 保持不变
+        double lufs;
+        if (mLoudnessCache && !track->decoder->isLive() && mLoudnessCache->lookup(track->filename, &lufs)) {
+            track->normGain = static_cast<float>(std::pow(10.0, (mLoudnessOptions.targetLufs - lufs) / 20.0));
+            XLOG(AV_LOG_INFO, "XMixer", "cached loudness %.1f LUFS, gain %.2f dB: %s", lufs,
+                 mLoudnessOptions.targetLufs - lufs, track->filename.data());
+        }
+    }
+}
+
+void XMixer::finishLoudness() {
+    if (!mLoudnessOptions.enabled) {
+        return;
+    }
+
+    for (auto& track : mTrackList) {
+        if (!track->meter) {
+            continue;
+        }
+
+        double lufs = track->meter->integratedLoudness();
+        XLOG(AV_LOG_INFO, "XMixer", "input loudness: %.1f LUFS, true peak: %.1f dBTP: %s", lufs,
+             track->meter->truePeak(), track->filename.data());
+
+        // 只有完整读完、没有裁剪的素材才写入缓存
+        bool whole = track->trimStartMs <= 0 && track->trimLengthMs <= 0;
+        if (mLoudnessCache && track->finished && whole && !track->decoder->isLive() && std::isfinite(lufs)) {
+            mLoudnessCache->store(track->filename, lufs);
+        }
+    }
+
+    if (mBusMeter) {
+        XLOG(AV_LOG_INFO, "XMixer", "mix loudness: %.1f LUFS, true peak: %.1f dBTP (before limiter)",
+             mBusMeter->integratedLoudness(), mBusMeter->truePeak());
+    }
+
+    if (mLoudnessCache && mLoudnessCache->save() < 0) {
+        XLOG(AV_LOG_WARNING, "XMixer", "save loudness cache failed: %s",
+             mLoudnessOptions.cachePath.data());
+    }
+}
+
+void XMixer::prepareWaveform() {
+    mMixWaveform.reset();
+    for (auto& track : mTrackList) {
+        track->waveform.reset();
+    }
+    if (!mWaveformOptions.enabled) {
+        return;
+    }
+
+    mMixWaveform = std::make_unique<XWaveform>(OUT_SAMPLE_RATE, mWaveformOptions.binSizes);
+    for (auto& track : mTrackList) {
+        track->waveform = std::make_unique<XWaveform>(OUT_SAMPLE_RATE, mWaveformOptions.binSizes);
+    }
+}
+
+void XMixer::finishWaveform(const std::string& outPath) {
+    if (!mMixWaveform) {
+        return;
+    }
+
+    std::string path = outPath + ".wave";
+    if (mMixWaveform->write(path) < 0) {
+        XLOG(AV_LOG_WARNING, "XMixer", "write waveform failed: %s", path.data());
+    }
+    mMixWaveform.reset();
+
+    for (size_t i = 0; i < mTrackList.size(); ++i) {
+        auto& track = mTrackList[i];
+        path = outPath + "." + std::to_string(i) + ".wave";
+        if (track->waveform->write(path) < 0) {
+            XLOG(AV_LOG_WARNING, "XMixer", "write waveform failed: %s", path.data());
+        }
+        track->waveform.reset();
+    }
+}
+
+void XMixer::prepareBuses(int busCount) {
+    // 上级总线找不到或者成环时接到主总线
+    for (auto& bus : mBuses) {
+        bus->parentBus = nullptr;
+        for (auto& parent : mBuses) {
+            if (!bus->parent.empty() && parent->name == bus->parent && parent != bus) {
+                bus->parentBus = parent.get();
+            }
+        }
+        if (!bus->parent.empty() && !bus->parentBus) {
+            XLOG(AV_LOG_WARNING, "XMixer", "bus %s: parent %s not found, route to master", bus->name.data(),
+                 bus->parent.data());
+        }
+        bus->samples.assign(busCount, 0.0f);
+        bus->silent = true;
+    }
+
+    std::vector<std::pair<int, XSubmixBus*>> depths;
+    for (auto& bus : mBuses) {
+        int depth = 0;
+        for (XSubmixBus* parent = bus->parentBus; parent; parent = parent->parentBus) {
+            if (++depth > static_cast<int>(mBuses.size())) {
+                XLOG(AV_LOG_WARNING, "XMixer", "bus %s: parent cycle, route to master", bus->name.data());
+                bus->parentBus = nullptr;
+                depth = 0;
+                break;
+            }
+        }
+        depths.emplace_back(depth, bus.get());
+    }
+    std::stable_sort(depths.begin(), depths.end(),
+                     [](const std::pair<int, XSubmixBus*>& a, const std::pair<int, XSubmixBus*>& b) {
+                         return a.first > b.first;
+                     });
+    mBusOrder.clear();
+    for (auto& it : depths) {
+        mBusOrder.push_back(it.second);
+    }
+
+    // 每条总线上的输入按顺序轮流分到至多 mMixThreads 个任务里
+    std::vector<std::pair<XSubmixBus*, std::vector<XMixTrack*>>> groups;
+    groups.emplace_back(nullptr, std::vector<XMixTrack*>());
+    for (auto* bus : mBusOrder) {
+        groups.emplace_back(bus, std::vector<XMixTrack*>());
+    }
+    for (auto& track : mTrackList) {
+        auto it = std::find_if(groups.begin(), groups.end(),
+                               [&track](const std::pair<XSubmixBus*, std::vector<XMixTrack*>>& group) {
+                                   return group.first ? group.first->name == track->bus : track->bus.empty();
+                               });
+        if (it == groups.end()) {
+            XLOG(AV_LOG_WARNING, "XMixer", "bus %s not found, route to master: %s", track->bus.data(),
+                 track->filename.data());
+            it = groups.begin();
+        }
+        it->second.push_back(track.get());
+    }
+
+    mWorks.clear();
+    for (auto& group : groups) {
+        int count = std::min(mMixThreads, static_cast<int>(group.second.size()));
+        size_t first = mWorks.size();
+        for (int i = 0; i < count; ++i) {
+            auto work = std::make_unique<XMixWork>();
+            work->bus = group.first;
+            work->sum.assign(busCount, 0.0f);
+            if (!group.first) {
+                work->voice.assign(busCount, 0.0f);
+                work->bed.assign(busCount, 0.0f);
+            }
+            mWorks.push_back(std::move(work));
+        }
+        for (size_t i = 0; i < group.second.size(); ++i) {
+            mWorks[first + i % count]->tracks.push_back(group.second[i]);
+        }
+    }
+}
+
+void XMixer::renderWork(XMixWork& work, int64_t blockPos, int blockSize, bool telemetry) {
+    XTRACE_SCOPE("mix work");
+
+    std::fill(work.sum.begin(), work.sum.end(), 0.0f);
+    if (mDucker && !work.bus) {
+        std::fill(work.voice.begin(), work.voice.end(), 0.0f);
+        std::fill(work.bed.begin(), work.bed.end(), 0.0f);
+    }
+    work.silent = true;
+    work.audibleTracks = 0;
+    work.soloTrack = nullptr;
+    work.waitNs = 0;
+
+    for (auto* track : work.tracks) {
+        // 已经结束的输入不再取样本, 剩下的时间线上相当于静音
+        if (track->finished) {
+            continue;
+        }
+
+        // 还没到这一路的起始位置; 起始位置落在块中间时只取块内后面这部分
+        int64_t startSample = av_rescale(track->offsetMs, OUT_SAMPLE_RATE, 1000);
+        if (startSample >= blockPos + blockSize) {
+            continue;
+        }
+        int lead = static_cast<int>(std::max<int64_t>(0, startSample - blockPos));
+        int wanted = (blockSize - lead) * OUT_SAMPLE_CHANNELS * static_cast<int>(sizeof(int16_t));
+
+        // 第一次取样本前跳过裁剪掉的开头; 有裁剪长度时最后一块只取到裁剪的结尾
+        int bytesPerSample = OUT_SAMPLE_CHANNELS * static_cast<int>(sizeof(int16_t));
+        if (track->consumed < 0) {
+            track->consumed = 0;
+            if (track->trimStartMs > 0) {
+                XTRACE_SCOPE("trim start");
+                track->decoder->skipSamples(av_rescale(track->trimStartMs, OUT_SAMPLE_RATE, 1000) * bytesPerSample);
+            }
+        }
+        int64_t trimBytes = av_rescale(track->trimLengthMs, OUT_SAMPLE_RATE, 1000) * bytesPerSample;
+        if (track->trimLengthMs > 0) {
+            wanted = static_cast<int>(std::min<int64_t>(wanted, std::max<int64_t>(0, trimBytes - track->consumed)));
+        }
+
+        bool silent = false;
+        int readed;
+        {
+            XTRACE_SCOPE("getSamples");
+            int64_t waitStart = telemetry ? XTelemetry::now() : 0;
+            const uint8_t* data = nullptr;
+            readed = track->decoder->peekSamples(&data, wanted, &silent);
+            if (readed == AVERROR(ENOSYS)) {
+                readed = track->decoder->getSamples(reinterpret_cast<uint8_t*>(track->pcm.data()), wanted, &silent);
+                track->view = track->pcm.data();
+            } else {
+                track->view = reinterpret_cast<const int16_t*>(data);
+                track->peeked = std::max(readed, 0);
+            }
+            if (waitStart > 0) {
+                work.waitNs += XTelemetry::now() - waitStart;
+            }
+        }
+
+        // 点播输入只在读到结尾时才会取不满, 记下它在时间线上结束的位置; 取到裁剪长度时同样结束
+        track->consumed += std::max(readed, 0);
+        if (readed < 0 || (readed < wanted && !track->decoder->isLive()) ||
+            (track->trimLengthMs > 0 && track->consumed >= trimBytes)) {
+            track->finished = true;
+            track->endSample = blockPos + lead + std::max(readed, 0) / bytesPerSample;
+            // 共享素材的读取器立即关闭, 不再拖住缓存的释放; 样本已经拷贝到 pcm
+            if (track->decoder->isShared()) {
+                track->decoder->stop();
+            }
+        }
+        if (readed <= 0) {
+            continue;
+        }
+
+        // 静音块不做转换和求和; 响度测量的门限窗口和音效的尾巴仍然需要这段零样本
+        int count = readed / static_cast<int>(sizeof(int16_t));
+        int busOffset = lead * OUT_SAMPLE_CHANNELS;
+        if (silent && !track->meter && track->effects.empty()) {
+            if (track->waveform) {
+                track->waveform->processSilence(count / OUT_SAMPLE_CHANNELS);
+            }
+            continue;
+        }
+        if (silent) {
+            std::fill(track->samples.begin(), track->samples.begin() + count, 0.0f);
+        } else {
+            XMixKernels::s16ToFloat(track->view, track->samples.data(), count);
+        }
+        if (track->waveform) {
+            track->waveform->process(track->samples.data(), count / OUT_SAMPLE_CHANNELS);
+        }
+        if (track->meter) {
+            track->meter->process(track->samples.data(), count / OUT_SAMPLE_CHANNELS);
+        }
+        if (silent && track->effects.empty()) {
+            continue;
+        }
+        if (!track->effects.empty()) {
+            track->effects.process(track->samples.data(), count / OUT_SAMPLE_CHANNELS);
+        }
+        work.silent = false;
+        ++work.audibleTracks;
+        work.soloTrack = track;
+
+        // 直接接到主总线的人声和背景分开累加, 归并时人声同时进入主总线
+        float* dst = work.sum.data();
+        if (mDucker && !work.bus && track->role == XTrackRole::BED) {
+            dst = work.bed.data();
+        } else if (mDucker && !work.bus && track->role == XTrackRole::VOICE) {
+            dst = work.voice.data();
+        }
+        XMixKernels::accumulate(dst + busOffset, track->samples.data(), track->gain * track->normGain, count);
+    }
+}
+
+bool XMixer::reduceBuses(int count) {
+    XTRACE_SCOPE("reduceBuses");
+
+    bool silent = true;
+    for (auto* bus : mBusOrder) {
+        std::fill(bus->samples.begin(), bus->samples.end(), 0.0f);
+        bus->silent = true;
+    }
+
+    for (auto& work : mWorks) {
+        if (work->silent) {
+            continue;
+        }
+        if (work->bus) {
+            XMixKernels::accumulate(work->bus->samples.data(), work->sum.data(), 1.0f, count);
+            work->bus->silent = false;
+            continue;
+        }
+        XMixKernels::accumulate(mBus.data(), work->sum.data(), 1.0f, count);
+        if (mDucker) {
+            XMixKernels::accumulate(mVoiceBus.data(), work->voice.data(), 1.0f, count);
+            XMixKernels::accumulate(mBus.data(), work->voice.data(), 1.0f, count);
+            XMixKernels::accumulate(mBedBus.data(), work->bed.data(), 1.0f, count);
+        }
+        silent = false;
+    }
+
+    // 下级总线总在上级之前, 处理完音效和增益后累加到上级, 最上层的按角色进入主总线
+    for (auto* bus : mBusOrder) {
+        if (bus->silent && bus->effects.empty()) {
+            continue;
+        }
+        if (!bus->effects.empty()) {
+            bus->effects.process(bus->samples.data(), count / OUT_SAMPLE_CHANNELS);
+        }
+        if (bus->parentBus) {
+            XMixKernels::accumulate(bus->parentBus->samples.data(), bus->samples.data(), bus->gain, count);
+            bus->parentBus->silent = false;
+            continue;
+        }
+
+        if (mDucker && bus->role == XTrackRole::BED) {
+            XMixKernels::accumulate(mBedBus.data(), bus->samples.data(), bus->gain, count);
+        } else {
+            if (mDucker && bus->role == XTrackRole::VOICE) {
+                XMixKernels::accumulate(mVoiceBus.data(), bus->samples.data(), bus->gain, count);
+            }
+            XMixKernels::accumulate(mBus.data(), bus->samples.data(), bus->gain, count);
+        }
+        silent = false;
+    }
+    return silent;
+}
+
+int XMixer::processBus(int nbSamples, FILE* spill, bool silent) {
+    XTRACE_SCOPE("processBus");
+
+    // 所有输入都静音, 总线上也没有带状态的处理时输出一定是零, 直接编码共享的零帧
+    int frameSize = mZeroFrame->avframe->nb_samples;
+    if (silent && !mDucker && mMasterEffects.empty() && !mLimiter && !spill && mOutPending.empty() &&
+        nbSamples % frameSize == 0) {
+        int ret = 0;
+        if (mMixWaveform) {
+            mMixWaveform->processSilence(nbSamples);
+        }
+        for (int i = 0; i < nbSamples / frameSize && ret >= 0; ++i) {
+            mZeroFrames.add();
+#if OUT_TO_FILE
+            fwrite(mZeroFrame->avframe->data[0], sizeof(int16_t), frameSize * OUT_SAMPLE_CHANNELS, mFile);
+#else
+            ret = encodeAudioFrame(mZeroFrame->avframe);
+#endif
+        }
+        return ret;
+    }
+
+    if (mDucker) {
+        mDucker->process(mVoiceBus.data(), mBedBus.data(), mBus.data(), nbSamples);
+    }
+
+    if (!mMasterEffects.empty()) {
+        mMasterEffects.process(mBus.data(), nbSamples);
+    }
+
+    if (mBusMeter) {
+        mBusMeter->process(mBus.data(), nbSamples);
+    }
+
+    if (spill) {
+        size_t count = static_cast<size_t>(nbSamples) * OUT_SAMPLE_CHANNELS;
+        return fwrite(mBus.data(), sizeof(float), count, spill) == count ? 0 : AVERROR(EIO);
+    }
+
+    return writeBus(mBus.data(), nbSamples);
+}
+
+int XMixer::writeBus(float* samples, int nbSamples) {
+    int channels = OUT_SAMPLE_CHANNELS;
+    if (mLimiter) {
+        mLimiter->process(samples, samples, nbSamples);
+    }
+
+    int skip = std::min(mOutputSkip, nbSamples);
+    mOutputSkip -= skip;
+    samples += skip * channels;
+    nbSamples -= skip;
+    if (mMixWaveform) {
+        mMixWaveform->process(samples, nbSamples);
+    }
+    mOutPending.insert(mOutPending.end(), samples, samples + nbSamples * channels);
+
+    int frameCount = mAudioCodecCtx->frame_size * channels;
+    size_t offset = 0;
+    int ret = 0;
+    while (mOutPending.size() - offset >= static_cast<size_t>(frameCount)) {
+        XMixKernels::floatToS16(mOutPending.data() + offset, reinterpret_cast<int16_t*>(mAudioFrame->avframe->data[0]),
+                                frameCount);
+        offset += frameCount;
+#if OUT_TO_FILE
+        fwrite(mAudioFrame->avframe->data[0], sizeof(int16_t), frameCount, mFile);
+#else
+        ret = encodeAudioFrame(mAudioFrame->avframe);
+#endif
+        if (ret < 0) {
+            break;
+        }
+    }
+    mOutPending.erase(mOutPending.begin(), mOutPending.begin() + offset);
+
+    return ret;
+}
+
+int XMixer::flushBus() {
+    int channels = OUT_SAMPLE_CHANNELS;
+    if (mLimiter) {
+        std::vector<float> tail(static_cast<size_t>(mLimiter->latency()) * channels, 0.0f);
+        int ret = writeBus(tail.data(), mLimiter->latency());
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    // 最后不足一帧的部分单独编码
+    int remain = static_cast<int>(mOutPending.size()) / channels;
+    if (remain <= 0) {
+        return 0;
+    }
+
+    XMixKernels::floatToS16(mOutPending.data(), reinterpret_cast<int16_t*>(mAudioFrame->avframe->data[0]),
+                            remain * channels);
+    mOutPending.clear();
+
+    int ret = 0;
+    int frameSize = mAudioFrame->avframe->nb_samples;
+    mAudioFrame->avframe->nb_samples = remain;
+#if OUT_TO_FILE
+    fwrite(mAudioFrame->avframe->data[0], sizeof(int16_t), remain * channels, mFile);
+#else
+    ret = encodeAudioFrame(mAudioFrame->avframe);
+#endif
+    mAudioFrame->avframe->nb_samples = frameSize;
+    return ret;
 }
 
 int XMixer::openOutFile(const std::string &filename) {
+    // 分段输出时由 hls/segment 复用器自己打开段文件和播放列表: HLS 的 fMP4/TS 段用 hls, ADTS 段用 segment
+    const char* formatName = nullptr;
+    std::string url = filename;
+    bool adts = mSegmentOptions.format == XSegmentFormat::ADTS;
+    if (mSegmentOptions.enabled) {
+        static const char* const EXTENSIONS[] = {".m4s", ".ts", ".aac"};
+        size_t slash = filename.find_last_of('/');
+        size_t dot = filename.find_last_of('.');
+        std::string base = dot != std::string::npos && (slash == std::string::npos || dot > slash) ?
+                           filename.substr(0, dot) : filename;
+        mSegmentPlaylist = filename;
+        mSegmentPattern = base + "_%05d" + EXTENSIONS[static_cast<int>(mSegmentOptions.format)];
+        mSegmentInit = mSegmentOptions.format == XSegmentFormat::FMP4 ? base + "_init.mp4" : std::string();
+        mSegmentFiles.clear();
+        mClosedSegments.clear();
+        mSegmentIndex = 0;
+        formatName = adts ? "segment" : "hls";
+        url = adts ? mSegmentPattern : filename;
+    }
+
     AVFormatContext *ic = nullptr;
-    int ret = avformat_alloc_output_context2(&ic, nullptr, nullptr, filename.data());
+    int ret = avformat_alloc_output_context2(&ic, nullptr, formatName, url.data());
     if (ret < 0) {
-        av_log(nullptr, AV_LOG_FATAL, "[XMixer] avformat_alloc_output_context2 failed: %s\n", av_err2str(ret));
+        XLOG(AV_LOG_FATAL, "XMixer", "avformat_alloc_output_context2 failed: %s", av_err2str(ret));
         return ret;
     }
     mFormatCtx = std::shared_ptr<AVFormatContext>(ic, OutputFormatDeleter());
 
+    // 复用器把 opaque 和这两个回调传给内部每段的复用器, 段文件的打开和关闭都能看到
+    if (mSegmentOptions.enabled) {
+        mIoOpen = ic->io_open;
+        mIoClose = ic->io_close;
+        ic->opaque = this;
+        ic->io_open = segmentIoOpen;
+        ic->io_close = segmentIoClose;
+    }
+
+    // 画面源的流排在音频前面, 和常见的视频文件一致
+    mPictureCtx.reset();
+    if (!mRemuxOptions.pictureSource.empty()) {
+        if (mSegmentOptions.enabled && adts) {
+            XLOG(AV_LOG_WARNING, "XMixer", "ADTS segments cannot carry picture source: %s",
+                 mRemuxOptions.pictureSource.data());
+        } else {
+            ret = openPictureSource();
+            if (ret < 0) {
+                return ret;
+            }
+        }
+    }
+
     ret = addAudioStream();
     if (ret < 0) {
         return ret;
     }
 
-    ret = avio_open(&ic->pb, filename.data(), AVIO_FLAG_WRITE);
-    if (ret < 0) {
-        av_log(nullptr, AV_LOG_FATAL, "[XMixer] avio_open failed: %s\n", av_err2str(ret));
-        return ret;
+    if (!(ic->oformat->flags & AVFMT_NOFILE)) {
+        ret = avio_open(&ic->pb, url.data(), AVIO_FLAG_WRITE);
+        if (ret < 0) {
+            XLOG(AV_LOG_FATAL, "XMixer", "avio_open failed: %s", av_err2str(ret));
+            return ret;
+        }
     }
 
-    ret = avformat_write_header(ic, nullptr);
+    AVDictionary* options = mSegmentOptions.enabled ? segmentMuxerOptions() : nullptr;
+    ret = avformat_write_header(ic, &options);
+    av_dict_free(&options);
     if (ret < 0) {
-        av_log(nullptr, AV_LOG_FATAL, "[XMixer] avformat_write_header failed: %s\n", av_err2str(ret));
+        XLOG(AV_LOG_FATAL, "XMixer", "avformat_write_header failed: %s", av_err2str(ret));
         return ret;
     }
 
     return 0;
 }
 
+AVDictionary* XMixer::segmentMuxerOptions() {
+    AVDictionary* options = nullptr;
+    char duration[32];
+    snprintf(duration, sizeof(duration), "%.3f", std::max(1, mSegmentOptions.durationMs) / 1000.0);
+
+    if (mSegmentOptions.format == XSegmentFormat::ADTS) {
+        av_dict_set(&options, "segment_format", "adts", 0);
+        av_dict_set(&options, "segment_time", duration, 0);
+        av_dict_set(&options, "segment_list", mSegmentPlaylist.data(), 0);
+        av_dict_set(&options, "segment_list_type", "m3u8", 0);
+        return options;
+    }
+
+    // 播放列表保留全部段, 结束时加上 ENDLIST; 段和播放列表都先写临时文件再改名, 拉取方不会读到写了一半的文件
+    bool fmp4 = mSegmentOptions.format == XSegmentFormat::FMP4;
+    av_dict_set(&options, "hls_time", duration, 0);
+    av_dict_set(&options, "hls_list_size", "0", 0);
+    av_dict_set(&options, "hls_playlist_type", "event", 0);
+    av_dict_set(&options, "hls_flags", "temp_file+independent_segments", 0);
+    av_dict_set(&options, "hls_segment_type", fmp4 ? "fmp4" : "mpegts", 0);
+    av_dict_set(&options, "hls_segment_filename", mSegmentPattern.data(), 0);
+    if (fmp4) {
+        // 初始化段的名字相对于播放列表所在目录
+        size_t slash = mSegmentInit.find_last_of('/');
+        std::string name = slash == std::string::npos ? mSegmentInit : mSegmentInit.substr(slash + 1);
+        av_dict_set(&options, "hls_fmp4_init_filename", name.data(), 0);
+    }
+    return options;
+}
+
+int XMixer::segmentIoOpen(AVFormatContext* s, AVIOContext** pb, const char* url, int flags,
+                          AVDictionary** options) {
+    auto* mixer = static_cast<XMixer*>(s->opaque);
+    int ret = mixer->mIoOpen(s, pb, url, flags, options);
+    if (ret >= 0 && (flags & AVIO_FLAG_WRITE)) {
+        mixer->mSegmentFiles[*pb] = url;
+    }
+    return ret;
+}
+
+void XMixer::segmentIoClose(AVFormatContext* s, AVIOContext* pb) {
+    auto* mixer = static_cast<XMixer*>(s->opaque);
+    auto it = mixer->mSegmentFiles.find(pb);
+    if (it != mixer->mSegmentFiles.end()) {
+        // 临时文件在关闭之后改名, 通知时用最终的名字
+        std::string path = it->second;
+        mixer->mSegmentFiles.erase(it);
+        const std::string suffix = ".tmp";
+        if (path.size() > suffix.size() && path.compare(path.size() - suffix.size(), suffix.size(), suffix) == 0) {
+            path.resize(path.size() - suffix.size());
+        }
+        if (path != mixer->mSegmentPlaylist && path != mixer->mSegmentInit) {
+            mixer->mClosedSegments.push_back(path);
+        }
+    }
+    mixer->mIoClose(s, pb);
+}
+
+void XMixer::publishSegments() {
+    for (auto& path : mClosedSegments) {
+        XSegmentInfo info;
+        info.index = mSegmentIndex++;
+        info.path = path;
+        XLOG(AV_LOG_VERBOSE, "XMixer", "segment %d finished: %s", info.index, info.path.data());
+        if (mSegmentOptions.callback) {
+            mSegmentOptions.callback(info);
+        }
+    }
+    mClosedSegments.clear();
+}
+
 int XMixer::addAudioStream() {
     if (!mFormatCtx) {
         return AVERROR(EINVAL);
     }
 
+    int ret = openEncoder();
+    if (ret < 0) {
+        return ret;
+    }
+
+    AVCodecContext *avctx = mAudioCodecCtx.get();
+    AVStream *stream = avformat_new_stream(mFormatCtx.get(), avctx->codec);
+    if (!stream) {
+        XLOG(AV_LOG_FATAL, "XMixer", "cannot new audio stream");
+        return AVERROR(ENOMEM);
+    }
+    mAudioIndex = stream->index;
+    stream->time_base = avctx->time_base;
+    if (mDuration > 0) {
+        stream->duration = av_rescale_q(mDuration, AVRational{1, OUT_SAMPLE_RATE}, stream->time_base);
+    }
+
+    ret = avcodec_parameters_from_context(stream->codecpar, avctx);
+    if (ret < 0) {
+        XLOG(AV_LOG_FATAL, "XMixer", "avcodec_parameters_from_context failed: %s", av_err2str(ret));
+        return ret;
+    }
+
+    return 0;
+}
+
+int XMixer::openEncoder() {
     AVCodec *codec = avcodec_find_encoder_by_name("libfdk_aac");
     if (!codec) {
-        av_log(nullptr, AV_LOG_FATAL, "[XMixer] cannot find (%s) encoder\n", avcodec_get_name(AV_CODEC_ID_AAC));
+        XLOG(AV_LOG_FATAL, "XMixer", "cannot find (%s) encoder", avcodec_get_name(AV_CODEC_ID_AAC));
         return AVERROR_ENCODER_NOT_FOUND;
     }
 
     AVCodecContext *avctx = avcodec_alloc_context3(codec);
     if (!avctx) {
-        av_log(nullptr, AV_LOG_FATAL, "[XMixer] avcodec_alloc_context3 failed\n");
+        XLOG(AV_LOG_FATAL, "XMixer", "avcodec_alloc_context3 failed");
         return AVERROR(ENOMEM);
     }
     mAudioCodecCtx = std::shared_ptr<AVCodecContext>(avctx, CodecDeleter());
@@ -149,62 +1249,301 @@ int XMixer::addAudioStream() {
     avctx->channels = av_get_channel_layout_nb_channels(avctx->channel_layout);
     avctx->time_base = {1, avctx->sample_rate};
 
-    if (mFormatCtx->oformat->flags & AVFMT_GLOBALHEADER) {
+    // 分段复用器本身不要求全局头, 但段内的 mp4 需要; ts 和 adts 复用器会自己补 ADTS 头
+    if ((mFormatCtx->oformat->flags & AVFMT_GLOBALHEADER) || mSegmentOptions.enabled) {
         avctx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
     }
 
     int ret = avcodec_open2(avctx, nullptr, nullptr);
     if (ret < 0) {
-        av_log(nullptr, AV_LOG_FATAL, "[XMixer] avcodec_open2 failed: %s\n", av_err2str(ret));
+        XLOG(AV_LOG_FATAL, "XMixer", "avcodec_open2 failed: %s", av_err2str(ret));
         return ret;
     }
 
-    AVStream *stream = avformat_new_stream(mFormatCtx.get(), codec);
-    if (!stream) {
-        av_log(nullptr, AV_LOG_FATAL, "[XMixer] cannot new audio stream\n");
-        return AVERROR(ENOMEM);
+    return 0;
+}
+
+int XMixer::encodeAudioFrame(AVFrame* frame) {
+    XTRACE_SCOPE("encodeAudioFrame");
+
+    int64_t start = XTelemetry::isEnabled() ? XTelemetry::now() : 0;
+    int64_t encodeNs = 0;
+    if (frame) {
+        frame->pts = mEncodeSampleCount;
+    }
+    int ret = avcodec_send_frame(mAudioCodecCtx.get(), frame);
+    if (ret < 0 && ret != AVERROR(EOF) && ret != AVERROR(EAGAIN)) {
+        XLOG(AV_LOG_FATAL, "XMixer", "avcodec_send_frame failed: %s", av_err2str(ret));
+        return ret;
+    }
+    if (frame) {
+        mEncodeSampleCount += frame->nb_samples;
     }
-    mAudioIndex = stream->index;
-    stream->time_base = avctx->time_base;
 
-    ret = avcodec_parameters_from_context(stream->codecpar, avctx);
-    if (ret < 0) {
-        av_log(nullptr, AV_LOG_FATAL, "[XMixer] avcodec_parameters_from_context failed: %s\n", av_err2str(ret));
+    auto pkt = std::make_unique<Packet>();
+    for (;;) {
+        ret = avcodec_receive_packet(mAudioCodecCtx.get(), pkt->avpkt);
+        if (start > 0) {
+            int64_t now = XTelemetry::now();
+            encodeNs += now - start;
+            start = now;
+        }
+        if (ret < 0) {
+            break;
+        }
+
+        // 直通切换前后编码器冲洗和预热产生的包, 和直通的包时间上重叠
+        if (pkt->avpkt->pts < mEncodeValidFrom || pkt->avpkt->pts >= mEncodeValidTo) {
+            av_packet_unref(pkt->avpkt);
+            continue;
+        }
+
+        ret = writePacket(pkt->avpkt);
+        if (start > 0) {
+            int64_t now = XTelemetry::now();
+            mWriteHistogram.record(static_cast<uint64_t>(now - start));
+            mEncodeNs += now - start;
+            start = now;
+        }
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    if (encodeNs > 0) {
+        mEncodeHistogram.record(static_cast<uint64_t>(encodeNs));
+        mEncodeNs += encodeNs;
+    }
+
+    if (ret != AVERROR(EAGAIN) && ret != AVERROR_EOF) {
+        XLOG(AV_LOG_FATAL, "XMixer", "avcodec_receive_packet failed: %s", av_err2str(ret));
         return ret;
     }
 
     return 0;
 }
 
-int XMixer::encodeAudioFrame() {
+int XMixer::writePacket(AVPacket* pkt) {
+    XTRACE_SCOPE("av_interleaved_write_frame");
 
-    mAudioFrame->avframe->pts = mEncodeSampleCount;
-    int ret = avcodec_send_frame(mAudioCodecCtx.get(), mAudioFrame->avframe);
-    if (ret < 0 && ret != AVERROR(EOF) && ret != AVERROR(EAGAIN)) {
-        av_log(nullptr, AV_LOG_FATAL, "[XMixer] avcodec_send_frame failed: %s\n", av_err2str(ret));
+    // 先把画面源里时间上不晚于这个音频包的包写进去, 复用器只需要缓存很短的一段就能交错
+    if (mPictureCtx && pkt->dts != AV_NOPTS_VALUE) {
+        int ret = writePicture(av_rescale(pkt->dts, AV_TIME_BASE, OUT_SAMPLE_RATE));
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    AVStream *stream = mFormatCtx->streams[mAudioIndex];
+    av_packet_rescale_ts(pkt, AVRational{1, OUT_SAMPLE_RATE}, stream->time_base);
+    pkt->stream_index = stream->index;
+
+    int ret = av_interleaved_write_frame(mFormatCtx.get(), pkt);
+    if (ret < 0) {
+        XLOG(AV_LOG_FATAL, "XMixer", "av_interleaved_write_frame failed: %s", av_err2str(ret));
+    }
+
+    // 写包时切出的段此时已经改名并列入播放列表
+    if (!mClosedSegments.empty()) {
+        publishSegments();
+    }
+    return ret;
+}
+
+int XMixer::openPictureSource() {
+    const std::string& filename = mRemuxOptions.pictureSource;
+    AVFormatContext *ic = nullptr;
+    int ret = avformat_open_input(&ic, filename.data(), nullptr, nullptr);
+    if (ret < 0) {
+        XLOG(AV_LOG_FATAL, "XMixer", "open picture source failed: %s: %s", av_err2str(ret), filename.data());
         return ret;
     }
-    mEncodeSampleCount += mAudioFrame->avframe->nb_samples;
+    mPictureCtx = std::unique_ptr<AVFormatContext, InputFormatDeleter>(ic);
 
-    auto pkt = std::make_unique<Packet>();
-    ret = avcodec_receive_packet(mAudioCodecCtx.get(), pkt->avpkt);
-    if (ret >= 0) {
-        AVStream *stream = mFormatCtx->streams[mAudioIndex];
-        av_packet_rescale_ts(pkt->avpkt, mAudioCodecCtx->time_base, stream->time_base);
-        pkt->avpkt->stream_index = stream->index;
+    ret = avformat_find_stream_info(ic, nullptr);
+    if (ret < 0) {
+        XLOG(AV_LOG_FATAL, "XMixer", "avformat_find_stream_info failed: %s: %s", av_err2str(ret), filename.data());
+        return ret;
+    }
 
-        ret = av_interleaved_write_frame(mFormatCtx.get(), pkt->avpkt);
+    // 画面源的时间戳减去它自己的起始时间, 和从 0 开始的混音结果对齐
+    mPictureStart = ic->start_time != AV_NOPTS_VALUE ? ic->start_time : 0;
+    mPictureEnd = false;
+    mPicturePending.reset();
+    mPictureMap.assign(ic->nb_streams, -1);
+
+    for (unsigned int i = 0; i < ic->nb_streams; ++i) {
+        AVStream *in = ic->streams[i];
+        AVMediaType type = in->codecpar->codec_type;
+
+        // 封面图不是连续的画面, 不复制; 源文件自己的音轨由混音结果代替
+        bool wanted = (type == AVMEDIA_TYPE_VIDEO && !(in->disposition & AV_DISPOSITION_ATTACHED_PIC)) ||
+                      (type == AVMEDIA_TYPE_SUBTITLE && mRemuxOptions.copySubtitles);
+        if (wanted && avformat_query_codec(mFormatCtx->oformat, in->codecpar->codec_id, FF_COMPLIANCE_NORMAL) == 0) {
+            XLOG(AV_LOG_WARNING, "XMixer", "output format %s cannot hold %s, stream %u skipped",
+                 mFormatCtx->oformat->name, avcodec_get_name(in->codecpar->codec_id), i);
+            wanted = false;
+        }
+        if (!wanted) {
+            in->discard = AVDISCARD_ALL;
+            continue;
+        }
+
+        AVStream *out = avformat_new_stream(mFormatCtx.get(), nullptr);
+        if (!out) {
+            return AVERROR(ENOMEM);
+        }
+        ret = avcodec_parameters_copy(out->codecpar, in->codecpar);
         if (ret < 0) {
-            av_log(nullptr, AV_LOG_FATAL, "[XMixer] av_interleaved_write_frame failed: %s\n", av_err2str(ret));
             return ret;
         }
-        return 1;
+        // 源容器的 codec tag 在输出容器里不一定合法, 交给复用器重新选
+        out->codecpar->codec_tag = 0;
+        out->time_base = in->time_base;
+        out->avg_frame_rate = in->avg_frame_rate;
+        out->sample_aspect_ratio = in->sample_aspect_ratio;
+        out->disposition = in->disposition;
+        av_dict_copy(&out->metadata, in->metadata, 0);
+        mPictureMap[i] = out->index;
     }
 
-    if (ret < 0 && ret != AVERROR(EAGAIN)) {
-        av_log(nullptr, AV_LOG_FATAL, "[XMixer] avcodec_receive_packet failed: %s\n", av_err2str(ret));
-        return ret;
+    if (std::all_of(mPictureMap.begin(), mPictureMap.end(), [](int index) { return index < 0; })) {
+        XLOG(AV_LOG_WARNING, "XMixer", "picture source has no stream to copy: %s", filename.data());
+        mPictureCtx.reset();
     }
+    return 0;
+}
+
+int XMixer::writePicture(int64_t until) {
+    while (mPictureCtx && !mPictureEnd) {
+        if (!mPicturePending) {
+            auto pkt = std::make_unique<Packet>();
+            int ret = av_read_frame(mPictureCtx.get(), pkt->avpkt);
+            if (ret < 0) {
+                if (ret != AVERROR_EOF) {
+                    XLOG(AV_LOG_ERROR, "XMixer", "read picture source failed: %s", av_err2str(ret));
+                }
+                mPictureEnd = true;
+                break;
+            }
+            int index = pkt->avpkt->stream_index;
+            if (index < 0 || index >= static_cast<int>(mPictureMap.size()) || mPictureMap[index] < 0) {
+                continue;
+            }
+            mPicturePending = std::move(pkt);
+        }
 
+        // 这个包比音频还靠后, 留到下一个音频包之后再写
+        AVPacket *pkt = mPicturePending->avpkt;
+        AVStream *in = mPictureCtx->streams[pkt->stream_index];
+        int64_t offset = av_rescale_q(mPictureStart, AV_TIME_BASE_Q, in->time_base);
+        int64_t ts = pkt->dts != AV_NOPTS_VALUE ? pkt->dts : pkt->pts;
+        if (ts != AV_NOPTS_VALUE && av_rescale_q(ts - offset, in->time_base, AV_TIME_BASE_Q) > until) {
+            break;
+        }
+
+        AVStream *out = mFormatCtx->streams[mPictureMap[pkt->stream_index]];
+        if (pkt->pts != AV_NOPTS_VALUE) {
+            pkt->pts -= offset;
+        }
+        if (pkt->dts != AV_NOPTS_VALUE) {
+            pkt->dts -= offset;
+        }
+        av_packet_rescale_ts(pkt, in->time_base, out->time_base);
+        pkt->stream_index = out->index;
+        pkt->pos = -1;
+
+        int ret = av_interleaved_write_frame(mFormatCtx.get(), pkt);
+        mPicturePending.reset();
+        if (ret < 0) {
+            XLOG(AV_LOG_FATAL, "XMixer", "write picture packet failed: %s", av_err2str(ret));
+            return ret;
+        }
+        mPicturePackets.add();
+    }
     return 0;
-}
\ No newline at end of file
+}
+
+std::shared_ptr<Packet> XMixer::passthroughPacket(XMixTrack& track, FILE* spill) {
+    if (!mPassthroughOptions.enabled || spill || mDucker || mLimiter || !mMasterEffects.empty() ||
+        !mOutPending.empty() || mOutputSkip > 0) {
+        return nullptr;
+    }
+    if (!track.effects.empty() || track.meter || track.gain * track.normGain != 1.0f || !mBuses.empty()) {
+        return nullptr;
+    }
+
+    // 解码器只在样本和包一一对应时给出包, 还要求这个包正好是一个编码帧
+    std::shared_ptr<Packet> packet = track.decoder->passthroughPacket();
+    if (!packet || mAudioCodecCtx->frame_size != 1024) {
+        return nullptr;
+    }
+    return packet;
+}
+
+int XMixer::writePassthrough(const Packet& packet, const int16_t* pcm) {
+    int ret = mPassthrough ? 0 : enterPassthrough(pcm);
+    if (ret < 0) {
+        return ret;
+    }
+
+    auto pkt = std::make_unique<Packet>();
+    ret = av_packet_ref(pkt->avpkt, packet.avpkt);
+    if (ret < 0) {
+        return ret;
+    }
+
+    int frameSize = mAudioCodecCtx->frame_size;
+    if (mMixWaveform) {
+        mMixWaveform->processS16(pcm, frameSize);
+    }
+    pkt->avpkt->pts = mEncodeSampleCount;
+    pkt->avpkt->dts = mEncodeSampleCount;
+    pkt->avpkt->duration = frameSize;
+    pkt->avpkt->flags |= AV_PKT_FLAG_KEY;
+    mEncodeSampleCount += frameSize;
+    mPassthroughFrames.add();
+    return writePacket(pkt->avpkt);
+}
+
+int XMixer::enterPassthrough(const int16_t* pcm) {
+    // 当前块也送进编码器再冲洗: 编码器最后一个包的重叠窗口里是真实信号, 和直通的第一个包衔接时混叠可以抵消;
+    // 当前块自己产生的包和直通的包重叠, 丢掉
+    int64_t start = mEncodeSampleCount;
+    int frameCount = mAudioCodecCtx->frame_size * OUT_SAMPLE_CHANNELS;
+    memcpy(mAudioFrame->avframe->data[0], pcm, frameCount * sizeof(int16_t));
+
+    mEncodeValidTo = start;
+    int ret = encodeAudioFrame(mAudioFrame->avframe);
+    if (ret >= 0) {
+        ret = encodeAudioFrame(nullptr);
+    }
+    mEncodeValidTo = INT64_MAX;
+    mEncodeSampleCount = start;
+    mPassthrough = true;
+
+    XLOG(AV_LOG_VERBOSE, "XMixer", "passthrough on at %.3f s", static_cast<double>(start) / OUT_SAMPLE_RATE);
+    return ret;
+}
+
+int XMixer::leavePassthrough() {
+    // 冲洗过的编码器不能再用, 重建一个, 先用直通段最后几帧预热, 预热产生的包和直通的包重叠, 丢掉
+    int64_t end = mEncodeSampleCount;
+    mPassthrough = false;
+    mPassthroughRun = 0;
+    int ret = openEncoder();
+    if (ret < 0) {
+        return ret;
+    }
+
+    int frameCount = mAudioCodecCtx->frame_size * OUT_SAMPLE_CHANNELS;
+    mEncodeSampleCount = end - PREROLL_FRAMES * mAudioCodecCtx->frame_size;
+    mEncodeValidFrom = end;
+    for (int i = 0; i < PREROLL_FRAMES && ret >= 0; ++i) {
+        memcpy(mAudioFrame->avframe->data[0], mPreroll.data() + i * frameCount, frameCount * sizeof(int16_t));
+        ret = encodeAudioFrame(mAudioFrame->avframe);
+    }
+
+    XLOG(AV_LOG_VERBOSE, "XMixer", "passthrough off at %.3f s", static_cast<double>(end) / OUT_SAMPLE_RATE);
+    return ret;
+}
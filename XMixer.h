@@ -8,10 +8,194 @@
 #define OUT_TO_FILE 0
 
 #include "XFFHeader.h"
+#include <functional>
+#include <map>
 #include <string>
 #include <vector>
+#include <atomic>
+#include "XDecoder.h"
+#include "XPlaylist.h"
+#include "XDucker.h"
+#include "XAudioEffect.h"
+#include "XTelemetry.h"
 
-class XDecoder;
+class XLoudnessMeter;
+class XLoudnessCache;
+class XProbeCache;
+class XLimiter;
+class XMixPool;
+class XSharedSource;
+class XWaveform;
+
+struct XLoudnessOptions {
+    /* 打开后对每路输入和总线测量 BS.1770 响度, 并在编码前做真峰值限幅 */
+    bool enabled = false;
+
+    double targetLufs = -23.0;
+    double truePeakDb = -1.0;
+
+    /* 两遍模式: 第一遍把总线缓存到临时文件并测量响度, 第二遍按测得的响度调整增益后编码, 不需要重新解码 */
+    bool twoPass = false;
+
+    /* 素材响度缓存文件, 命中时按缓存的响度把每路输入预先归一化到目标响度, 为空则不使用 */
+    std::string cachePath;
+};
+
+struct XTelemetryOptions {
+    /* 打开后记录各阶段耗时直方图和队列占用, 开销在 1% 以内; 进程内所有混音器共用这个开关 */
+    bool enabled = false;
+
+    /* 非空时混音过程中按间隔把 stats() 以 JSON 写入该文件, 结束时再写一次 */
+    std::string dumpPath;
+    int dumpIntervalMs = 1000;
+
+    /* 编译时打开 XTRACE_ENABLED 才有效: mix() 结束时写出线程时间线, 为空则写到 <输出文件>.trace.json */
+    std::string tracePath;
+};
+
+struct XPassthroughOptions {
+    /*
+     * 只有一路输入发声, 且它是和输出参数一致的 AAC-LC 时, 把它的原始包直接封装到输出, 省掉编码也没有二次压缩的损失;
+     * 需要在 add 之前设置. 打开响度处理/闪避/主总线音效, 或者这一路有音效/增益时不会直通
+     */
+    bool enabled = false;
+
+    /* 连续满足条件的帧数达到该值才切到直通, 每次切换都要冲洗并重建编码器, 避免来回切换 */
+    int minFrames = 43;
+};
+
+struct XRemuxOptions {
+    /*
+     * 画面源: 非空时把它的视频(和字幕)包原样复制到输出, 和混音后的音频在同一遍里交错写入, 不重新编码;
+     * 输出格式需要能装下画面源的编码, 装不下的流跳过
+     */
+    std::string pictureSource;
+
+    bool copySubtitles = true;
+};
+
+struct XWaveformOptions {
+    /*
+     * 打开后在混音的同时生成每路输入(裁剪之后, 增益和音效之前)和混音结果的多级波形概览, 格式见 XWaveform;
+     * 混音结果写到 "<输出文件>.wave", 第 i 路输入写到 "<输出文件>.<i>.wave"
+     */
+    bool enabled = false;
+
+    /* 每一级每格的采样点数 */
+    std::vector<int> binSizes = {256, 1024, 8192};
+};
+
+struct XMemoryOptions {
+    /*
+     * 所有解码器的样本缓冲、包队列和共享素材缓存加起来的上限, 进程内所有混音器共用; 0 表示不限制.
+     * 各路缓冲按码率和等待情况在上限内分配, 上限太小时每路降到最小, 不会拒绝输入
+     */
+    int64_t limitBytes = 0;
+};
+
+enum class XSegmentFormat {
+    FMP4,       // HLS fMP4: 初始化段 "<名字>_init.mp4" 加 .m4s 分片
+    MPEGTS,     // HLS MPEG-TS
+    ADTS        // HLS 打包音频, 每段一个 .aac, 不带时间戳, 不写画面源
+};
+
+struct XSegmentInfo {
+    int index = 0;
+    std::string path;
+};
+
+struct XSegmentOptions {
+    /*
+     * 分段输出: mix 的 outPath 作为 m3u8 播放列表, 每段编码完立即写完、更新播放列表并回调, 不用等整个混音结束
+     * 就可以开始分发. 段文件和播放列表在同一目录, 名为 "<播放列表去掉扩展名>_<序号>.<扩展名>"
+     */
+    bool enabled = false;
+    XSegmentFormat format = XSegmentFormat::FMP4;
+    int durationMs = 4000;
+
+    /* 段文件写完并且已经列入播放列表后在混音线程里调用 */
+    std::function<void(const XSegmentInfo&)> callback;
+};
+
+enum class XTrackRole {
+    NORMAL,
+    VOICE,      // 人声, 作为闪避的侧链
+    BED         // 背景音乐/环境声, 人声出现时被压低
+};
+
+struct XMixTrack {
+    std::shared_ptr<XDecoder> decoder;
+    std::string filename;
+    XTrackRole role = XTrackRole::NORMAL;
+    float gain = 1.0f;
+
+    /* 响度缓存命中时归一化到目标响度的增益, 由混音器在混音开始时设置, 混音时和 gain 相乘 */
+    float normGain = 1.0f;
+
+    /* 所在子混音总线的名字, 为空时直接接到主总线; 接到子混音总线时 role 不起作用, 由总线的 role 决定闪避 */
+    std::string bus;
+
+    /* 在时间线上的起始位置, 之前这一路是静音 */
+    int64_t offsetMs = 0;
+
+    /* 素材内的裁剪范围: 跳过开头的 trimStartMs, 只用之后的 trimLengthMs, 小于等于 0 表示用到结尾 */
+    int64_t trimStartMs = 0;
+    int64_t trimLengthMs = 0;
+
+    bool finished = false;
+
+    /* 读到结尾时在时间线上的位置(样本), 混音结束时用来确定输出长度 */
+    int64_t endSample = -1;
+
+    /* 裁剪起点之后已经取出的字节数 */
+    int64_t consumed = -1;
+
+    /* 在样本转成 float 之后, 累加到总线之前处理 */
+    XEffectChain effects;
+
+    /* 本块的样本: 指向解码器样本缓冲内部(零拷贝, 块结束时归还 peeked 字节)或者 pcm */
+    const int16_t* view = nullptr;
+    int peeked = 0;
+
+    std::vector<int16_t> pcm;
+    std::vector<float> samples;
+    std::unique_ptr<XLoudnessMeter> meter;
+    std::unique_ptr<XWaveform> waveform;
+};
+
+/* 子混音总线: 输入和下级总线先在这里求和, 经过音效和增益后送到上级总线, 上级为空时送到主总线 */
+struct XSubmixBus {
+    std::string name;
+    std::string parent;
+
+    /* 直接接到主总线时参与闪避: 人声总线作为侧链, 背景总线被压低 */
+    XTrackRole role = XTrackRole::NORMAL;
+    float gain = 1.0f;
+
+    /* 在增益之前处理 */
+    XEffectChain effects;
+
+    /* 以下由混音器维护 */
+    XSubmixBus* parentBus = nullptr;
+    std::vector<float> samples;
+    bool silent = true;
+};
+
+/* 并行混音的一个任务: 同一条总线上的一组输入先累加到任务自己的部分和, 再由混音线程按总线树归并 */
+struct XMixWork {
+    XSubmixBus* bus = nullptr;
+    std::vector<XMixTrack*> tracks;
+
+    /* 直接接到主总线的任务按角色分开累加, 供闪避使用 */
+    std::vector<float> sum;
+    std::vector<float> voice;
+    std::vector<float> bed;
+
+    bool silent = true;
+    int audibleTracks = 0;
+    XMixTrack* soloTrack = nullptr;
+    int64_t waitNs = 0;
+};
 
 class XMixer {
 public:
@@ -19,16 +203,145 @@ public:
 
     ~XMixer();
 
-    void add(const std::string& filename);
+    /*
+     * 同一个点播文件再次加入时不再单独解码: 所有位置共用一路解码器, 解码结果按块共享, 各自按 offsetMs、gain
+     * 和裁剪范围读取. 只有影响解码结果的选项(静音门限、保留原始包、并行解码、格式提示)都相同时才共享,
+     * 不同时单独打开一路解码器. 打开直通时不共享.
+     * 共享的块最多缓存约 24 秒, 位置之间相差更远时落后的位置改用自己的解码器
+     */
+    std::shared_ptr<XMixTrack> add(const std::string& filename, const XDecoderOptions& options = XDecoderOptions());
+
+    /*
+     * 把多轨文件(MOV/MKV 分轨)里的多路音频流分别作为输入, 文件只解封装一次; streams 为空时取全部音频流.
+     * 每一路的 filename 为 "<文件>#<流序号>", 不参与响度缓存
+     */
+    std::vector<std::shared_ptr<XMixTrack>> addStreams(const std::string& filename,
+                                                       const std::vector<int>& streams = std::vector<int>(),
+                                                       const XDecoderOptions& options = XDecoderOptions());
+
+    /*
+     * 播放列表输入: files 在同一个位置上依次首尾相接地解码, 同时最多打开两个; 返回的输入和 add 一样可以设置
+     * offsetMs、gain、裁剪和总线. 不参与共享解码、直通和响度缓存
+     */
+    std::shared_ptr<XMixTrack> addPlaylist(const std::vector<std::string>& files,
+                                           const XPlaylistOptions& options = XPlaylistOptions(),
+                                           const XDecoderOptions& decoderOptions = XDecoderOptions());
 
     void mix(const std::string& outPath);
 
+    /* 结束正在进行的混音, 直播输入不会自己结束, 需要调用方在其它线程里调用 */
+    void stop();
+
+    void setLoudness(const XLoudnessOptions& options);
+
+    void setDucking(const XDuckingOptions& options);
+
+    /* 主总线音效链, 在闪避之后, 响度测量和限幅之前处理 */
+    XEffectChain& masterEffects();
+
+    void setTelemetry(const XTelemetryOptions& options);
+
+    void setPassthrough(const XPassthroughOptions& options);
+
+    /* 把画面源的视频和混音结果一起写到输出, 在 mix 之前设置 */
+    void setRemux(const XRemuxOptions& options);
+
+    void setWaveform(const XWaveformOptions& options);
+
+    /* 内存预算, 对之后的输入立即生效, 已经在解码的输入在下次重新分配时调整 */
+    void setMemoryBudget(const XMemoryOptions& options);
+
+    /* 分段输出, 在 mix 之前设置 */
+    void setSegments(const XSegmentOptions& options);
+
+    /* 每个混音块的样本数, 和编码帧大小无关; 打开直通时按编码帧大小混音 */
+    void setBlockSize(int nbSamples);
+
+    /* 探测结果缓存文件, 需要在 add 之前设置, 为空则不使用; mix 开始时写回 */
+    void setProbeCache(const std::string& path);
+
+    /*
+     * 增加一条子混音总线, parent 为上级总线的名字, 为空时接到主总线; 输入通过 XMixTrack::bus 指定所在的总线.
+     * 需要在 mix 之前设置, 名字重复时返回已有的总线. 有子混音总线时不会直通
+     */
+    std::shared_ptr<XSubmixBus> addBus(const std::string& name, const std::string& parent = std::string());
+
+    /*
+     * 混音线程数(包含混音线程本身), 小于等于 0 时取 CPU 核数. 每条总线上的输入分成若干组在多个线程上
+     * 同时取样本、转换、处理音效和求和, 分组只和线程数有关, 同样的线程数输出逐样本一致
+     */
+    void setMixThreads(int threads);
+
+    /* 当前的性能统计快照, 混音过程中可以在其它线程调用 */
+    XMixerStats stats() const;
+
+private:
+    friend class XMixerBench;
+
 private:
+    /* 文件已经加入过时返回共享素材的读取器, 第一次加入的输入也改为从共享素材读取; 不能共享时返回空 */
+    std::shared_ptr<XDecoder> sharedDecoder(const std::string& filename, const XDecoderOptions& options);
+
     int openOutFile(const std::string& filename);
 
+    /* 分段复用器(hls/segment)的选项 */
+    AVDictionary* segmentMuxerOptions();
+
+    /* 分段复用器打开和关闭文件都经过这里, 记下关闭的段文件, 由 publishSegments 在写包之后通知 */
+    static int segmentIoOpen(AVFormatContext* s, AVIOContext** pb, const char* url, int flags,
+                             AVDictionary** options);
+
+    static void segmentIoClose(AVFormatContext* s, AVIOContext* pb);
+
+    void publishSegments();
+
     int addAudioStream();
 
-    int encodeAudioFrame();
+    int openEncoder();
+
+    /* frame 为空时冲洗编码器 */
+    int encodeAudioFrame(AVFrame* frame);
+
+    /* pts 以样本为单位 */
+    int writePacket(AVPacket* pkt);
+
+    int openPictureSource();
+
+    /* 复制画面源里时间不晚于 until(AV_TIME_BASE) 的包 */
+    int writePicture(int64_t until);
+
+    std::shared_ptr<Packet> passthroughPacket(XMixTrack& track, FILE* spill);
+
+    int writePassthrough(const Packet& packet, const int16_t* pcm);
+
+    int enterPassthrough(const int16_t* pcm);
+
+    int leavePassthrough();
+
+    /* 解析总线树, 按线程数把输入分成任务 */
+    void prepareBuses(int busCount);
+
+    /* 工作线程里执行: 取这组输入的样本, 处理后累加到任务的部分和 */
+    void renderWork(XMixWork& work, int64_t blockPos, int blockSize, bool telemetry);
+
+    /* 把各任务的部分和按总线树自下而上归并到主总线, 全部静音时返回 true */
+    bool reduceBuses(int count);
+
+    int processBus(int nbSamples, FILE* spill, bool silent);
+
+    int writeBus(float* samples, int nbSamples);
+
+    int flushBus();
+
+    void prepareLoudness();
+
+    void finishLoudness();
+
+    void prepareWaveform();
+
+    void finishWaveform(const std::string& outPath);
+
+    void dumpStats();
 
 private:
     const int OUT_SAMPLE_FMT = AV_SAMPLE_FMT_S16;
@@ -36,6 +349,12 @@ private:
     const int OUT_SAMPLE_CHANNELS = 2;
     const uint64_t OUT_SAMPLE_CHANNEL_LAYOUT = AV_CH_LAYOUT_STEREO;
 
+    /* 从直通切回编码时用来预热新编码器的帧数 */
+    const int PREROLL_FRAMES = 2;
+
+    /* 默认的混音块大小, 4096 个样本的 float 总线(32KB)还在 L1/L2 里, 每块的固定开销摊得更薄 */
+    const int DEFAULT_BLOCK_SIZE = 4096;
+
 private:
     int mAudioIndex;
     std::shared_ptr<AVFormatContext> mFormatCtx;
@@ -43,12 +362,90 @@ private:
 
     int mEncodeSampleCount;
 
-    std::vector<std::shared_ptr<XDecoder>> mDecoderList;
+    std::vector<std::shared_ptr<XMixTrack>> mTrackList;
+
+    /* 多次加入的文件, 按文件名索引; 同一文件按不同的解码选项加入时各有一个 */
+    std::multimap<std::string, std::shared_ptr<XSharedSource>> mSources;
 
-    long mDuration;
+    /* 时间线长度, 以输出样本为单位, 0 表示未知(有直播输入或者探测不到时长) */
+    int64_t mDuration;
 
     std::unique_ptr<Frame> mAudioFrame;
 
+    /* 全零的一帧, 所有输入都静音时直接拿来编码 */
+    std::unique_ptr<Frame> mZeroFrame;
+
+    std::atomic<bool> mAborted;
+
+    std::vector<float> mBus;
+    std::vector<float> mVoiceBus;
+    std::vector<float> mBedBus;
+    std::vector<float> mOutPending;
+    int mOutputSkip;
+
+    XDuckingOptions mDuckingOptions;
+    std::unique_ptr<XDucker> mDucker;
+
+    XEffectChain mMasterEffects;
+
+    XLoudnessOptions mLoudnessOptions;
+    std::unique_ptr<XLoudnessCache> mLoudnessCache;
+    std::unique_ptr<XLoudnessMeter> mBusMeter;
+    std::unique_ptr<XLimiter> mLimiter;
+
+    XWaveformOptions mWaveformOptions;
+    std::unique_ptr<XWaveform> mMixWaveform;
+
+    XTelemetryOptions mTelemetryOptions;
+    std::atomic<int64_t> mStartTime;
+    std::atomic<int64_t> mMixedSamples;
+    int64_t mLastDumpTime;
+    int64_t mEncodeNs;
+    XHistogram mMixHistogram;
+    XHistogram mEncodeHistogram;
+    XHistogram mWriteHistogram;
+    XCounter mZeroFrames;
+
+    /* 直通状态; 编码器输出的包只保留 [mEncodeValidFrom, mEncodeValidTo) 之间的, 切换时和直通的包不重叠 */
+    XPassthroughOptions mPassthroughOptions;
+    bool mPassthrough;
+    int mPassthroughRun;
+    int64_t mEncodeValidFrom;
+    int64_t mEncodeValidTo;
+    std::vector<int16_t> mPreroll;
+    XCounter mPassthroughFrames;
+
+    std::shared_ptr<XProbeCache> mProbeCache;
+
+    int mBlockSize;
+
+    /* 子混音总线; mBusOrder 按深度从深到浅排列, 归并时下级总线总在上级之前 */
+    std::vector<std::shared_ptr<XSubmixBus>> mBuses;
+    std::vector<XSubmixBus*> mBusOrder;
+    std::vector<std::unique_ptr<XMixWork>> mWorks;
+    int mMixThreads;
+    std::unique_ptr<XMixPool> mPool;
+
+    /* 分段输出; mSegmentFiles 为复用器正在写的文件 */
+    XSegmentOptions mSegmentOptions;
+    std::string mSegmentPlaylist;
+    std::string mSegmentPattern;
+    std::string mSegmentInit;
+    int (*mIoOpen)(AVFormatContext*, AVIOContext**, const char*, int, AVDictionary**);
+    void (*mIoClose)(AVFormatContext*, AVIOContext*);
+    std::map<AVIOContext*, std::string> mSegmentFiles;
+    std::vector<std::string> mClosedSegments;
+    int mSegmentIndex;
+
+    /* 画面源; mPictureMap 为画面源的流序号到输出流序号, -1 表示不复制 */
+    XRemuxOptions mRemuxOptions;
+    std::unique_ptr<AVFormatContext, InputFormatDeleter> mPictureCtx;
+    std::vector<int> mPictureMap;
+    int64_t mPictureStart;
+    std::unique_ptr<Packet> mPicturePending;
+    bool mPictureEnd;
+    XCounter mPicturePackets;
+
 #if OUT_TO_FILE
     FILE* mFile;
 #endif
@@ -3,10 +3,13 @@
 //
 
 #include "XPacketQueue.h"
+#include "XTrace.h"
+
+#include <ctime>
 
 int gFlag = 0;
 XPacketQueue::XPacketQueue(int capacity)
-: mSize(0), mCapacity(capacity) {
+: mSize(0), mCapacity(capacity), mAborted(false), mGetWaiters(0) {
     mMutex = PTHREAD_MUTEX_INITIALIZER;
     mCond = PTHREAD_COND_INITIALIZER;
 
@@ -23,11 +26,41 @@ XPacketQueue::~XPacketQueue() {
     pthread_cond_destroy(&mCond);
 }
 
-int XPacketQueue::put(const std::shared_ptr<Packet> packet) {
+int XPacketQueue::put(const std::shared_ptr<Packet> packet, int timeoutMs) {
 
     pthread_mutex_lock(&mMutex);
-    if (mCapacity != -1 && mPacketQueue.size() >= mCapacity) {
-        pthread_cond_wait(&mCond, &mMutex);
+    if (!mAborted && mCapacity != -1 && mPacketQueue.size() >= mCapacity) {
+        // 队列满, 解码跟不上读包
+        XTRACE_SCOPE("packet queue full");
+        int64_t start = XTelemetry::isEnabled() ? XTelemetry::now() : 0;
+        struct timespec deadline = {};
+        if (timeoutMs >= 0) {
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            int64_t nsec = deadline.tv_nsec + static_cast<int64_t>(timeoutMs) * 1000000;
+            deadline.tv_sec += nsec / 1000000000;
+            deadline.tv_nsec = nsec % 1000000000;
+        }
+        bool timedOut = false;
+        while (!mAborted && mPacketQueue.size() >= mCapacity && !timedOut) {
+            if (timeoutMs >= 0) {
+                timedOut = pthread_cond_timedwait(&mCond, &mMutex, &deadline) == ETIMEDOUT;
+            } else {
+                pthread_cond_wait(&mCond, &mMutex);
+            }
+        }
+        mFullWaits.add();
+        if (start > 0) {
+            mFullWaitNs.add(static_cast<uint64_t>(XTelemetry::now() - start));
+        }
+        if (!mAborted && mPacketQueue.size() >= mCapacity) {
+            pthread_mutex_unlock(&mMutex);
+            return AVERROR(EAGAIN);
+        }
+    }
+
+    if (mAborted) {
+        pthread_mutex_unlock(&mMutex);
+        return -1;
     }
 
     std::shared_ptr<Packet> pkt;
@@ -46,6 +79,9 @@ int XPacketQueue::put(const std::shared_ptr<Packet> packet) {
     pkt->flag = ++gFlag;
     mPacketQueue.emplace(pkt);
     mSize += pkt->avpkt->size;
+    if (XTelemetry::isEnabled()) {
+        mDepth.sample(static_cast<int64_t>(mPacketQueue.size()));
+    }
     pthread_cond_signal(&mCond);
     pthread_mutex_unlock(&mMutex);
     return 0;
@@ -59,12 +95,29 @@ int XPacketQueue::putNullPacket(int streamIndex) {
 
 std::shared_ptr<Packet> XPacketQueue::get() {
     pthread_mutex_lock(&mMutex);
-    if (mPacketQueue.empty()) {
-        pthread_cond_wait(&mCond, &mMutex);
+    if (!mAborted && mPacketQueue.empty()) {
+        // 队列空, 读包(IO/解封装)跟不上解码
+        XTRACE_SCOPE("packet queue empty");
+        int64_t start = XTelemetry::isEnabled() ? XTelemetry::now() : 0;
+        ++mGetWaiters;
+        while (!mAborted && mPacketQueue.empty()) {
+            pthread_cond_wait(&mCond, &mMutex);
+        }
+        --mGetWaiters;
+        mEmptyWaits.add();
+        if (start > 0) {
+            mEmptyWaitNs.add(static_cast<uint64_t>(XTelemetry::now() - start));
+        }
+    }
+
+    if (mAborted) {
+        pthread_mutex_unlock(&mMutex);
+        return nullptr;
     }
 
     auto pkt = std::move(mPacketQueue.front());
     mPacketQueue.pop();
+    mSize -= pkt->avpkt->size;
     pthread_cond_signal(&mCond);
     pthread_mutex_unlock(&mMutex);
     return pkt;
@@ -74,6 +127,34 @@ int XPacketQueue::getAvailableCount() const {
     return static_cast<int>(mPacketQueue.size());
 }
 
+void XPacketQueue::setCapacity(int capacity) {
+    pthread_mutex_lock(&mMutex);
+    mCapacity = capacity;
+    pthread_cond_broadcast(&mCond);
+    pthread_mutex_unlock(&mMutex);
+}
+
+int64_t XPacketQueue::bytes() const {
+    pthread_mutex_lock(&mMutex);
+    int64_t size = mSize;
+    pthread_mutex_unlock(&mMutex);
+    return size;
+}
+
+int XPacketQueue::capacity() const {
+    pthread_mutex_lock(&mMutex);
+    int capacity = mCapacity;
+    pthread_mutex_unlock(&mMutex);
+    return capacity;
+}
+
+bool XPacketQueue::isStarved() const {
+    pthread_mutex_lock(&mMutex);
+    bool starved = mGetWaiters > 0;
+    pthread_mutex_unlock(&mMutex);
+    return starved;
+}
+
 void XPacketQueue::flush() {
     pthread_mutex_lock(&mMutex);
     std::queue<std::shared_ptr<Packet>>().swap(mPacketQueue);
@@ -81,3 +162,21 @@ void XPacketQueue::flush() {
     pthread_cond_signal(&mCond);
     pthread_mutex_unlock(&mMutex);
 }
+
+void XPacketQueue::abort() {
+    pthread_mutex_lock(&mMutex);
+    mAborted = true;
+    pthread_cond_broadcast(&mCond);
+    pthread_mutex_unlock(&mMutex);
+}
+
+XQueueStats XPacketQueue::stats() const {
+    XQueueStats stats;
+    stats.depth = mDepth.snapshot();
+    stats.capacity = mCapacity;
+    stats.fullWaits.count = mFullWaits.value();
+    stats.fullWaits.waitNs = mFullWaitNs.value();
+    stats.emptyWaits.count = mEmptyWaits.value();
+    stats.emptyWaits.waitNs = mEmptyWaitNs.value();
+    return stats;
+}
@@ -7,6 +7,7 @@
 #include <queue>
 #include <pthread.h>
 #include "XFFHeader.h"
+#include "XTelemetry.h"
 
 class XPacketQueue {
 public:
@@ -14,7 +15,8 @@ public:
 
     ~XPacketQueue();
 
-    int put(std::shared_ptr<Packet> pkt);
+    /* 队列满时最多等 timeoutMs 毫秒, 超时返回 AVERROR(EAGAIN), 包没有入队; 小于 0 时一直等 */
+    int put(std::shared_ptr<Packet> pkt, int timeoutMs = -1);
 
     int putNullPacket(int streamIndex);
 
@@ -22,7 +24,24 @@ public:
     
     int getAvailableCount() const;
 
+    /* 运行中调整容量(包数), 变大时唤醒等待的生产者; 已经排队的包不受影响 */
+    void setCapacity(int capacity);
+
+    /* 排队的包的字节数 */
+    int64_t bytes() const;
+
+    int capacity() const;
+
+    /* 消费者正阻塞在 get 上等包 */
+    bool isStarved() const;
+
     void flush();
+
+    /* 唤醒所有阻塞在 put/get 上的线程, 之后 put 返回 -1, get 返回 nullptr */
+    void abort();
+
+    /* 队列深度和满/空等待的统计, 可以在任意线程调用 */
+    XQueueStats stats() const;
     
 private:
     static const size_t PQ_DEFAULT_CAPACITY = 10;
@@ -30,13 +49,24 @@ private:
 private:
     std::queue<std::shared_ptr<Packet>> mPacketQueue;
     
-    pthread_mutex_t mMutex;
+    mutable pthread_mutex_t mMutex;
 
     pthread_cond_t mCond;
     
     int mSize;
     
     int mCapacity;
+
+    bool mAborted;
+
+    int mGetWaiters;
+
+    /* put 只在读线程调用, get 只在解码线程调用, 各自的计数器只有一个写者 */
+    XGauge mDepth;
+    XCounter mFullWaits;
+    XCounter mFullWaitNs;
+    XCounter mEmptyWaits;
+    XCounter mEmptyWaitNs;
 };
 
 #endif /* XPacketQueue_hpp */
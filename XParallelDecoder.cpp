@@ -0,0 +1,402 @@
+//
+// Created by Andy on 2020/7/28.
+//
+
+#include "XParallelDecoder.h"
+#include "XLog.h"
+#include "XThreadUtils.h"
+#include "XTrace.h"
+
+#include <algorithm>
+
+namespace {
+
+    /* 分段太多时规划阶段的定位次数也多, 一般几十段就足够把线程用满 */
+    const int MAX_SEGMENTS = 512;
+
+    /* 定位后对不上包边界时, 每次往前多退一段预热长度重新定位, 最多这么多次 */
+    const int MAX_SEEK_RETRIES = 3;
+}
+
+XParallelDecoder::XParallelDecoder(const std::string& filename, int streamIndex, int threads, int segmentSeconds)
+        : mFilename(filename), mStreamIndex(streamIndex), mThreads(std::max(1, threads)),
+          mSegmentSeconds(std::max(1, segmentSeconds)), mPrimeBytes(0), mAlignToPacket(false), mTotalSamples(-1),
+          mOutputSamples(0), mNextDispatch(0),
+          mNextOutput(0), mWindow(0), mMismatches(0), mFinished(false), mAborted(false) {
+}
+
+XParallelDecoder::~XParallelDecoder() {
+    abort();
+    for (auto& worker : mWorkers) {
+        if (worker->thread.joinable()) {
+            worker->thread.join();
+        }
+    }
+}
+
+bool XParallelDecoder::isSupported(const AVFormatContext* ic, int streamIndex, int segmentSeconds) {
+    if (!ic || !ic->iformat || !ic->pb || !(ic->pb->seekable & AVIO_SEEKABLE_NORMAL)) {
+        return false;
+    }
+    if (streamIndex < 0 || streamIndex >= static_cast<int>(ic->nb_streams)) {
+        return false;
+    }
+    if (segmentSeconds <= 0 || ic->duration == AV_NOPTS_VALUE ||
+        ic->duration < 2LL * segmentSeconds * AV_TIME_BASE) {
+        return false;
+    }
+
+    std::string name = ic->iformat->name;
+    AVCodecID codecId = ic->streams[streamIndex]->codecpar->codec_id;
+    return (name == "mp3" && codecId == AV_CODEC_ID_MP3) ||
+           (name == "aac" && codecId == AV_CODEC_ID_AAC) ||
+           (name == "flac" && codecId == AV_CODEC_ID_FLAC) ||
+           (name == "wav" && codecId >= AV_CODEC_ID_PCM_S16LE && codecId < AV_CODEC_ID_ADPCM_IMA_QT);
+}
+
+int XParallelDecoder::start(const AVCodecParameters* codecpar, AVRational timeBase, int64_t duration) {
+    // MP3 的比特池最多回溯 511 字节, 再加上 MDCT 重叠和合成滤波器的状态, 预热几帧之后输出就和串行解码一致,
+    // 这里按码率留 0.25 秒; FLAC 和 PCM 的帧互不依赖, 不需要预热
+    if (codecpar->codec_id == AV_CODEC_ID_MP3 || codecpar->codec_id == AV_CODEC_ID_AAC) {
+        mPrimeBytes = std::max<int64_t>(16 * 1024, codecpar->bit_rate / 8 / 4);
+    }
+    mAlignToPacket = codecpar->codec_id != AV_CODEC_ID_MP3 && codecpar->codec_id != AV_CODEC_ID_AAC &&
+                     codecpar->codec_id != AV_CODEC_ID_FLAC;
+
+    int ret = plan(duration);
+    if (ret < 0) {
+        return ret;
+    }
+
+    int threads = std::min<int>(mThreads, static_cast<int>(mSegments.size()));
+    mWindow = static_cast<size_t>(threads) * 2;
+    for (int i = 0; i < threads; ++i) {
+        auto worker = std::make_unique<XWorker>();
+        ret = openWorker(*worker, codecpar, timeBase);
+        if (ret < 0) {
+            return ret;
+        }
+        mWorkers.emplace_back(std::move(worker));
+    }
+
+    for (auto& worker : mWorkers) {
+        XWorker* w = worker.get();
+        worker->thread = std::thread([this, w] { workThread(w); });
+    }
+
+    XLOG(AV_LOG_INFO, "XParallelDecoder", "%zu segments on %d threads: %s", mSegments.size(), threads,
+         mFilename.data());
+    return 0;
+}
+
+int XParallelDecoder::openWorker(XWorker& worker, const AVCodecParameters* codecpar, AVRational timeBase) {
+    AVFormatContext* ic = nullptr;
+    int ret = avformat_open_input(&ic, mFilename.data(), nullptr, nullptr);
+    if (ret < 0) {
+        return ret;
+    }
+    worker.formatCtx = std::unique_ptr<AVFormatContext, InputFormatDeleter>(ic);
+    if (mStreamIndex >= static_cast<int>(ic->nb_streams)) {
+        return AVERROR_STREAM_NOT_FOUND;
+    }
+
+    AVCodecContext* avctx = avcodec_alloc_context3(nullptr);
+    if (!avctx) {
+        return AVERROR(ENOMEM);
+    }
+    worker.codecCtx = std::unique_ptr<AVCodecContext, CodecDeleter>(avctx);
+
+    ret = avcodec_parameters_to_context(avctx, codecpar);
+    if (ret < 0) {
+        return ret;
+    }
+    avctx->pkt_timebase = timeBase;
+    avctx->thread_count = 1;
+
+    AVCodec* codec = avcodec_find_decoder(avctx->codec_id);
+    if (!codec) {
+        return AVERROR_DECODER_NOT_FOUND;
+    }
+    return avcodec_open2(avctx, codec, nullptr);
+}
+
+int XParallelDecoder::plan(int64_t duration) {
+    // 规划用单独的上下文, 和解码线程一样不做 avformat_find_stream_info, 定位后看到的包边界和它们一致
+    AVFormatContext* ic = nullptr;
+    int ret = avformat_open_input(&ic, mFilename.data(), nullptr, nullptr);
+    if (ret < 0) {
+        return ret;
+    }
+    std::unique_ptr<AVFormatContext, InputFormatDeleter> holder(ic);
+    if (mStreamIndex >= static_cast<int>(ic->nb_streams)) {
+        return AVERROR_STREAM_NOT_FOUND;
+    }
+
+    // LAME 头给出了结尾补齐时, 串行解码输出的样本数是从开头算起到补齐开始的位置, 再去掉开头的编码延迟
+    const AVStream* st = ic->streams[mStreamIndex];
+    if (st->first_discard_sample > 0) {
+        mTotalSamples = st->first_discard_sample - std::max<int64_t>(0, st->start_skip_samples);
+    }
+
+    // 第一个包的位置就是数据开始的位置; PCM 的切分点对齐到包大小, 和从头顺序读取时的包边界一致
+    auto pkt = std::make_unique<Packet>();
+    int64_t dataStart = -1;
+    int64_t packetSize = 0;
+    while (dataStart < 0 && av_read_frame(ic, pkt->avpkt) >= 0) {
+        if (pkt->avpkt->stream_index == mStreamIndex) {
+            dataStart = pkt->avpkt->pos;
+            packetSize = pkt->avpkt->size;
+        }
+        av_packet_unref(pkt->avpkt);
+    }
+    int64_t fileSize = avio_size(ic->pb);
+    if (dataStart < 0 || packetSize <= 0 || fileSize <= dataStart) {
+        return AVERROR_INVALIDDATA;
+    }
+
+    int64_t count = std::min<int64_t>(duration / (static_cast<int64_t>(mSegmentSeconds) * AV_TIME_BASE), MAX_SEGMENTS);
+    auto first = std::make_unique<XSegment>();
+    first->begin = dataStart;
+    mSegments.emplace_back(std::move(first));
+
+    for (int64_t k = 1; k < count; ++k) {
+        int64_t target = dataStart + (fileSize - dataStart) * k / count;
+        if (mAlignToPacket) {
+            target = dataStart + (target - dataStart) / packetSize * packetSize;
+        }
+        int64_t seekPos = std::max(dataStart, target - mPrimeBytes);
+        ret = av_seek_frame(ic, -1, seekPos, AVSEEK_FLAG_BYTE);
+        if (ret < 0) {
+            return ret;
+        }
+
+        int64_t begin = -1;
+        while (begin < 0 && av_read_frame(ic, pkt->avpkt) >= 0) {
+            if (pkt->avpkt->stream_index == mStreamIndex && pkt->avpkt->pos >= target) {
+                begin = pkt->avpkt->pos;
+            }
+            av_packet_unref(pkt->avpkt);
+        }
+        if (begin < 0) {
+            // 切分点之后已经没有完整的包
+            break;
+        }
+        if (begin <= mSegments.back()->begin) {
+            continue;
+        }
+
+        mSegments.back()->end = begin;
+        auto segment = std::make_unique<XSegment>();
+        segment->seekPos = seekPos;
+        segment->begin = begin;
+        mSegments.emplace_back(std::move(segment));
+    }
+
+    return mSegments.size() > 1 ? 0 : AVERROR(EINVAL);
+}
+
+void XParallelDecoder::workThread(XWorker* worker) {
+    XThreadUtils::configThreadName("parallelDecode");
+    XTRACE_THREAD_NAME("parallelDecode " + mFilename);
+
+    for (;;) {
+        XSegment* segment;
+        {
+            std::unique_lock<std::mutex> lock(mMutex);
+            mCond.wait(lock, [this] {
+                return mAborted || mNextDispatch >= mSegments.size() || mNextDispatch < mNextOutput + mWindow;
+            });
+            if (mAborted || mNextDispatch >= mSegments.size()) {
+                break;
+            }
+            segment = mSegments[mNextDispatch++].get();
+        }
+
+        int ret = decodeSegment(*segment, *worker);
+
+        std::lock_guard<std::mutex> lock(mMutex);
+        segment->done = true;
+        if (ret < 0 && ret != AVERROR_EOF) {
+            segment->error = ret;
+        }
+        mCond.notify_all();
+    }
+}
+
+int XParallelDecoder::decodeSegment(XSegment& segment, XWorker& worker) {
+    XTRACE_SCOPE("decodeSegment");
+
+    // 第一段由刚打开的上下文从头读, 开头的编码延迟照常裁掉; 其它段按字节定位到规划时的位置,
+    // 没有落在本段第一个包上时往前退一些重新定位, 预热部分的输出照样丢掉
+    int64_t seekPos = segment.seekPos;
+    for (int attempt = 0;; ++attempt) {
+        int ret = decodeFrom(segment, worker, seekPos);
+        if (ret != AVERROR(EAGAIN)) {
+            return ret;
+        }
+        onMismatch();
+        if (attempt >= MAX_SEEK_RETRIES || seekPos <= 0) {
+            XLOG(AV_LOG_WARNING, "XParallelDecoder", "segment at %lld never lands on a packet boundary: %s",
+                 static_cast<long long>(segment.begin), mFilename.data());
+            return AVERROR_INVALIDDATA;
+        }
+        seekPos = std::max<int64_t>(0, seekPos - std::max<int64_t>(mPrimeBytes, 16 * 1024) * (attempt + 1));
+    }
+}
+
+int XParallelDecoder::decodeFrom(XSegment& segment, XWorker& worker, int64_t seekPos) {
+    AVFormatContext* ic = worker.formatCtx.get();
+    AVCodecContext* avctx = worker.codecCtx.get();
+
+    avcodec_flush_buffers(avctx);
+    if (seekPos >= 0) {
+        int ret = av_seek_frame(ic, -1, seekPos, AVSEEK_FLAG_BYTE);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    auto pkt = std::make_unique<Packet>();
+    bool started = false;
+    for (;;) {
+        if (mAborted) {
+            return AVERROR_EXIT;
+        }
+
+        int ret = av_read_frame(ic, pkt->avpkt);
+        if (ret == AVERROR_EOF) {
+            break;
+        }
+        if (ret < 0) {
+            return ret;
+        }
+        if (pkt->avpkt->stream_index != mStreamIndex) {
+            av_packet_unref(pkt->avpkt);
+            continue;
+        }
+
+        // 读到下一段的范围就结束; 记下实际的包位置, 取到下一段时和它的起点核对
+        int64_t pos = pkt->avpkt->pos;
+        if (pos >= segment.end) {
+            av_packet_unref(pkt->avpkt);
+            segment.next = pos;
+            return 0;
+        }
+        if (!started && pos >= segment.begin) {
+            if (pos != segment.begin) {
+                // 定位后的包边界和规划时不一致, 直接开始输出会多出或缺少一帧; 还没有输出过, 换位置重来
+                av_packet_unref(pkt->avpkt);
+                return AVERROR(EAGAIN);
+            }
+            started = true;
+        }
+
+        // 和串行解码一样, 坏包只丢掉这一帧; 预热阶段缺少前面的数据, 出错是正常的
+        avcodec_send_packet(avctx, pkt->avpkt);
+        av_packet_unref(pkt->avpkt);
+        ret = pushFrames(segment, avctx, started);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    // 最后一段读到文件结尾, 冲出解码器里剩下的帧
+    segment.next = INT64_MAX;
+    if (!started) {
+        return AVERROR(EAGAIN);
+    }
+    avcodec_send_packet(avctx, nullptr);
+    return pushFrames(segment, avctx, started);
+}
+
+int XParallelDecoder::pushFrames(XSegment& segment, AVCodecContext* avctx, bool keep) {
+    for (;;) {
+        auto frame = std::make_shared<Frame>();
+        int ret = avcodec_receive_frame(avctx, frame->avframe);
+        if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
+            return 0;
+        }
+        if (ret < 0) {
+            return ret;
+        }
+        if (!keep) {
+            continue;
+        }
+
+        std::lock_guard<std::mutex> lock(mMutex);
+        segment.frames.emplace_back(std::move(frame));
+        mCond.notify_all();
+    }
+}
+
+void XParallelDecoder::onMismatch() {
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        ++mMismatches;
+    }
+    XLOG_EVERY(1000, AV_LOG_WARNING, "XParallelDecoder", "segment boundary mismatch: %s", mFilename.data());
+}
+
+int XParallelDecoder::receiveFrame(AVFrame* frame) {
+    std::unique_lock<std::mutex> lock(mMutex);
+    for (;;) {
+        if (mAborted) {
+            return AVERROR_EXIT;
+        }
+
+        if (mNextOutput >= mSegments.size()) {
+            if (!mFinished) {
+                mFinished = true;
+                XLOG(AV_LOG_VERBOSE, "XParallelDecoder", "finished: %zu segments, %d boundary mismatches: %s",
+                     mSegments.size(), mMismatches, mFilename.data());
+            }
+            return AVERROR_EOF;
+        }
+
+        XSegment& segment = *mSegments[mNextOutput];
+        if (!segment.frames.empty()) {
+            std::shared_ptr<Frame> next = std::move(segment.frames.front());
+            segment.frames.pop_front();
+
+            // 最后一段的结尾补齐按总样本数裁掉, 和串行解码的长度一致
+            int nbSamples = next->avframe->nb_samples;
+            if (mTotalSamples >= 0 && mOutputSamples + nbSamples > mTotalSamples) {
+                nbSamples = static_cast<int>(std::max<int64_t>(0, mTotalSamples - mOutputSamples));
+                if (nbSamples <= 0) {
+                    continue;
+                }
+                next->avframe->nb_samples = nbSamples;
+            }
+            mOutputSamples += nbSamples;
+            av_frame_move_ref(frame, next->avframe);
+            return 0;
+        }
+        if (segment.error < 0) {
+            return segment.error;
+        }
+        if (segment.done) {
+            // 前一段顺序读到的下一个包就是串行解码的包边界, 下一段必须从它开始, 否则拼接处会多出或缺少一帧;
+            // 下一段的帧还没有交出去, 返回错误由调用方从这里改为串行解码
+            if (mNextOutput + 1 < mSegments.size() && segment.next != mSegments[mNextOutput + 1]->begin) {
+                XLOG(AV_LOG_WARNING, "XParallelDecoder", "segment %zu ends at %lld, next begins at %lld: %s",
+                     mNextOutput, static_cast<long long>(segment.next),
+                     static_cast<long long>(mSegments[mNextOutput + 1]->begin), mFilename.data());
+                return AVERROR_INVALIDDATA;
+            }
+
+            // 取完一段, 窗口后移, 空闲的解码线程可以开始下一段
+            ++mNextOutput;
+            mCond.notify_all();
+            continue;
+        }
+
+        XTRACE_SCOPE("wait segment");
+        mCond.wait(lock);
+    }
+}
+
+void XParallelDecoder::abort() {
+    std::lock_guard<std::mutex> lock(mMutex);
+    mAborted = true;
+    mCond.notify_all();
+}
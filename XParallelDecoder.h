@@ -0,0 +1,105 @@
+//
+// Created by Andy on 2020/7/28.
+//
+
+#ifndef MIXER_XPARALLELDECODER_H
+#define MIXER_XPARALLELDECODER_H
+
+#include "XFFHeader.h"
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/**
+ * 单个长文件的并行解码: 按字节把文件切成若干段, 每段由一个解码线程各自打开文件、按字节定位后解封装和解码,
+ * 解码结果按文件顺序交给调用方, 重采样仍然在调用方串行进行, 拼接处和串行解码逐样本一致.
+ *
+ * - 只支持帧可以独立定位的格式: MP3, ADTS AAC, FLAC, WAV(PCM)
+ * - 分段边界取切分点之后的第一个包, 事先用一个单独的上下文按同样的方式定位得到, 解码线程定位到同一位置时
+ *   看到的包边界相同; 前一段解到这个包为止, 后一段从这个包开始输出
+ * - MP3/AAC 的帧依赖前面的数据(比特池, MDCT 重叠), 每段从切分点之前一小段开始解码预热, 预热部分的输出丢掉
+ * - 解码线程定位后没有正好落在本段的第一个包上时, 从更靠前的位置重新定位, 直到对上; 几次都对不上,
+ *   或者前一段顺序读到的下一个包不是本段的第一个包时, 取到这里返回错误, 由调用方改为串行解码
+ * - 同时在解码或等待取走的段数有上限, 内存占用约为 2 * threads * segmentSeconds 秒的解码数据
+ * - 字节定位后时间戳未知, 解封装器不会给最后一段标出结尾补齐; 按 LAME 头里的总样本数在输出端裁掉,
+ *   开头的编码延迟由第一段从头读时正常裁掉
+ */
+class XParallelDecoder {
+public:
+    XParallelDecoder(const std::string& filename, int streamIndex, int threads, int segmentSeconds);
+
+    ~XParallelDecoder();
+
+    /* 已经打开的输入能否并行解码: 本地可随机访问的文件, 格式支持, 并且至少能切成两段 */
+    static bool isSupported(const AVFormatContext* ic, int streamIndex, int segmentSeconds);
+
+    /* 规划分段并启动解码线程, codecpar 取自调用方已经探测过的流参数 */
+    int start(const AVCodecParameters* codecpar, AVRational timeBase, int64_t duration);
+
+    /* 按文件顺序取出下一帧, 全部取完返回 AVERROR_EOF */
+    int receiveFrame(AVFrame* frame);
+
+    void abort();
+
+private:
+    struct XSegment {
+        int64_t seekPos = -1;       // 解封装的起点, 小于 0 表示从文件开头读, 不需要定位
+        int64_t begin = 0;          // 本段第一个输出的包的位置
+        int64_t end = INT64_MAX;    // 下一段第一个包的位置
+        int64_t next = INT64_MAX;   // 解码时实际读到的位于 end 或之后的第一个包, 读到结尾时为 INT64_MAX
+        std::deque<std::shared_ptr<Frame>> frames;
+        bool done = false;
+        int error = 0;
+    };
+
+    struct XWorker {
+        std::unique_ptr<AVFormatContext, InputFormatDeleter> formatCtx;
+        std::unique_ptr<AVCodecContext, CodecDeleter> codecCtx;
+        std::thread thread;
+    };
+
+    int openWorker(XWorker& worker, const AVCodecParameters* codecpar, AVRational timeBase);
+
+    int plan(int64_t duration);
+
+    void workThread(XWorker* worker);
+
+    int decodeSegment(XSegment& segment, XWorker& worker);
+
+    /* 从 seekPos 开始解码一遍; 没有正好读到 begin 这个包时返回 AVERROR(EAGAIN), 由调用方换更早的位置重试 */
+    int decodeFrom(XSegment& segment, XWorker& worker, int64_t seekPos);
+
+    int pushFrames(XSegment& segment, AVCodecContext* avctx, bool keep);
+
+    void onMismatch();
+
+private:
+    std::string mFilename;
+    int mStreamIndex;
+    int mThreads;
+    int mSegmentSeconds;
+    int64_t mPrimeBytes;
+    bool mAlignToPacket;
+
+    /* 去掉开头编码延迟和结尾补齐之后的总样本数, 没有 LAME 头时为 -1; mOutputSamples 为已经交出的样本数 */
+    int64_t mTotalSamples;
+    int64_t mOutputSamples;
+
+    std::vector<std::unique_ptr<XSegment>> mSegments;
+    std::vector<std::unique_ptr<XWorker>> mWorkers;
+    size_t mNextDispatch;
+    size_t mNextOutput;
+    size_t mWindow;
+    int mMismatches;
+    bool mFinished;
+    std::atomic<bool> mAborted;
+    std::mutex mMutex;
+    std::condition_variable mCond;
+};
+
+#endif //MIXER_XPARALLELDECODER_H
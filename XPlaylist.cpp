@@ -0,0 +1,236 @@
+//
+// Created by Andy on 2020/8/10.
+//
+
+#include "XPlaylist.h"
+#include "XException.h"
+#include "XLog.h"
+#include "XThreadUtils.h"
+#include "XTrace.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+namespace {
+    const int SAMPLE_RATE = 44100;
+}
+
+XPlaylist::XPlaylist(const std::vector<std::string>& files, const XDecoderOptions& decoderOptions,
+                     const XPlaylistOptions& options)
+        : mFiles(files), mDecoderOptions(decoderOptions), mOptions(options), mCurrentEnd(false), mCurrentPos(0),
+          mCurrentLength(-1), mNextIndex(0), mHoldStart(0) {
+    // 列表里的素材都是点播文件, 样本和包不一一对应, 不能直通
+    mDecoderOptions.live = false;
+    mDecoderOptions.keepPackets = false;
+    // 并行解码不裁掉编码器补的结尾静音, 首尾相接会有空隙; 预取时也不再多开解码上下文
+    mDecoderOptions.decodeThreads = 0;
+
+    mName = "playlist:" + (files.empty() ? std::string() : files.front());
+    if (files.size() > 1) {
+        mName += " +" + std::to_string(files.size() - 1);
+    }
+    mFadeBytes = static_cast<int>(av_rescale(std::max(0, options.crossfadeMs), SAMPLE_RATE, 1000)) * BYTES_PER_SAMPLE;
+    mPrefetchBytes = av_rescale(std::max(0, options.prefetchMs), SAMPLE_RATE, 1000) * BYTES_PER_SAMPLE;
+
+    // 第一首同步打开, 之后的都在后台预取
+    auto first = takeNext();
+    if (!first) {
+        throw XException("no playable file in playlist");
+    }
+    std::lock_guard<std::mutex> lock(mMutex);
+    mCurrent = std::move(first);
+    int64_t duration = mCurrent->duration();
+    mCurrentLength = duration != AV_NOPTS_VALUE && duration > 0 ?
+                     av_rescale(duration, SAMPLE_RATE, AV_TIME_BASE) * BYTES_PER_SAMPLE : -1;
+}
+
+XPlaylist::~XPlaylist() {
+    stop();
+}
+
+const std::string& XPlaylist::name() const {
+    return mName;
+}
+
+int XPlaylist::read(uint8_t* out, int length) {
+    length -= length % BYTES_PER_SAMPLE;
+
+    int done = 0;
+    while (done < length) {
+        if (mCurrent) {
+            prefetch();
+        }
+
+        // 不淡化时直接读进 out, 读到结尾就接上下一首
+        if (mFadeBytes == 0 && mCurrent) {
+            int readed = std::max(0, mCurrent->getSamples(out + done, length - done));
+            done += readed;
+            mCurrentPos += readed;
+            if (done < length) {
+                advance();
+            }
+            continue;
+        }
+
+        // 淡化时留住当前一首最后 mFadeBytes; 读到结尾后后面还有素材时也留住, 用来和下一首叠加
+        fillHold(length - done + mFadeBytes);
+        int held = static_cast<int>(mHold.size() - mHoldStart);
+        bool fadeOut = mCurrent && (!mCurrentEnd || mNext.valid() || mNextIndex < mFiles.size());
+        int keep = fadeOut ? std::min(held, mFadeBytes) : 0;
+        int n = std::min(held - keep, length - done);
+        memcpy(out + done, mHold.data() + mHoldStart, n);
+        mHoldStart += n;
+        done += n;
+
+        if (done < length) {
+            if (!mCurrent) {
+                break;
+            }
+            advance();
+        }
+    }
+    return done > 0 ? done : -1;
+}
+
+void XPlaylist::stop() {
+    std::shared_ptr<XDecoder> current;
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        current = std::move(mCurrent);
+    }
+    if (current) {
+        current->stop();
+    }
+
+    // 等后台打开完成再停掉, 不留下没人管的解码线程
+    if (mNext.valid()) {
+        auto next = mNext.get();
+        if (next) {
+            next->stop();
+        }
+    }
+    mNextIndex = mFiles.size();
+}
+
+XDecoderStats XPlaylist::stats() const {
+    std::shared_ptr<XDecoder> current;
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        current = mCurrent;
+    }
+    return current ? current->stats() : XDecoderStats();
+}
+
+void XPlaylist::prefetch() {
+    if (mNext.valid() || mNextIndex >= mFiles.size()) {
+        return;
+    }
+    if (mCurrentLength < 0 || mCurrentLength - mCurrentPos <= mPrefetchBytes + mFadeBytes) {
+        startPrefetch();
+    }
+}
+
+void XPlaylist::startPrefetch() {
+    std::string filename = mFiles[mNextIndex++];
+    XDecoderOptions options = mDecoderOptions;
+    mNext = std::async(std::launch::async, [filename, options]() -> std::shared_ptr<XDecoder> {
+        XThreadUtils::configThreadName("playlistPrefetch");
+        XTRACE_SCOPE("playlist prefetch");
+        try {
+            auto decoder = std::make_shared<XDecoder>(filename, options);
+            decoder->start();
+            return decoder;
+        } catch (std::exception& e) {
+            XLOG(AV_LOG_ERROR, "XPlaylist", "open failed, skipped: %s: %s", e.what(), filename.data());
+            return nullptr;
+        }
+    });
+}
+
+std::shared_ptr<XDecoder> XPlaylist::takeNext() {
+    for (;;) {
+        if (!mNext.valid()) {
+            if (mNextIndex >= mFiles.size()) {
+                return nullptr;
+            }
+            startPrefetch();
+        }
+
+        std::shared_ptr<XDecoder> next;
+        {
+            XTRACE_SCOPE("wait prefetch");
+            next = mNext.get();
+        }
+        if (next) {
+            return next;
+        }
+    }
+}
+
+void XPlaylist::advance() {
+    // 先拿到下一首再停掉当前一首, 两首之间不会多出第三个解码器
+    std::shared_ptr<XDecoder> next = takeNext();
+    std::shared_ptr<XDecoder> previous;
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        previous = std::move(mCurrent);
+        mCurrent = next;
+    }
+    if (previous) {
+        previous->stop();
+    }
+    mCurrentEnd = false;
+    mCurrentPos = 0;
+    mCurrentLength = -1;
+    if (!next) {
+        return;
+    }
+
+    int64_t duration = next->duration();
+    if (duration != AV_NOPTS_VALUE && duration > 0) {
+        mCurrentLength = av_rescale(duration, SAMPLE_RATE, AV_TIME_BASE) * BYTES_PER_SAMPLE;
+    }
+    XLOG(AV_LOG_INFO, "XPlaylist", "next track: %s", next->stats().filename.data());
+
+    // 留住的是上一首的最后一段, 和下一首同样长的开头按等功率曲线叠加; 下一首比淡化还短时只叠加它的长度
+    int held = static_cast<int>(mHold.size() - mHoldStart);
+    if (held <= 0) {
+        return;
+    }
+    std::vector<uint8_t> head(held);
+    int readed = std::max(0, next->getSamples(head.data(), held));
+    mCurrentPos += readed;
+    mCurrentEnd = readed < held;
+
+    int16_t* tail = reinterpret_cast<int16_t*>(mHold.data() + mHold.size() - readed);
+    const int16_t* in = reinterpret_cast<const int16_t*>(head.data());
+    int nbSamples = readed / BYTES_PER_SAMPLE;
+    for (int i = 0; i < nbSamples; ++i) {
+        double t = (i + 0.5) / nbSamples * M_PI / 2;
+        float fadeOut = static_cast<float>(std::cos(t));
+        float fadeIn = static_cast<float>(std::sin(t));
+        for (int c = 0; c < 2; ++c) {
+            float v = tail[i * 2 + c] * fadeOut + in[i * 2 + c] * fadeIn;
+            v = v > 32767.0f ? 32767.0f : (v < -32768.0f ? -32768.0f : v);
+            tail[i * 2 + c] = static_cast<int16_t>(std::lrint(v));
+        }
+    }
+}
+
+void XPlaylist::fillHold(int size) {
+    if (mHoldStart > 0) {
+        mHold.erase(mHold.begin(), mHold.begin() + mHoldStart);
+        mHoldStart = 0;
+    }
+
+    while (mCurrent && !mCurrentEnd && static_cast<int>(mHold.size()) < size) {
+        int wanted = size - static_cast<int>(mHold.size());
+        size_t offset = mHold.size();
+        mHold.resize(offset + wanted);
+        int readed = std::max(0, mCurrent->getSamples(mHold.data() + offset, wanted));
+        mHold.resize(offset + readed);
+        mCurrentPos += readed;
+        mCurrentEnd = readed < wanted;
+    }
+}
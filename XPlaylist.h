@@ -0,0 +1,89 @@
+//
+// Created by Andy on 2020/8/10.
+//
+
+#ifndef MIXER_XPLAYLIST_H
+#define MIXER_XPLAYLIST_H
+
+#include "XDecoder.h"
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+struct XPlaylistOptions {
+    /* 相邻两首的交叉淡化长度(等功率), 0 表示首尾直接相接 */
+    int crossfadeMs = 0;
+
+    /* 当前一首剩余不到这么长时在后台打开并开始解码下一首; 当前一首时长未知时一开始就预取 */
+    int prefetchMs = 10000;
+};
+
+/**
+ * 播放列表输入: 列表里的素材在同一个位置上依次首尾相接地解码, 输出连续的 S16 立体声样本.
+ *
+ * - 任何时候最多只有两个解码器: 正在读的一首和预取的下一首; 下一首在后台线程里打开和启动
+ * - 编码器延迟和结尾填充由解码器按 skip_samples 裁掉, 相邻两首之间按样本拼接, 没有时间线取整带来的空隙;
+ *   并行解码不裁结尾填充, 所以列表里的素材总是串行解码, decoderOptions 里的 decodeThreads 不起作用
+ * - 交叉淡化时总是留住当前一首最后 crossfadeMs 的样本, 读到结尾后和下一首的开头叠加
+ * - 打不开的素材跳过
+ */
+class XPlaylist {
+public:
+    /* 第一首在构造时打开, 一首都打不开时抛出 XException */
+    XPlaylist(const std::vector<std::string>& files, const XDecoderOptions& decoderOptions,
+              const XPlaylistOptions& options);
+
+    ~XPlaylist();
+
+    const std::string& name() const;
+
+    /* 和 XDecoder::getSamples 一样, 只在整个列表读完时不足 length 字节, 没有数据时返回负数; 不报告静音段 */
+    int read(uint8_t* out, int length);
+
+    void stop();
+
+    /* 当前一首的统计 */
+    XDecoderStats stats() const;
+
+private:
+    /* 当前一首快结束时在后台打开下一首 */
+    void prefetch();
+
+    void startPrefetch();
+
+    /* 取出预取的下一首, 还没打开时等待; 打不开的跳过, 列表结束时返回空 */
+    std::shared_ptr<XDecoder> takeNext();
+
+    /* 当前一首读完, 把留住的结尾和下一首的开头叠加后留在 mHold 里, 换成下一首 */
+    void advance();
+
+    /* 从当前一首读到 mHold 里, 直到 mHold 至少有 size 字节或者读到结尾 */
+    void fillHold(int size);
+
+private:
+    static const int BYTES_PER_SAMPLE = 2 * static_cast<int>(sizeof(int16_t));
+
+    std::vector<std::string> mFiles;
+    std::string mName;
+    XDecoderOptions mDecoderOptions;
+    XPlaylistOptions mOptions;
+    int mFadeBytes;
+    int64_t mPrefetchBytes;
+
+    mutable std::mutex mMutex;
+    std::shared_ptr<XDecoder> mCurrent;
+    bool mCurrentEnd;
+    int64_t mCurrentPos;        // 当前一首已经读出的字节数
+    int64_t mCurrentLength;     // 当前一首探测到的字节数, 未知时为 -1
+
+    std::future<std::shared_ptr<XDecoder>> mNext;
+    size_t mNextIndex;          // 下一个要打开的素材
+
+    /* 交叉淡化时留住的样本, 从 mHoldStart 开始有效 */
+    std::vector<uint8_t> mHold;
+    size_t mHoldStart;
+};
+
+#endif //MIXER_XPLAYLIST_H
@@ -0,0 +1,207 @@
+//
+// Created by Andy on 2020/7/29.
+//
+
+#include "XProbeCache.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cerrno>
+#include <fstream>
+#include <sstream>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+    std::shared_ptr<AVCodecParameters> allocCodecParameters() {
+        return std::shared_ptr<AVCodecParameters>(avcodec_parameters_alloc(), CodecParametersDeleter());
+    }
+
+    std::string toHex(const uint8_t* data, int size) {
+        static const char DIGITS[] = "0123456789abcdef";
+        if (!data || size <= 0) {
+            return "-";
+        }
+        std::string out;
+        out.reserve(size * 2);
+        for (int i = 0; i < size; ++i) {
+            out += DIGITS[data[i] >> 4];
+            out += DIGITS[data[i] & 0xf];
+        }
+        return out;
+    }
+
+    bool fromHex(const std::string& hex, AVCodecParameters* par) {
+        if (hex == "-") {
+            return true;
+        }
+        if (hex.size() % 2 != 0) {
+            return false;
+        }
+
+        int size = static_cast<int>(hex.size() / 2);
+        auto* data = static_cast<uint8_t*>(av_mallocz(size + AV_INPUT_BUFFER_PADDING_SIZE));
+        if (!data) {
+            return false;
+        }
+        for (int i = 0; i < size; ++i) {
+            int value = 0;
+            if (sscanf(hex.data() + i * 2, "%2x", &value) != 1) {
+                av_free(data);
+                return false;
+            }
+            data[i] = static_cast<uint8_t>(value);
+        }
+        par->extradata = data;
+        par->extradata_size = size;
+        return true;
+    }
+}
+
+XProbeCache::XProbeCache(const std::string &path)
+        : mPath(path), mDirty(false) {
+    std::ifstream in(mPath);
+    std::string line;
+    while (std::getline(in, line)) {
+        std::istringstream fields(line);
+        Entry entry;
+        XProbeInfo &info = entry.info;
+        info.codecpar = allocCodecParameters();
+        AVCodecParameters *par = info.codecpar.get();
+        if (!par) {
+            break;
+        }
+
+        int codecId = 0;
+        std::string extradata;
+        if (!(fields >> entry.size >> entry.mtime >> info.formatName >> info.streamIndex >> info.timeBase.num
+                     >> info.timeBase.den >> info.startTime >> info.duration >> info.bitRate >> codecId
+                     >> par->codec_tag >> par->format >> par->bit_rate >> par->bits_per_coded_sample
+                     >> par->bits_per_raw_sample >> par->profile >> par->level >> par->channel_layout
+                     >> par->channels >> par->sample_rate >> par->block_align >> par->frame_size
+                     >> par->initial_padding >> par->trailing_padding >> par->seek_preroll >> extradata)) {
+            continue;
+        }
+        par->codec_type = AVMEDIA_TYPE_AUDIO;
+        par->codec_id = static_cast<AVCodecID>(codecId);
+        if (!fromHex(extradata, par)) {
+            continue;
+        }
+
+        std::string filename;
+        fields.get();
+        std::getline(fields, filename);
+        if (!filename.empty()) {
+            mEntries[filename] = entry;
+        }
+    }
+}
+
+bool XProbeCache::fileKey(const std::string &filename, int64_t *size, int64_t *mtime) {
+    struct stat st;
+    if (stat(filename.data(), &st) != 0 || !S_ISREG(st.st_mode)) {
+        return false;
+    }
+
+    *size = st.st_size;
+    *mtime = st.st_mtime;
+    return true;
+}
+
+bool XProbeCache::lookup(const std::string &filename, XProbeInfo *info) const {
+    int64_t size, mtime;
+    if (!fileKey(filename, &size, &mtime)) {
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(mMutex);
+    auto it = mEntries.find(filename);
+    if (it == mEntries.end() || it->second.size != size || it->second.mtime != mtime) {
+        return false;
+    }
+
+    *info = it->second.info;
+    return true;
+}
+
+void XProbeCache::store(const std::string &filename, const AVFormatContext *ic, int streamIndex) {
+    if (!ic || !ic->iformat || streamIndex < 0 || streamIndex >= static_cast<int>(ic->nb_streams)) {
+        return;
+    }
+
+    Entry entry;
+    if (!fileKey(filename, &entry.size, &entry.mtime)) {
+        return;
+    }
+
+    const AVStream *stream = ic->streams[streamIndex];
+    XProbeInfo &info = entry.info;
+    info.codecpar = allocCodecParameters();
+    if (!info.codecpar || avcodec_parameters_copy(info.codecpar.get(), stream->codecpar) < 0) {
+        return;
+    }
+
+    // "mov,mp4,m4a,..." 这样的名字 av_find_input_format 找不到, 只取第一个
+    info.formatName = ic->iformat->name;
+    info.formatName = info.formatName.substr(0, info.formatName.find(','));
+    info.streamIndex = streamIndex;
+    info.timeBase = stream->time_base;
+    info.startTime = ic->start_time;
+    info.duration = ic->duration;
+    info.bitRate = ic->bit_rate;
+
+    std::lock_guard<std::mutex> lock(mMutex);
+    mEntries[filename] = entry;
+    mDirty = true;
+}
+
+int XProbeCache::save() {
+    std::lock_guard<std::mutex> lock(mMutex);
+    if (!mDirty) {
+        return 0;
+    }
+
+    // 先写临时文件再改名, 避免多个任务同时写坏缓存; 临时文件名每次唯一, 同时保存的任务各写各的
+    std::string tmpPath = mPath + ".XXXXXX";
+    int fd = mkstemp(&tmpPath[0]);
+    if (fd < 0) {
+        return -errno;
+    }
+    fchmod(fd, 0644);
+    close(fd);
+    {
+        std::ofstream out(tmpPath, std::ios::trunc);
+        if (!out) {
+            int ret = -errno;
+            unlink(tmpPath.data());
+            return ret;
+        }
+        for (auto &it : mEntries) {
+            const XProbeInfo &info = it.second.info;
+            const AVCodecParameters *par = info.codecpar.get();
+            out << it.second.size << ' ' << it.second.mtime << ' ' << info.formatName << ' ' << info.streamIndex
+                << ' ' << info.timeBase.num << ' ' << info.timeBase.den << ' ' << info.startTime << ' '
+                << info.duration << ' ' << info.bitRate << ' ' << static_cast<int>(par->codec_id) << ' '
+                << par->codec_tag << ' ' << par->format << ' ' << par->bit_rate << ' '
+                << par->bits_per_coded_sample << ' ' << par->bits_per_raw_sample << ' ' << par->profile << ' '
+                << par->level << ' ' << par->channel_layout << ' ' << par->channels << ' ' << par->sample_rate
+                << ' ' << par->block_align << ' ' << par->frame_size << ' ' << par->initial_padding << ' '
+                << par->trailing_padding << ' ' << par->seek_preroll << ' '
+                << toHex(par->extradata, par->extradata_size) << ' ' << it.first << '\n';
+        }
+        if (!out) {
+            unlink(tmpPath.data());
+            return -EIO;
+        }
+    }
+
+    if (rename(tmpPath.data(), mPath.data()) != 0) {
+        int ret = -errno;
+        unlink(tmpPath.data());
+        return ret;
+    }
+
+    mDirty = false;
+    return 0;
+}
@@ -0,0 +1,62 @@
+//
+// Created by Andy on 2020/7/29.
+//
+
+#ifndef MIXER_XPROBECACHE_H
+#define MIXER_XPROBECACHE_H
+
+#include "XFFHeader.h"
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+
+/* avformat_find_stream_info 探测出的、打开解码器需要的信息 */
+struct XProbeInfo {
+    std::string formatName;
+    int streamIndex = -1;
+    AVRational timeBase = {0, 1};
+    int64_t startTime = AV_NOPTS_VALUE;
+    int64_t duration = AV_NOPTS_VALUE;
+    int64_t bitRate = 0;
+    std::shared_ptr<AVCodecParameters> codecpar;
+};
+
+/**
+ * 素材探测结果的持久化缓存, 和响度缓存一样以路径 + 文件大小 + 修改时间为键, 文件被改动后自动失效.
+ * 命中时解码器按缓存的格式直接打开, 不再调用 avformat_find_stream_info(它可能要解码好几秒的数据).
+ * 每行一条: "<size> <mtime> <格式> <流序号> <时间基> <起始时间> <时长> <码率> <编码参数...> <extradata> <path>",
+ * 多个解码器可以在不同线程同时查询和写入
+ */
+class XProbeCache {
+public:
+    explicit XProbeCache(const std::string& path);
+
+    bool lookup(const std::string& filename, XProbeInfo* info) const;
+
+    /* 记录已经完成探测的输入, ic 必须调用过 avformat_find_stream_info */
+    void store(const std::string& filename, const AVFormatContext* ic, int streamIndex);
+
+    int save();
+
+    const std::string& path() const {
+        return mPath;
+    }
+
+private:
+    static bool fileKey(const std::string& filename, int64_t* size, int64_t* mtime);
+
+private:
+    struct Entry {
+        int64_t size;
+        int64_t mtime;
+        XProbeInfo info;
+    };
+
+    std::string mPath;
+    std::map<std::string, Entry> mEntries;
+    bool mDirty;
+    mutable std::mutex mMutex;
+};
+
+#endif //MIXER_XPROBECACHE_H
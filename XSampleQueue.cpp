@@ -8,7 +8,13 @@
 #include <cstdlib>
 #include <cstring>
 
+#include <fcntl.h>
+#include <sys/mman.h>
 #include <sys/types.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
 
 #define RBUF_DEFAULT_SIZE 4096
 
@@ -19,8 +25,62 @@ struct _rbuf_s {
     int rfx;                    // read offset
     int wfx;                    // write offset
     rbuf_mode_t mode;           // the ringbuffer mode (blocking/overwrite)
+    int mirrored;               // buf[i] and buf[i + size] map the same byte
 };
 
+int
+rbuf_page_size(void) {
+    long page = sysconf(_SC_PAGESIZE);
+    return page > 0 ? (int) page : 4096;
+}
+
+/*
+ * 同一块共享内存映射到相邻的两段虚拟地址, 越过结尾的读写自动落到开头, 任意一段都是连续的.
+ * size 必须是页大小的整数倍; 平台不支持时返回 NULL, 调用方退回普通内存
+ */
+static u_char *
+rbuf_map_mirrored(int size) {
+    int fd = -1;
+#if defined(__linux__) && defined(SYS_memfd_create)
+    // 老的 glibc 没有 memfd_create 的封装, 直接走系统调用
+    fd = (int) syscall(SYS_memfd_create, "rbuf", 0);
+#endif
+    if (fd < 0) {
+        // macOS 的共享内存名最长 31 个字符, 打开后立即删除名字, 只留下描述符
+        static int counter = 0;
+        char name[32];
+        snprintf(name, sizeof(name), "/rbuf.%d.%d", (int) getpid(), __sync_fetch_and_add(&counter, 1));
+        fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+        if (fd < 0) {
+            return NULL;
+        }
+        shm_unlink(name);
+    }
+
+    if (ftruncate(fd, size) != 0) {
+        close(fd);
+        return NULL;
+    }
+
+    // 先占住两倍大小的地址空间, 再把共享内存固定映射到前后两半
+    void *base = mmap(NULL, 2 * (size_t) size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) {
+        close(fd);
+        return NULL;
+    }
+    u_char *buf = (u_char *) base;
+    if (mmap(buf, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED ||
+        mmap(buf + size, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) {
+        munmap(base, 2 * (size_t) size);
+        close(fd);
+        return NULL;
+    }
+
+    // 映射持有共享内存的引用, 描述符可以关掉
+    close(fd);
+    return buf;
+}
+
 rbuf_t *rbuf_create(int size) {
     rbuf_t *new_rb;
     new_rb = (rbuf_t *) calloc(1, sizeof(rbuf_t));
@@ -32,6 +92,17 @@ rbuf_t *rbuf_create(int size) {
         new_rb->size = RBUF_DEFAULT_SIZE;
     else
         new_rb->size = size;
+
+    // 镜像映射以页为单位, 容量向上取整到页大小
+    int page = rbuf_page_size();
+    int mirrored_size = (new_rb->size + page - 1) / page * page;
+    new_rb->buf = rbuf_map_mirrored(mirrored_size);
+    if (new_rb->buf) {
+        new_rb->size = mirrored_size;
+        new_rb->mirrored = 1;
+        return new_rb;
+    }
+
     new_rb->buf = (u_char *) malloc(new_rb->size);
     if (!new_rb->buf) {
         /* TODO - Error Messaeggs */
@@ -67,7 +138,10 @@ void rbuf_skip(rbuf_t *rb, int size) {
 int rbuf_read(rbuf_t *rb, u_char *out, int size) {
     int read_size = size > rb->used ? rb->used : size;
     int to_end = rb->size - rb->rfx;
-    if (read_size > to_end) { // check if we need to wrap around
+    if (rb->mirrored) {
+        memcpy(out, &rb->buf[rb->rfx], read_size);
+        rb->rfx = read_size >= to_end ? read_size - to_end : rb->rfx + read_size;
+    } else if (read_size > to_end) { // check if we need to wrap around
         memcpy(out, &rb->buf[rb->rfx], to_end);
         int start_size = read_size - to_end;
         memcpy(out + to_end, &rb->buf[0], start_size);
@@ -115,7 +189,10 @@ rbuf_write(rbuf_t *rb, u_char *in, int size) {
     }
 
 
-    if (write_size > to_end) {
+    if (rb->mirrored) {
+        memcpy(&rb->buf[rb->wfx], in, write_size);
+        rb->wfx = write_size >= to_end ? write_size - to_end : rb->wfx + write_size;
+    } else if (write_size > to_end) {
         memcpy(&rb->buf[rb->wfx], in, to_end);
         int from_start = write_size - to_end;
         memcpy(&rb->buf[0], in + to_end, from_start);
@@ -151,10 +228,49 @@ rbuf_clear(rbuf_t *rb) {
 
 void
 rbuf_destroy(rbuf_t *rb) {
-    free(rb->buf);
+    if (rb->mirrored)
+        munmap(rb->buf, 2 * (size_t) rb->size);
+    else
+        free(rb->buf);
     free(rb);
 }
 
+int
+rbuf_is_mirrored(rbuf_t *rb) {
+    return rb->mirrored;
+}
+
+u_char *
+rbuf_peek_read(rbuf_t *rb, int *size) {
+    int to_end = rb->size - rb->rfx;
+    *size = (rb->mirrored || rb->used <= to_end) ? rb->used : to_end;
+    return &rb->buf[rb->rfx];
+}
+
+void
+rbuf_commit_read(rbuf_t *rb, int size) {
+    rbuf_skip(rb, size);
+}
+
+u_char *
+rbuf_peek_write(rbuf_t *rb, int *size) {
+    int available = rb->size - rb->used;
+    int to_end = rb->size - rb->wfx;
+    *size = (rb->mirrored || available <= to_end) ? available : to_end;
+    return &rb->buf[rb->wfx];
+}
+
+void
+rbuf_commit_write(rbuf_t *rb, int size) {
+    int available = rb->size - rb->used;
+    if (size > available)
+        size = available;
+    rb->wfx += size;
+    if (rb->wfx >= rb->size)
+        rb->wfx -= rb->size;
+    rb->used += size;
+}
+
 
 int
 rbuf_find(rbuf_t *rb, u_char octet) {
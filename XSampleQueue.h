@@ -25,9 +25,27 @@ typedef struct _rbuf_s rbuf_t;
  * @brief Create a new ringbuffer
  * @param size : The size of the ringbuffer (in bytes)
  * @return     : A pointer to an initialized rbuf_t structure
+ * @note       : The buffer is mapped twice back to back (memfd_create on Linux,
+ *               shm_open elsewhere) so every readable or writable region is
+ *               contiguous; the size is then rounded up to the page size.
+ *               Falls back to a plain heap buffer when the mapping fails
  */
 rbuf_t *rbuf_create(int size);
 
+/**
+ * @brief Returns the granularity rbuf_create() rounds mirrored buffers to
+ * @return the system page size in bytes
+ */
+int rbuf_page_size(void);
+
+/**
+ * @brief Returns whether the ringbuffer is backed by the mirrored mapping
+ * @param rbuf  : A valid pointer to a rbuf_t structure
+ * @return 1 if rbuf_peek_read()/rbuf_peek_write() always cover all the
+ *         used/available bytes, 0 if they stop at the end of the buffer
+ */
+int rbuf_is_mirrored(rbuf_t *rbuf);
+
 void rbuf_set_mode(rbuf_t *rbuf, rbuf_mode_t mode);
 rbuf_mode_t rbuf_mode(rbuf_t *rbuf);
 
@@ -61,6 +79,41 @@ int rbuf_read(rbuf_t *rbuf, u_char *out, int size);
  */
 int rbuf_write(rbuf_t *rbuf, u_char *in, int size);
 
+/**
+ * @brief Get a pointer to the unread bytes without copying them
+ * @param rbuf  : A valid pointer to a rbuf_t structure
+ * @param size : Filled with the amount of contiguous bytes readable at the
+ *               returned pointer
+ * @return     : A pointer into the ringbuffer, valid until the bytes are
+ *               released by rbuf_commit_read()
+ */
+u_char *rbuf_peek_read(rbuf_t *rbuf, int *size);
+
+/**
+ * @brief Release bytes obtained by rbuf_peek_read()
+ * @param rbuf  : A valid pointer to a rbuf_t structure
+ * @param size : The amount of bytes consumed
+ */
+void rbuf_commit_read(rbuf_t *rbuf, int size);
+
+/**
+ * @brief Get a pointer to the free space so the producer can fill it in place
+ * @param rbuf  : A valid pointer to a rbuf_t structure
+ * @param size : Filled with the amount of contiguous bytes writable at the
+ *               returned pointer
+ * @return     : A pointer into the ringbuffer
+ * @note       : Only one producer may fill the space at a time; the bytes
+ *               become readable after rbuf_commit_write()
+ */
+u_char *rbuf_peek_write(rbuf_t *rbuf, int *size);
+
+/**
+ * @brief Publish bytes written through rbuf_peek_write()
+ * @param rbuf  : A valid pointer to a rbuf_t structure
+ * @param size : The amount of bytes written
+ */
+void rbuf_commit_write(rbuf_t *rbuf, int size);
+
 /**
  * @brief Returns the total size of the ringbuffer (specified at creation time)
  * @param rbuf  : A valid pointer to a rbuf_t structure
@@ -0,0 +1,252 @@
+//
+// Created by Andy on 2020/8/5.
+//
+
+#include "XSharedSource.h"
+#include "XDecoder.h"
+#include "XLog.h"
+#include "XMemoryBudget.h"
+#include "XTrace.h"
+
+#include <algorithm>
+#include <climits>
+#include <cstring>
+
+XSharedSource::XSharedSource(const std::string& filename, std::shared_ptr<XDecoder> decoder)
+        : mFilename(filename), mDecoder(std::move(decoder)), mBase(0), mEnd(0), mEof(false), mNextReader(0) {
+}
+
+XSharedSource::~XSharedSource() {
+    mDecoder->stop();
+    for (auto& it : mReaders) {
+        if (it.second.decoder) {
+            it.second.decoder->stop();
+        }
+    }
+    int64_t cached = 0;
+    for (auto& block : mBlocks) {
+        cached += block->data.size();
+    }
+    XMemoryBudget::instance().addCache(-cached);
+}
+
+const std::string& XSharedSource::filename() const {
+    return mFilename;
+}
+
+int64_t XSharedSource::duration() const {
+    return mDecoder->duration();
+}
+
+const XDecoderOptions& XSharedSource::options() const {
+    return mDecoder->options();
+}
+
+XDecoderStats XSharedSource::stats() const {
+    return mDecoder->stats();
+}
+
+int XSharedSource::open() {
+    std::lock_guard<std::mutex> lock(mMutex);
+    int reader = mNextReader++;
+    mReaders[reader] = XReader();
+    return reader;
+}
+
+void XSharedSource::close(int reader) {
+    std::shared_ptr<XDecoder> decoder;
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        auto it = mReaders.find(reader);
+        if (it == mReaders.end()) {
+            return;
+        }
+        decoder = std::move(it->second.decoder);
+        mReaders.erase(it);
+        release();
+    }
+    if (decoder) {
+        decoder->stop();
+    }
+}
+
+void XSharedSource::fill(int64_t end) {
+    std::lock_guard<std::mutex> fillLock(mFillMutex);
+    for (;;) {
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            if (mEof || mEnd >= end) {
+                return;
+            }
+        }
+
+        // 在锁外等解码, 其它读取器照常读已经解出来的块
+        XTRACE_SCOPE("shared source fill");
+        auto block = std::make_shared<XPcmBlock>();
+        block->data.resize(BLOCK_BYTES);
+        bool silent = false;
+        int readed = mDecoder->getSamples(block->data.data(), BLOCK_BYTES, &silent);
+
+        std::lock_guard<std::mutex> lock(mMutex);
+        if (readed <= 0) {
+            mEof = true;
+            return;
+        }
+        block->size = readed;
+        block->silent = silent;
+        if (silent) {
+            std::vector<uint8_t>().swap(block->data);
+        } else {
+            block->data.resize(readed);
+        }
+        // 缓存的样本计入内存预算, 静音块不占空间
+        XMemoryBudget::instance().addCache(block->data.size());
+        mBlocks.push_back(std::move(block));
+        mEnd += readed;
+        mEof = readed < BLOCK_BYTES;
+        release();
+    }
+}
+
+int XSharedSource::read(int reader, uint8_t* out, int length, bool* silent) {
+    if (silent) {
+        *silent = false;
+    }
+
+    int64_t pos;
+    std::shared_ptr<XDecoder> own;
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        auto it = mReaders.find(reader);
+        if (it == mReaders.end()) {
+            return AVERROR(EINVAL);
+        }
+        pos = it->second.pos;
+        own = it->second.decoder;
+    }
+    if (own) {
+        return own->getSamples(out, length, silent);
+    }
+
+    fill(pos + length);
+
+    // 块的大小固定, 只有最后一块可能不满; 取出用到的块后在锁外拷贝
+    std::vector<std::shared_ptr<const XPcmBlock>> blocks;
+    int64_t first;
+    int readed;
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        if (pos < mBase) {
+            // 落后太多, 要的块已经按上限释放
+            readed = 0;
+            first = -1;
+        } else {
+            readed = static_cast<int>(std::max<int64_t>(0, std::min<int64_t>(length, mEnd - pos)));
+            first = (pos - mBase) / BLOCK_BYTES;
+            int64_t last = readed > 0 ? (pos + readed - 1 - mBase) / BLOCK_BYTES : first - 1;
+            for (int64_t i = first; i <= last; ++i) {
+                blocks.push_back(mBlocks[i]);
+            }
+            first = mBase + first * BLOCK_BYTES;
+        }
+    }
+    if (first < 0) {
+        own = detach(reader, pos);
+        return own ? own->getSamples(out, length, silent) : AVERROR(EIO);
+    }
+    if (readed <= 0) {
+        return -1;
+    }
+
+    bool allSilent = silent != nullptr &&
+                     std::all_of(blocks.begin(), blocks.end(),
+                                 [](const std::shared_ptr<const XPcmBlock>& block) { return block->silent; });
+    if (allSilent) {
+        *silent = true;
+    } else {
+        int copied = 0;
+        int offset = static_cast<int>(pos - first);
+        for (auto& block : blocks) {
+            int n = std::min(readed - copied, block->size - offset);
+            if (block->silent) {
+                memset(out + copied, 0, n);
+            } else {
+                memcpy(out + copied, block->data.data() + offset, n);
+            }
+            copied += n;
+            offset = 0;
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(mMutex);
+    auto it = mReaders.find(reader);
+    if (it != mReaders.end()) {
+        it->second.pos = pos + readed;
+    }
+    release();
+    return readed;
+}
+
+int64_t XSharedSource::skip(int reader, int64_t length) {
+    std::shared_ptr<XDecoder> own;
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        auto it = mReaders.find(reader);
+        if (it == mReaders.end()) {
+            return AVERROR(EINVAL);
+        }
+        own = it->second.decoder;
+        if (!own) {
+            // 结尾未知时先按请求跳过, 之后的读取从这里开始, 超出结尾时读不到数据
+            int64_t skipped = mEof ? std::max<int64_t>(0, std::min(length, mEnd - it->second.pos)) : length;
+            it->second.pos += skipped;
+            release();
+            return skipped;
+        }
+    }
+    return own->skipSamples(length);
+}
+
+std::shared_ptr<XDecoder> XSharedSource::detach(int reader, int64_t pos) {
+    std::shared_ptr<XDecoder> decoder;
+    try {
+        decoder = std::make_shared<XDecoder>(mFilename, mDecoder->options());
+        decoder->start();
+    } catch (std::exception& e) {
+        XLOG(AV_LOG_ERROR, "XSharedSource", "open private decoder for %s failed: %s", mFilename.c_str(), e.what());
+        return nullptr;
+    }
+    if (pos > 0) {
+        decoder->skipSamples(pos);
+    }
+    XLOG(AV_LOG_INFO, "XSharedSource", "reader %d fell behind the shared cache of %s, decode privately",
+         reader, mFilename.c_str());
+
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        auto it = mReaders.find(reader);
+        if (it != mReaders.end()) {
+            it->second.decoder = decoder;
+            release();
+            return decoder;
+        }
+    }
+    decoder->stop();
+    return nullptr;
+}
+
+void XSharedSource::release() {
+    // 有单独解码器的读取器不再占用缓存; 超出上限时最早的块无论是否还有人要都释放
+    int64_t minPos = INT64_MAX;
+    for (auto& it : mReaders) {
+        if (!it.second.decoder) {
+            minPos = std::min(minPos, it.second.pos);
+        }
+    }
+    while (!mBlocks.empty() &&
+           (mBase + mBlocks.front()->size <= minPos || mBlocks.size() > static_cast<size_t>(MAX_CACHE_BLOCKS))) {
+        mBase += mBlocks.front()->size;
+        XMemoryBudget::instance().addCache(-static_cast<int64_t>(mBlocks.front()->data.size()));
+        mBlocks.pop_front();
+    }
+}
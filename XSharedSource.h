@@ -0,0 +1,100 @@
+//
+// Created by Andy on 2020/8/5.
+//
+
+#ifndef MIXER_XSHAREDSOURCE_H
+#define MIXER_XSHAREDSOURCE_H
+
+#include "XTelemetry.h"
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+class XDecoder;
+struct XDecoderOptions;
+
+/**
+ * 时间线上多次使用的同一素材: 只用一个解码器解码, 输出按固定大小的块保存, 各个位置的读取器共享这些只读块.
+ *
+ * - 块按需解码: 读取器要的数据还没解出来时, 在读取器的线程里从解码器取下一块, 同时只有一个线程在取
+ * - 块以 shared_ptr 共享, 读取器在锁外拷贝, 拷贝期间块不会被释放
+ * - 所有读取器都越过的块释放掉; 混音开始时各读取器先移到自己的裁剪起点, 读完或到裁剪结尾时关闭,
+ *   缓存只保留还有读取器要用的范围
+ * - 缓存最多 MAX_CACHE_BLOCKS 块: 落后太多(比如起始位置晚很多还没开始读)的读取器不再拖住缓存, 它要的块被释放后
+ *   改用自己单独的解码器, 从开头解码并丢到它的读位置, 之后照常读; 内存不随位置之间的间隔增长
+ * - 静音块只记标记不保存数据
+ */
+class XSharedSource {
+public:
+    /* 每块的字节数, S16 立体声约 0.37 秒 */
+    static const int BLOCK_BYTES = 64 * 1024;
+
+    /* 缓存的块数上限, 约 24 秒 */
+    static const int MAX_CACHE_BLOCKS = 64;
+
+    /* decoder 需要已经 start, 之后只由这里取样本 */
+    XSharedSource(const std::string& filename, std::shared_ptr<XDecoder> decoder);
+
+    ~XSharedSource();
+
+    const std::string& filename() const;
+
+    int64_t duration() const;
+
+    /* 共用的解码器的选项 */
+    const XDecoderOptions& options() const;
+
+    XDecoderStats stats() const;
+
+    /* 登记一个读取器, 读位置从素材开头开始 */
+    int open();
+
+    void close(int reader);
+
+    /* 和 XDecoder::getSamples 一样, 只在读到结尾时不足 length 字节 */
+    int read(int reader, uint8_t* out, int length, bool* silent);
+
+    /* 只前移读位置, 返回实际跳过的字节数 */
+    int64_t skip(int reader, int64_t length);
+
+private:
+    struct XPcmBlock {
+        std::vector<uint8_t> data;
+        int size = 0;
+        bool silent = false;
+    };
+
+    struct XReader {
+        int64_t pos = 0;
+        std::shared_ptr<XDecoder> decoder;     // 落后到缓存之外后单独使用的解码器
+    };
+
+    /* 解码到 end 字节或者结尾 */
+    void fill(int64_t end);
+
+    /* 释放所有读取器都已经越过的块, 以及超出上限的最早的块, 调用时持有 mMutex */
+    void release();
+
+    /* 读取器要的块已经释放, 给它打开单独的解码器并丢到 pos; 失败时返回空 */
+    std::shared_ptr<XDecoder> detach(int reader, int64_t pos);
+
+private:
+    std::string mFilename;
+    std::shared_ptr<XDecoder> mDecoder;
+
+    std::mutex mFillMutex;
+
+    mutable std::mutex mMutex;
+    std::deque<std::shared_ptr<const XPcmBlock>> mBlocks;
+    int64_t mBase;                      // mBlocks 第一块在素材里的字节位置
+    int64_t mEnd;                       // 已经解码的字节数
+    bool mEof;
+    std::map<int, XReader> mReaders;
+    int mNextReader;
+};
+
+#endif //MIXER_XSHAREDSOURCE_H
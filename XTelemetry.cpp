@@ -0,0 +1,198 @@
+//
+// Created by Andy on 2020/7/22.
+//
+
+#include "XTelemetry.h"
+
+#include <chrono>
+#include <cstdarg>
+#include <cstdio>
+
+std::atomic<bool> XTelemetry::sEnabled(false);
+
+void XTelemetry::setEnabled(bool enabled) {
+    sEnabled.store(enabled, std::memory_order_relaxed);
+}
+
+int64_t XTelemetry::now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void XGauge::sample(int64_t value) {
+    mLast.store(value, std::memory_order_relaxed);
+    if (value > mMax.load(std::memory_order_relaxed)) {
+        mMax.store(value, std::memory_order_relaxed);
+    }
+    mSum.add(static_cast<uint64_t>(value));
+    mCount.add();
+}
+
+XGaugeSnapshot XGauge::snapshot() const {
+    XGaugeSnapshot snapshot;
+    snapshot.last = mLast.load(std::memory_order_relaxed);
+    snapshot.max = mMax.load(std::memory_order_relaxed);
+    uint64_t count = mCount.value();
+    snapshot.mean = count > 0 ? static_cast<double>(mSum.value()) / count : 0;
+    return snapshot;
+}
+
+int XHistogram::bucketIndex(uint64_t value) {
+    if (value < 2 * SUB_BUCKETS) {
+        return static_cast<int>(value);
+    }
+
+    int msb = 63 - __builtin_clzll(value);
+    int shift = msb - SUB_BUCKET_BITS;
+    return (shift + 1) * SUB_BUCKETS + static_cast<int>((value >> shift) & (SUB_BUCKETS - 1));
+}
+
+void XHistogram::record(uint64_t value) {
+    mBuckets[bucketIndex(value)].add();
+    mCount.add();
+    mSum.add(value);
+    if (value > mMax.load(std::memory_order_relaxed)) {
+        mMax.store(value, std::memory_order_relaxed);
+    }
+}
+
+XHistogramSnapshot XHistogram::snapshot() const {
+    XHistogramSnapshot snapshot;
+    snapshot.buckets.resize(BUCKET_COUNT);
+    for (int i = 0; i < BUCKET_COUNT; ++i) {
+        snapshot.buckets[i] = mBuckets[i].value();
+    }
+    snapshot.count = mCount.value();
+    snapshot.sum = mSum.value();
+    snapshot.max = mMax.load(std::memory_order_relaxed);
+    return snapshot;
+}
+
+uint64_t XHistogramSnapshot::bucketUpperBound(int index) {
+    const int SUB_BUCKETS = XHistogram::SUB_BUCKETS;
+    if (index < 2 * SUB_BUCKETS) {
+        return static_cast<uint64_t>(index);
+    }
+
+    int shift = index / SUB_BUCKETS - 1;
+    uint64_t lower = static_cast<uint64_t>(SUB_BUCKETS + index % SUB_BUCKETS) << shift;
+    return lower + ((static_cast<uint64_t>(1) << shift) - 1);
+}
+
+double XHistogramSnapshot::mean() const {
+    return count > 0 ? static_cast<double>(sum) / count : 0;
+}
+
+uint64_t XHistogramSnapshot::percentile(double p) const {
+    // 快照时各个计数器不是同一时刻读取的, 这里以桶的总和为准
+    uint64_t total = 0;
+    for (uint64_t n : buckets) {
+        total += n;
+    }
+    if (total == 0) {
+        return 0;
+    }
+
+    uint64_t rank = static_cast<uint64_t>(p * total + 0.5);
+    rank = rank < 1 ? 1 : (rank > total ? total : rank);
+    uint64_t seen = 0;
+    for (size_t i = 0; i < buckets.size(); ++i) {
+        seen += buckets[i];
+        if (seen >= rank) {
+            uint64_t bound = bucketUpperBound(static_cast<int>(i));
+            return bound < max ? bound : max;
+        }
+    }
+    return max;
+}
+
+static void appendf(std::string& out, const char* format, ...) __attribute__((format(printf, 2, 3)));
+
+static void appendf(std::string& out, const char* format, ...) {
+    char text[512];
+    va_list args;
+    va_start(args, format);
+    int n = vsnprintf(text, sizeof(text), format, args);
+    va_end(args);
+    if (n > 0) {
+        out.append(text, static_cast<size_t>(n) < sizeof(text) ? n : sizeof(text) - 1);
+    }
+}
+
+static void appendString(std::string& out, const std::string& value) {
+    out += '"';
+    for (char c : value) {
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += c;
+        } else if (static_cast<unsigned char>(c) < 0x20) {
+            appendf(out, "\\u%04x", c);
+        } else {
+            out += c;
+        }
+    }
+    out += '"';
+}
+
+/* 直方图输出为微秒 */
+static void appendHistogram(std::string& out, const char* name, const XHistogramSnapshot& h) {
+    appendf(out, "\"%s\": {\"count\": %llu, \"mean_us\": %.3f, \"p50_us\": %.3f, \"p90_us\": %.3f, "
+                 "\"p99_us\": %.3f, \"max_us\": %.3f, \"total_ms\": %.3f}", name,
+            static_cast<unsigned long long>(h.count), h.mean() / 1e3, h.percentile(0.5) / 1e3,
+            h.percentile(0.9) / 1e3, h.percentile(0.99) / 1e3, h.max / 1e3, h.sum / 1e6);
+}
+
+static void appendQueue(std::string& out, const char* name, const XQueueStats& q) {
+    appendf(out, "\"%s\": {\"depth\": %lld, \"depth_max\": %lld, \"depth_mean\": %.1f, \"capacity\": %lld, "
+                 "\"full_waits\": %llu, \"full_wait_ms\": %.3f, \"empty_waits\": %llu, \"empty_wait_ms\": %.3f}",
+            name, static_cast<long long>(q.depth.last), static_cast<long long>(q.depth.max), q.depth.mean,
+            static_cast<long long>(q.capacity), static_cast<unsigned long long>(q.fullWaits.count),
+            q.fullWaits.waitNs / 1e6, static_cast<unsigned long long>(q.emptyWaits.count),
+            q.emptyWaits.waitNs / 1e6);
+}
+
+std::string XMixerStats::toJson() const {
+    std::string out;
+    out.reserve(2048 + inputs.size() * 1024);
+
+    appendf(out, "{\n  \"elapsed_ms\": %.3f,\n  \"mixed_samples\": %lld,\n  ", elapsedUs / 1e3,
+            static_cast<long long>(mixedSamples));
+    appendHistogram(out, "mix", mix);
+    out += ",\n  ";
+    appendHistogram(out, "encode", encode);
+    out += ",\n  ";
+    appendHistogram(out, "write", write);
+    appendf(out, ",\n  \"zero_frames\": %llu,\n  \"passthrough_frames\": %llu",
+            static_cast<unsigned long long>(zeroFrames), static_cast<unsigned long long>(passthroughFrames));
+    appendf(out, ",\n  \"memory\": {\"limit\": %lld, \"used\": %lld, \"peak\": %lld, \"planned\": %lld, "
+                 "\"cache\": %lld, \"inputs\": %d, \"grows\": %llu, \"shrinks\": %llu}",
+            static_cast<long long>(memory.limit), static_cast<long long>(memory.used),
+            static_cast<long long>(memory.peak), static_cast<long long>(memory.planned),
+            static_cast<long long>(memory.cache), memory.inputs, static_cast<unsigned long long>(memory.grows),
+            static_cast<unsigned long long>(memory.shrinks));
+    out += ",\n  \"inputs\": [";
+
+    for (size_t i = 0; i < inputs.size(); ++i) {
+        const XDecoderStats& input = inputs[i];
+        out += i == 0 ? "\n    {\"filename\": " : ",\n    {\"filename\": ";
+        appendString(out, input.filename);
+        out += ",\n     ";
+        appendHistogram(out, "demux", input.demux);
+        out += ",\n     ";
+        appendHistogram(out, "decode", input.decode);
+        out += ",\n     ";
+        appendHistogram(out, "resample", input.resample);
+        out += ",\n     ";
+        appendQueue(out, "packet_queue", input.packetQueue);
+        out += ",\n     ";
+        appendQueue(out, "sample_ring", input.sampleRing);
+        appendf(out, ",\n     \"reads\": %llu, \"silent_reads\": %llu", static_cast<unsigned long long>(input.reads),
+                static_cast<unsigned long long>(input.silentReads));
+        appendf(out, ",\n     \"open_us\": %lld, \"probe\": ", static_cast<long long>(input.openUs));
+        appendString(out, input.probe);
+        out += "}";
+    }
+
+    out += inputs.empty() ? "]\n}\n" : "\n  ]\n}\n";
+    return out;
+}
@@ -0,0 +1,180 @@
+//
+// Created by Andy on 2020/7/22.
+//
+
+#ifndef MIXER_XTELEMETRY_H
+#define MIXER_XTELEMETRY_H
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/**
+ * 流水线内部的性能统计.
+ *
+ * 所有计数器都是单写者的: 每个计数器只会被一个线程(读线程/解码线程/混音线程)更新, 写入时只做
+ * relaxed 的 load + store, 不需要加锁也没有原子 RMW; 任意线程都可以随时读取快照.
+ * 关闭时每个打点只多一次 relaxed load.
+ */
+class XTelemetry {
+public:
+    static bool isEnabled() {
+        return sEnabled.load(std::memory_order_relaxed);
+    }
+
+    static void setEnabled(bool enabled);
+
+    /* 单调时钟, 纳秒 */
+    static int64_t now();
+
+private:
+    static std::atomic<bool> sEnabled;
+};
+
+class XCounter {
+public:
+    void add(uint64_t n = 1) {
+        mValue.store(mValue.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+
+    uint64_t value() const {
+        return mValue.load(std::memory_order_relaxed);
+    }
+
+private:
+    std::atomic<uint64_t> mValue{0};
+};
+
+struct XGaugeSnapshot {
+    int64_t last = 0;
+    int64_t max = 0;
+    double mean = 0;
+};
+
+/* 队列/缓冲区占用的采样值 */
+class XGauge {
+public:
+    void sample(int64_t value);
+
+    XGaugeSnapshot snapshot() const;
+
+private:
+    std::atomic<int64_t> mLast{0};
+    std::atomic<int64_t> mMax{0};
+    XCounter mSum;
+    XCounter mCount;
+};
+
+struct XHistogramSnapshot {
+    uint64_t count = 0;
+    uint64_t sum = 0;
+    uint64_t max = 0;
+    std::vector<uint64_t> buckets;
+
+    double mean() const;
+
+    /* p 取值 [0, 1], 返回对应桶的上界 */
+    uint64_t percentile(double p) const;
+
+    static uint64_t bucketUpperBound(int index);
+};
+
+/**
+ * HDR 风格的对数-线性直方图: 每个 2 的幂区间再等分成 8 个子桶, 相对误差不超过 12.5%,
+ * 覆盖 [0, 2^64) 纳秒只需要 496 个桶, 记录时只有几次位运算.
+ */
+class XHistogram {
+public:
+    static const int SUB_BUCKET_BITS = 3;
+    static const int SUB_BUCKETS = 1 << SUB_BUCKET_BITS;
+    static const int BUCKET_COUNT = (64 - SUB_BUCKET_BITS + 1) * SUB_BUCKETS;
+
+    void record(uint64_t value);
+
+    XHistogramSnapshot snapshot() const;
+
+    static int bucketIndex(uint64_t value);
+
+private:
+    XCounter mBuckets[BUCKET_COUNT];
+    XCounter mCount;
+    XCounter mSum;
+    std::atomic<uint64_t> mMax{0};
+};
+
+/* 作用域计时, 析构时把耗时记入直方图, 统计关闭时不读时钟 */
+class XScopedTimer {
+public:
+    explicit XScopedTimer(XHistogram& histogram)
+            : mHistogram(histogram), mStart(XTelemetry::isEnabled() ? XTelemetry::now() : 0) {
+    }
+
+    ~XScopedTimer() {
+        if (mStart > 0) {
+            mHistogram.record(static_cast<uint64_t>(XTelemetry::now() - mStart));
+        }
+    }
+
+    XScopedTimer(const XScopedTimer&) = delete;
+
+    XScopedTimer& operator=(const XScopedTimer&) = delete;
+
+private:
+    XHistogram& mHistogram;
+    int64_t mStart;
+};
+
+struct XStallStats {
+    uint64_t count = 0;
+    uint64_t waitNs = 0;
+};
+
+/* 队列满时生产者等待(full), 队列空时消费者等待(empty) */
+struct XQueueStats {
+    XGaugeSnapshot depth;
+    int64_t capacity = 0;
+    XStallStats fullWaits;
+    XStallStats emptyWaits;
+};
+
+struct XDecoderStats {
+    std::string filename;
+    XHistogramSnapshot demux;       // av_read_frame
+    XHistogramSnapshot decode;      // avcodec_send_packet/avcodec_receive_frame
+    XHistogramSnapshot resample;    // swr_convert
+    XQueueStats packetQueue;        // 单位: 包
+    XQueueStats sampleRing;         // 单位: 字节
+    uint64_t reads = 0;             // 混音线程取样本的次数
+    uint64_t silentReads = 0;       // 其中整块是静音, 跳过转换和求和的次数
+    int64_t openUs = 0;             // 构造时打开输入和解码器的耗时
+    std::string probe;              // 参数来源: cache(探测缓存), header(格式提示+头部), full(avformat_find_stream_info)
+};
+
+/* 进程内内存预算, 单位: 字节 */
+struct XMemoryBudgetStats {
+    int64_t limit = 0;              // 0 表示不限制
+    int64_t used = 0;               // 各输入的样本缓冲、排队的包和共享素材缓存当前占用之和
+    int64_t peak = 0;
+    int64_t planned = 0;            // 按当前分配, 样本缓冲和包队列都满时的占用
+    int64_t cache = 0;              // 其中共享素材缓存的块
+    int inputs = 0;
+    uint64_t grows = 0;             // 样本缓冲实际换大/换小的次数
+    uint64_t shrinks = 0;
+};
+
+struct XMixerStats {
+    int64_t elapsedUs = 0;
+    int64_t mixedSamples = 0;
+    XHistogramSnapshot mix;         // 每个混音块的求和/音效/总线处理, 不含等待样本和编码
+    XHistogramSnapshot encode;      // avcodec_send_frame/avcodec_receive_packet
+    XHistogramSnapshot write;       // av_interleaved_write_frame
+    uint64_t zeroFrames = 0;        // 所有输入都静音, 直接编码共享零帧的次数
+    uint64_t passthroughFrames = 0; // 不经过编码直接封装的帧数
+    XMemoryBudgetStats memory;
+    std::vector<XDecoderStats> inputs;
+
+    std::string toJson() const;
+};
+
+#endif //MIXER_XTELEMETRY_H
@@ -0,0 +1,167 @@
+//
+// Created by Andy on 2020/7/24.
+//
+
+#include "XTrace.h"
+
+#if XTRACE_ENABLED
+
+#include "XTelemetry.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace {
+
+    enum XTraceType : char {
+        TRACE_COMPLETE = 'X',
+        TRACE_INSTANT = 'i'
+    };
+
+    struct XTraceEvent {
+        const char* name;
+        int64_t timestamp;
+        int64_t duration;
+        XTraceType type;
+    };
+
+    /* 单写者环形缓冲, 写入位置单调递增, 导出时只读取已经发布的部分 */
+    struct XTraceBuffer {
+        static const int CAPACITY = 1 << 16;
+
+        explicit XTraceBuffer(int id) : id(id), events(CAPACITY) {}
+
+        void push(const char* name, int64_t timestamp, int64_t duration, XTraceType type) {
+            uint64_t index = written.load(std::memory_order_relaxed);
+            XTraceEvent& event = events[index & (CAPACITY - 1)];
+            event.name = name;
+            event.timestamp = timestamp;
+            event.duration = duration;
+            event.type = type;
+            written.store(index + 1, std::memory_order_release);
+        }
+
+        int id;
+        std::string threadName;
+        std::vector<XTraceEvent> events;
+        std::atomic<uint64_t> written{0};
+        std::atomic<bool> alive{true};
+    };
+
+    std::mutex sRegistryMutex;
+    std::vector<std::shared_ptr<XTraceBuffer>> sRegistry;
+    int sNextId = 1;
+
+    /* 线程退出时只做标记, 缓冲保留到下一次导出, 解码线程往往在混音结束之前就退出了 */
+    struct XTraceThreadBuffer {
+        std::shared_ptr<XTraceBuffer> buffer;
+
+        ~XTraceThreadBuffer() {
+            if (buffer) {
+                buffer->alive = false;
+            }
+        }
+    };
+
+    XTraceBuffer* threadBuffer() {
+        static thread_local XTraceThreadBuffer local;
+        if (!local.buffer) {
+            std::lock_guard<std::mutex> lock(sRegistryMutex);
+            local.buffer = std::make_shared<XTraceBuffer>(sNextId++);
+            sRegistry.emplace_back(local.buffer);
+        }
+        return local.buffer.get();
+    }
+
+    void writeString(FILE* file, const std::string& value) {
+        fputc('"', file);
+        for (char c : value) {
+            if (c == '"' || c == '\\') {
+                fputc('\\', file);
+                fputc(c, file);
+            } else if (static_cast<unsigned char>(c) >= 0x20) {
+                fputc(c, file);
+            }
+        }
+        fputc('"', file);
+    }
+}
+
+void XTrace::setThreadName(const std::string& name) {
+    XTraceBuffer* buffer = threadBuffer();
+    std::lock_guard<std::mutex> lock(sRegistryMutex);
+    buffer->threadName = name;
+}
+
+void XTrace::complete(const char* name, int64_t start, int64_t duration) {
+    threadBuffer()->push(name, start, duration, TRACE_COMPLETE);
+}
+
+void XTrace::instant(const char* name) {
+    threadBuffer()->push(name, XTelemetry::now(), 0, TRACE_INSTANT);
+}
+
+int XTrace::write(const std::string& path, int64_t since) {
+    FILE* file = fopen(path.data(), "w");
+    if (!file) {
+        return -1;
+    }
+
+    std::lock_guard<std::mutex> lock(sRegistryMutex);
+    fprintf(file, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+    bool first = true;
+    for (auto& buffer : sRegistry) {
+        if (!buffer->threadName.empty()) {
+            fprintf(file, "%s{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, \"args\": {\"name\": ",
+                    first ? "" : ",\n", buffer->id);
+            writeString(file, buffer->threadName);
+            fprintf(file, "}}");
+            first = false;
+        }
+
+        // 仍在运行的线程可能正在覆盖最旧的事件, 跳过这一部分
+        uint64_t end = buffer->written.load(std::memory_order_acquire);
+        uint64_t begin = end > XTraceBuffer::CAPACITY ? end - XTraceBuffer::CAPACITY + 1024 : 0;
+        for (uint64_t i = begin; i < end; ++i) {
+            const XTraceEvent& event = buffer->events[i & (XTraceBuffer::CAPACITY - 1)];
+            if (event.timestamp < since) {
+                continue;
+            }
+
+            double ts = (event.timestamp - since) / 1e3;
+            const char* separator = first ? "" : ",\n";
+            first = false;
+            switch (event.type) {
+                case TRACE_COMPLETE:
+                    fprintf(file, "%s{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f}",
+                            separator, event.name, buffer->id, ts, event.duration / 1e3);
+                    break;
+                case TRACE_INSTANT:
+                    fprintf(file, "%s{\"name\": \"%s\", \"ph\": \"i\", \"s\": \"t\", \"pid\": 1, \"tid\": %d, \"ts\": %.3f}",
+                            separator, event.name, buffer->id, ts);
+                    break;
+            }
+        }
+    }
+    fprintf(file, "\n]}\n");
+    int ret = fclose(file) == 0 ? 0 : -1;
+
+    sRegistry.erase(std::remove_if(sRegistry.begin(), sRegistry.end(),
+                                   [](const std::shared_ptr<XTraceBuffer>& buffer) { return !buffer->alive; }),
+                    sRegistry.end());
+    return ret;
+}
+
+XTraceScope::XTraceScope(const char* name)
+        : mName(name), mStart(XTelemetry::now()) {
+}
+
+XTraceScope::~XTraceScope() {
+    XTrace::complete(mName, mStart, XTelemetry::now() - mStart);
+}
+
+#endif
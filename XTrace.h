@@ -0,0 +1,71 @@
+//
+// Created by Andy on 2020/7/24.
+//
+
+#ifndef MIXER_XTRACE_H
+#define MIXER_XTRACE_H
+
+/**
+ * 线程时间线追踪, 输出 Chrome trace 格式(chrome://tracing 或 ui.perfetto.dev 打开).
+ *
+ * 编译时用 -DXTRACE_ENABLED=1 打开(cmake -DMIXER_TRACE=ON), 默认关闭, 关闭时所有宏展开为空语句,
+ * 不产生任何代码. 打开后每个线程第一次打点时分配自己的环形缓冲, 写满后覆盖最旧的事件,
+ * 打点只写本线程的缓冲, 没有锁.
+ *
+ *   XTRACE_THREAD_NAME("audioWorkThread");
+ *   XTRACE_SCOPE("avcodec_send_packet");      // 作用域结束时记录一个完整事件
+ *   XTRACE_INSTANT("underrun");
+ *
+ * 事件名必须是字符串常量, 缓冲里只保存指针.
+ */
+#ifndef XTRACE_ENABLED
+#define XTRACE_ENABLED 0
+#endif
+
+#if XTRACE_ENABLED
+
+#include <cstdint>
+#include <string>
+
+class XTrace {
+public:
+    static void setThreadName(const std::string& name);
+
+    static void complete(const char* name, int64_t start, int64_t duration);
+
+    static void instant(const char* name);
+
+    /* 把 since(纳秒, XTelemetry::now 的时钟)之后的事件写成 Chrome trace JSON, 已退出线程的缓冲随后释放 */
+    static int write(const std::string& path, int64_t since);
+};
+
+class XTraceScope {
+public:
+    explicit XTraceScope(const char* name);
+
+    ~XTraceScope();
+
+    XTraceScope(const XTraceScope&) = delete;
+
+    XTraceScope& operator=(const XTraceScope&) = delete;
+
+private:
+    const char* mName;
+    int64_t mStart;
+};
+
+#define XTRACE_CONCAT_(a, b) a##b
+#define XTRACE_CONCAT(a, b) XTRACE_CONCAT_(a, b)
+#define XTRACE_SCOPE(name) XTraceScope XTRACE_CONCAT(xtraceScope_, __LINE__)(name)
+#define XTRACE_THREAD_NAME(name) XTrace::setThreadName(name)
+#define XTRACE_INSTANT(name) XTrace::instant(name)
+
+#else
+
+#define XTRACE_SCOPE(name) do {} while (0)
+#define XTRACE_THREAD_NAME(name) do {} while (0)
+#define XTRACE_INSTANT(name) do {} while (0)
+
+#endif
+
+#endif //MIXER_XTRACE_H
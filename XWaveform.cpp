@@ -0,0 +1,206 @@
+//
+// Created by Andy on 2020/8/7.
+//
+
+#include "XWaveform.h"
+#include "XMixKernels.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cfloat>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+
+namespace {
+
+    void putU16(std::vector<uint8_t>& out, uint32_t v) {
+        out.push_back(static_cast<uint8_t>(v & 0xff));
+        out.push_back(static_cast<uint8_t>((v >> 8) & 0xff));
+    }
+
+    void putU32(std::vector<uint8_t>& out, uint32_t v) {
+        putU16(out, v & 0xffff);
+        putU16(out, v >> 16);
+    }
+
+    int16_t quantize(double v) {
+        v = std::round(v * 32767.0);
+        return static_cast<int16_t>(std::max(-32768.0, std::min(32767.0, v)));
+    }
+}
+
+XWaveform::XWaveform(int sampleRate, const std::vector<int>& binSizes) : mSampleRate(sampleRate), mSamples(0) {
+    std::vector<int> sizes;
+    for (int size : binSizes) {
+        if (size > 0) {
+            sizes.push_back(size);
+        }
+    }
+    if (sizes.empty()) {
+        sizes.push_back(1024);
+    }
+    std::sort(sizes.begin(), sizes.end());
+
+    int finest = sizes.front();
+    for (int size : sizes) {
+        int rounded = (size + finest - 1) / finest * finest;
+        if (!mLevels.empty() && mLevels.back().binSize == rounded) {
+            continue;
+        }
+        XLevel level;
+        level.binSize = rounded;
+        resetBin(level.bin);
+        mLevels.push_back(std::move(level));
+    }
+}
+
+int64_t XWaveform::samples() const {
+    return mSamples;
+}
+
+void XWaveform::process(const float* samples, int nbSamples) {
+    XLevel& fine = mLevels.front();
+    while (nbSamples > 0) {
+        int n = std::min(nbSamples, fine.binSize - fine.bin.count);
+
+        XBin part;
+        float sumSq[CHANNELS];
+        XMixKernels::summarizeStereo(samples, n, part.min, part.max, sumSq);
+        for (int c = 0; c < CHANNELS; ++c) {
+            part.sumSq[c] = sumSq[c];
+        }
+        part.count = n;
+        mergeBin(fine.bin, part);
+
+        samples += n * CHANNELS;
+        nbSamples -= n;
+        mSamples += n;
+        if (fine.bin.count == fine.binSize) {
+            emitBin();
+        }
+    }
+}
+
+void XWaveform::processS16(const int16_t* samples, int nbSamples) {
+    int count = nbSamples * CHANNELS;
+    if (mScratch.size() < static_cast<size_t>(count)) {
+        mScratch.resize(count);
+    }
+    XMixKernels::s16ToFloat(samples, mScratch.data(), count);
+    process(mScratch.data(), nbSamples);
+}
+
+void XWaveform::processSilence(int nbSamples) {
+    XLevel& fine = mLevels.front();
+    while (nbSamples > 0) {
+        int n = std::min(nbSamples, fine.binSize - fine.bin.count);
+
+        XBin part;
+        for (int c = 0; c < CHANNELS; ++c) {
+            part.min[c] = 0.0f;
+            part.max[c] = 0.0f;
+            part.sumSq[c] = 0.0;
+        }
+        part.count = n;
+        mergeBin(fine.bin, part);
+
+        nbSamples -= n;
+        mSamples += n;
+        if (fine.bin.count == fine.binSize) {
+            emitBin();
+        }
+    }
+}
+
+int XWaveform::write(const std::string& path) {
+    // 结尾不足一格的部分: 最细一级先作为一格写出并合并到粗的级别, 粗的级别再各自写出
+    if (mLevels.front().bin.count > 0) {
+        emitBin();
+    }
+    for (size_t i = 1; i < mLevels.size(); ++i) {
+        if (mLevels[i].bin.count > 0) {
+            appendBin(mLevels[i], mLevels[i].bin);
+            resetBin(mLevels[i].bin);
+        }
+    }
+
+    std::vector<uint8_t> header;
+    header.insert(header.end(), {'X', 'W', 'A', 'V'});
+    putU16(header, VERSION);
+    putU16(header, CHANNELS);
+    putU32(header, static_cast<uint32_t>(mSampleRate));
+    putU16(header, static_cast<uint32_t>(mLevels.size()));
+    putU16(header, 0);
+    for (auto& level : mLevels) {
+        putU32(header, static_cast<uint32_t>(level.binSize));
+        putU32(header, static_cast<uint32_t>(level.data.size() / (CHANNELS * 3)));
+    }
+
+    std::string tmpPath = path + ".tmp";
+    {
+        std::ofstream out(tmpPath, std::ios::trunc | std::ios::binary);
+        if (!out) {
+            return -errno;
+        }
+        out.write(reinterpret_cast<const char*>(header.data()), header.size());
+
+        std::vector<uint8_t> data;
+        for (auto& level : mLevels) {
+            data.clear();
+            data.reserve(level.data.size() * 2);
+            for (int16_t v : level.data) {
+                putU16(data, static_cast<uint16_t>(v));
+            }
+            out.write(reinterpret_cast<const char*>(data.data()), data.size());
+        }
+        if (!out) {
+            return -EIO;
+        }
+    }
+
+    if (rename(tmpPath.data(), path.data()) != 0) {
+        return -errno;
+    }
+    return 0;
+}
+
+void XWaveform::resetBin(XBin& bin) {
+    for (int c = 0; c < CHANNELS; ++c) {
+        bin.min[c] = FLT_MAX;
+        bin.max[c] = -FLT_MAX;
+        bin.sumSq[c] = 0.0;
+    }
+    bin.count = 0;
+}
+
+void XWaveform::mergeBin(XBin& dst, const XBin& src) {
+    for (int c = 0; c < CHANNELS; ++c) {
+        dst.min[c] = std::min(dst.min[c], src.min[c]);
+        dst.max[c] = std::max(dst.max[c], src.max[c]);
+        dst.sumSq[c] += src.sumSq[c];
+    }
+    dst.count += src.count;
+}
+
+void XWaveform::appendBin(XLevel& level, const XBin& bin) {
+    for (int c = 0; c < CHANNELS; ++c) {
+        level.data.push_back(quantize(bin.min[c]));
+        level.data.push_back(quantize(bin.max[c]));
+        level.data.push_back(quantize(std::sqrt(bin.sumSq[c] / std::max(1, bin.count))));
+    }
+}
+
+void XWaveform::emitBin() {
+    XLevel& fine = mLevels.front();
+    appendBin(fine, fine.bin);
+    for (size_t i = 1; i < mLevels.size(); ++i) {
+        XLevel& level = mLevels[i];
+        mergeBin(level.bin, fine.bin);
+        if (level.bin.count == level.binSize) {
+            appendBin(level, level.bin);
+            resetBin(level.bin);
+        }
+    }
+    resetBin(fine.bin);
+}
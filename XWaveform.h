@@ -0,0 +1,73 @@
+//
+// Created by Andy on 2020/8/7.
+//
+
+#ifndef MIXER_XWAVEFORM_H
+#define MIXER_XWAVEFORM_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/**
+ * 多级波形概览, 给编辑界面画波形用: 每一级按 binSize 个采样点一格, 记下每个声道的最小值、最大值和均方根.
+ *
+ * - 最细一级直接从样本归约, 较粗的级别由最细一级的格合并(极值取极值, 平方和相加), 样本只扫一遍
+ * - 每一级的 binSize 向上取整到最细一级的整数倍
+ * - 处理交错立体声 float 样本; 静音段不看样本, 直接记零
+ *
+ * 旁路文件格式, 小端:
+ *   头部: "XWAV" | version u16 | channels u16 | sampleRate u32 | levelCount u16 | reserved u16
+ *   每级: binSize u32 | binCount u32
+ *   数据: 按级依次存放, 每格每个声道 min i16 | max i16 | rms i16, 满幅为 32767
+ */
+class XWaveform {
+public:
+    static const int VERSION = 1;
+    static const int CHANNELS = 2;
+
+    XWaveform(int sampleRate, const std::vector<int>& binSizes);
+
+    void process(const float* samples, int nbSamples);
+
+    void processS16(const int16_t* samples, int nbSamples);
+
+    void processSilence(int nbSamples);
+
+    /* 已经处理的采样点数 */
+    int64_t samples() const;
+
+    /* 不足一格的结尾也作为一格写出, 之后不能再处理样本. 先写临时文件再改名, 读取方不会看到写了一半的文件 */
+    int write(const std::string& path);
+
+private:
+    struct XBin {
+        float min[CHANNELS];
+        float max[CHANNELS];
+        double sumSq[CHANNELS];
+        int count;
+    };
+
+    struct XLevel {
+        int binSize;
+        XBin bin;                       // 正在累积的一格
+        std::vector<int16_t> data;      // 已经完成的格, 每格 CHANNELS * 3 个值
+    };
+
+    static void resetBin(XBin& bin);
+
+    static void mergeBin(XBin& dst, const XBin& src);
+
+    static void appendBin(XLevel& level, const XBin& bin);
+
+    /* 最细一级完成一格: 写入最细一级, 合并到较粗的级别 */
+    void emitBin();
+
+private:
+    int mSampleRate;
+    std::vector<XLevel> mLevels;
+    std::vector<float> mScratch;
+    int64_t mSamples;
+};
+
+#endif //MIXER_XWAVEFORM_H
@@ -0,0 +1,438 @@
+//
+// Created by Andy on 2020/7/20.
+//
+
+#include "XBench.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <iostream>
+#include <new>
+#include <regex>
+#include <sys/resource.h>
+
+/*
+ * 分配计数: glibc 下直接替换 malloc 系列(FFmpeg 的 av_malloc 也会被统计到), operator new 最终也走 malloc;
+ * 其它平台只能替换 operator new, 只统计 C++ 的分配.
+ */
+static std::atomic<int64_t> sAllocCount(0);
+
+#if defined(__GLIBC__)
+
+extern "C" {
+void* __libc_malloc(size_t size);
+void* __libc_calloc(size_t count, size_t size);
+void* __libc_realloc(void* ptr, size_t size);
+void* __libc_memalign(size_t alignment, size_t size);
+void __libc_free(void* ptr);
+
+void* malloc(size_t size) {
+    sAllocCount.fetch_add(1, std::memory_order_relaxed);
+    return __libc_malloc(size);
+}
+
+void* calloc(size_t count, size_t size) {
+    sAllocCount.fetch_add(1, std::memory_order_relaxed);
+    return __libc_calloc(count, size);
+}
+
+void* realloc(void* ptr, size_t size) {
+    sAllocCount.fetch_add(1, std::memory_order_relaxed);
+    return __libc_realloc(ptr, size);
+}
+
+void* memalign(size_t alignment, size_t size) {
+    sAllocCount.fetch_add(1, std::memory_order_relaxed);
+    return __libc_memalign(alignment, size);
+}
+
+void* aligned_alloc(size_t alignment, size_t size) {
+    sAllocCount.fetch_add(1, std::memory_order_relaxed);
+    return __libc_memalign(alignment, size);
+}
+
+int posix_memalign(void** ptr, size_t alignment, size_t size) {
+    if (alignment < sizeof(void*) || (alignment & (alignment - 1)) != 0) {
+        return EINVAL;
+    }
+    sAllocCount.fetch_add(1, std::memory_order_relaxed);
+    void* p = __libc_memalign(alignment, size);
+    if (!p) {
+        return ENOMEM;
+    }
+    *ptr = p;
+    return 0;
+}
+
+void free(void* ptr) {
+    __libc_free(ptr);
+}
+}
+
+#else
+
+void* operator new(size_t size) {
+    sAllocCount.fetch_add(1, std::memory_order_relaxed);
+    void* p = std::malloc(size ? size : 1);
+    if (!p) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void* operator new[](size_t size) {
+    return operator new(size);
+}
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept {
+    sAllocCount.fetch_add(1, std::memory_order_relaxed);
+    return std::malloc(size ? size : 1);
+}
+
+void* operator new[](size_t size, const std::nothrow_t& tag) noexcept {
+    return operator new(size, tag);
+}
+
+void operator delete(void* ptr) noexcept {
+    std::free(ptr);
+}
+
+void operator delete[](void* ptr) noexcept {
+    std::free(ptr);
+}
+
+void operator delete(void* ptr, size_t) noexcept {
+    std::free(ptr);
+}
+
+void operator delete[](void* ptr, size_t) noexcept {
+    std::free(ptr);
+}
+
+#endif
+
+XBenchState::XBenchState(int64_t maxIterations, int64_t arg)
+        : mMaxIterations(maxIterations), mIterations(0), mArg(arg), mStarted(false), mRunning(false), mWallStart(0),
+          mCpuStart(0), mWallNs(0), mCpuNs(0), mAllocStart(0), mAllocs(0), mItems(0), mBytes(0) {
+}
+
+bool XBenchState::keepRunning() {
+    if (!mStarted) {
+        mStarted = true;
+        resumeTiming();
+    }
+
+    if (mIterations < mMaxIterations && mSkipReason.empty()) {
+        ++mIterations;
+        return true;
+    }
+
+    pauseTiming();
+    return false;
+}
+
+void XBenchState::pauseTiming() {
+    if (!mRunning) {
+        return;
+    }
+    mRunning = false;
+    mWallNs += XBenchRunner::wallTimeNs() - mWallStart;
+    mCpuNs += XBenchRunner::cpuTimeNs() - mCpuStart;
+    mAllocs += XBenchRunner::allocationCount() - mAllocStart;
+}
+
+void XBenchState::resumeTiming() {
+    if (mRunning) {
+        return;
+    }
+    mRunning = true;
+    mAllocStart = XBenchRunner::allocationCount();
+    mCpuStart = XBenchRunner::cpuTimeNs();
+    mWallStart = XBenchRunner::wallTimeNs();
+}
+
+int64_t XBenchState::iterations() const {
+    return mIterations;
+}
+
+int64_t XBenchState::arg() const {
+    return mArg;
+}
+
+void XBenchState::setItemsProcessed(int64_t items) {
+    mItems = items;
+}
+
+void XBenchState::setBytesProcessed(int64_t bytes) {
+    mBytes = bytes;
+}
+
+void XBenchState::counter(const std::string& name, double value) {
+    mCounters[name] = value;
+}
+
+void XBenchState::skip(const std::string& reason) {
+    mSkipReason = reason;
+}
+
+XBenchmark::XBenchmark(const std::string& name, std::function<void(XBenchState&)> fn)
+        : mName(name), mFn(std::move(fn)), mFixedIterations(0) {
+}
+
+XBenchmark* XBenchmark::args(const std::vector<int64_t>& values) {
+    mArgs = values;
+    return this;
+}
+
+XBenchmark* XBenchmark::iterations(int64_t count) {
+    mFixedIterations = count;
+    return this;
+}
+
+static std::vector<std::unique_ptr<XBenchmark>>& registry() {
+    static std::vector<std::unique_ptr<XBenchmark>> benchmarks;
+    return benchmarks;
+}
+
+XBenchmark* XBenchRunner::add(const std::string& name, std::function<void(XBenchState&)> fn) {
+    registry().emplace_back(new XBenchmark(name, std::move(fn)));
+    return registry().back().get();
+}
+
+int64_t XBenchRunner::allocationCount() {
+    return sAllocCount.load(std::memory_order_relaxed);
+}
+
+int64_t XBenchRunner::peakRss() {
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) {
+        return 0;
+    }
+#if defined(__APPLE__)
+    return usage.ru_maxrss;
+#else
+    return static_cast<int64_t>(usage.ru_maxrss) * 1024;
+#endif
+}
+
+int64_t XBenchRunner::wallTimeNs() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+int64_t XBenchRunner::cpuTimeNs() {
+    // 进程 CPU 时间, 包含解码线程在内
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return static_cast<int64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+struct XBenchResult {
+    std::string name;
+    int64_t iterations = 0;
+    double realNs = 0;
+    double cpuNs = 0;
+    double allocs = 0;
+    double itemsPerSecond = 0;
+    double bytesPerSecond = 0;
+    std::map<std::string, double> counters;
+    std::string skipped;
+};
+
+static std::string humanRate(double value) {
+    static const char* UNITS[] = {"", "k", "M", "G", "T"};
+    int unit = 0;
+    while (value >= 1000 && unit < 4) {
+        value /= 1000;
+        ++unit;
+    }
+    char text[32];
+    snprintf(text, sizeof(text), "%.3g%s", value, UNITS[unit]);
+    return text;
+}
+
+static std::map<std::string, double> loadBaseline(const std::string& path) {
+    // 只解析自己输出的 json: 每个测试项单独一行
+    std::map<std::string, double> baseline;
+    std::ifstream in(path);
+    if (!in) {
+        std::cerr << "cannot open baseline: " << path << std::endl;
+        return baseline;
+    }
+
+    std::regex pattern("\"name\": \"([^\"]+)\".*\"real_time_ns\": ([-+0-9.eE]+)");
+    std::string line;
+    std::smatch match;
+    while (std::getline(in, line)) {
+        if (std::regex_search(line, match, pattern)) {
+            baseline[match[1]] = std::atof(match[2].str().data());
+        }
+    }
+    return baseline;
+}
+
+static void writeJson(const std::string& path, const std::vector<XBenchResult>& results) {
+    FILE* file = fopen(path.data(), "w");
+    if (!file) {
+        std::cerr << "cannot write json: " << path << std::endl;
+        return;
+    }
+
+    fprintf(file, "{\n  \"peak_rss_bytes\": %lld,\n  \"benchmarks\": [\n", static_cast<long long>(XBenchRunner::peakRss()));
+    for (size_t i = 0; i < results.size(); ++i) {
+        const XBenchResult& r = results[i];
+        fprintf(file, "    {\"name\": \"%s\", \"iterations\": %lld, \"real_time_ns\": %.3f, \"cpu_time_ns\": %.3f, "
+                      "\"allocs_per_iter\": %.3f, \"items_per_second\": %.3f, \"bytes_per_second\": %.3f",
+                r.name.data(), static_cast<long long>(r.iterations), r.realNs, r.cpuNs, r.allocs, r.itemsPerSecond,
+                r.bytesPerSecond);
+        for (auto& counter : r.counters) {
+            fprintf(file, ", \"%s\": %.6g", counter.first.data(), counter.second);
+        }
+        if (!r.skipped.empty()) {
+            fprintf(file, ", \"skipped\": \"%s\"", r.skipped.data());
+        }
+        fprintf(file, "}%s\n", i + 1 < results.size() ? "," : "");
+    }
+    fprintf(file, "  ]\n}\n");
+    fclose(file);
+}
+
+static void printResult(const XBenchResult& r, const std::map<std::string, double>& baseline) {
+    if (!r.skipped.empty()) {
+        printf("%-36s SKIPPED: %s\n", r.name.data(), r.skipped.data());
+        return;
+    }
+
+    printf("%-36s %12.1f ns %12.1f ns %10lld %8.2f", r.name.data(), r.realNs, r.cpuNs,
+           static_cast<long long>(r.iterations), r.allocs);
+    if (r.itemsPerSecond > 0) {
+        printf("  items/s=%s", humanRate(r.itemsPerSecond).data());
+    }
+    if (r.bytesPerSecond > 0) {
+        printf("  bytes/s=%s", humanRate(r.bytesPerSecond).data());
+    }
+    for (auto& counter : r.counters) {
+        printf("  %s=%.4g", counter.first.data(), counter.second);
+    }
+
+    auto it = baseline.find(r.name);
+    if (it != baseline.end() && it->second > 0) {
+        printf("  [%+.1f%% vs baseline]", (r.realNs - it->second) * 100 / it->second);
+    }
+    printf("\n");
+    fflush(stdout);
+}
+
+int XBenchRunner::run(int argc, char* argv[]) {
+    double minTime = 0.5;
+    std::string filter = ".*";
+    std::string jsonPath;
+    std::string baselinePath;
+    bool list = false;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg.compare(0, 9, "--filter=") == 0) {
+            filter = arg.substr(9);
+        } else if (arg.compare(0, 11, "--min_time=") == 0) {
+            minTime = std::atof(arg.substr(11).data());
+        } else if (arg.compare(0, 7, "--json=") == 0) {
+            jsonPath = arg.substr(7);
+        } else if (arg.compare(0, 11, "--baseline=") == 0) {
+            baselinePath = arg.substr(11);
+        } else if (arg == "--list") {
+            list = true;
+        }
+    }
+
+    std::regex pattern;
+    try {
+        pattern = std::regex(filter);
+    } catch (std::regex_error& e) {
+        std::cerr << "invalid filter: " << filter << std::endl;
+        return 1;
+    }
+
+    std::map<std::string, double> baseline;
+    if (!baselinePath.empty()) {
+        baseline = loadBaseline(baselinePath);
+    }
+
+    if (!list) {
+        printf("%-36s %15s %15s %10s %8s\n", "Benchmark", "Time", "CPU", "Iterations", "Allocs");
+        printf("%s\n", std::string(88, '-').data());
+    }
+
+    std::vector<XBenchResult> results;
+    for (auto& benchmark : registry()) {
+        std::vector<int64_t> args = benchmark->mArgs;
+        if (args.empty()) {
+            args.push_back(-1);
+        }
+
+        for (int64_t arg : args) {
+            std::string name = benchmark->mName;
+            if (arg >= 0) {
+                name += "/" + std::to_string(arg);
+            }
+            if (!std::regex_search(name, pattern)) {
+                continue;
+            }
+            if (list) {
+                printf("%s\n", name.data());
+                continue;
+            }
+
+            // 迭代次数从 1 开始按耗时放大, 直到单次测量超过 minTime
+            int64_t iterations = benchmark->mFixedIterations > 0 ? benchmark->mFixedIterations : 1;
+            XBenchResult result;
+            result.name = name;
+            for (;;) {
+                XBenchState state(iterations, arg);
+                benchmark->mFn(state);
+                state.pauseTiming();
+
+                double seconds = state.mWallNs / 1e9;
+                bool done = benchmark->mFixedIterations > 0 || !state.mSkipReason.empty() || seconds >= minTime ||
+                            iterations >= 1000000000;
+                if (!done) {
+                    double multiplier = seconds <= minTime / 10 ? 10 : minTime * 1.4 / seconds;
+                    iterations = std::max(iterations + 1, static_cast<int64_t>(iterations * multiplier));
+                    continue;
+                }
+
+                int64_t count = std::max<int64_t>(1, state.mIterations);
+                result.iterations = state.mIterations;
+                result.realNs = static_cast<double>(state.mWallNs) / count;
+                result.cpuNs = static_cast<double>(state.mCpuNs) / count;
+                result.allocs = static_cast<double>(state.mAllocs) / count;
+                if (seconds > 0) {
+                    result.itemsPerSecond = state.mItems / seconds;
+                    result.bytesPerSecond = state.mBytes / seconds;
+                }
+                result.counters = state.mCounters;
+                result.skipped = state.mSkipReason;
+                break;
+            }
+
+            printResult(result, baseline);
+            results.push_back(result);
+        }
+    }
+
+    if (!list) {
+        printf("%s\npeak RSS: %.1f MB\n", std::string(88, '-').data(), peakRss() / (1024.0 * 1024.0));
+    }
+
+    if (!jsonPath.empty()) {
+        writeJson(jsonPath, results);
+    }
+    return 0;
+}
@@ -0,0 +1,111 @@
+//
+// Created by Andy on 2020/7/20.
+//
+
+#ifndef MIXER_XBENCH_H
+#define MIXER_XBENCH_H
+
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+
+/**
+ * 仿 Google Benchmark 的最小性能测试框架:
+ *
+ *   static void BM_Foo(XBenchState& state) {
+ *       for (...准备...)
+ *       while (state.keepRunning()) { ...被测代码... }
+ *       state.setItemsProcessed(state.iterations() * n);
+ *   }
+ *   XBENCH(BM_Foo)->args({1, 8, 32});
+ *
+ * 迭代次数自动调整到单次测量至少 minTime 秒; 宏观测试可以用 iterations(1) 固定只跑一次.
+ */
+class XBenchState {
+public:
+    XBenchState(int64_t maxIterations, int64_t arg);
+
+    /* 循环条件, 第一次调用时开始计时, 返回 false 时停止计时 */
+    bool keepRunning();
+
+    void pauseTiming();
+
+    void resumeTiming();
+
+    int64_t iterations() const;
+
+    int64_t arg() const;
+
+    void setItemsProcessed(int64_t items);
+
+    void setBytesProcessed(int64_t bytes);
+
+    /* 自定义指标, 原样输出 */
+    void counter(const std::string& name, double value);
+
+    void skip(const std::string& reason);
+
+private:
+    friend class XBenchRunner;
+
+    int64_t mMaxIterations;
+    int64_t mIterations;
+    int64_t mArg;
+    bool mStarted;
+    bool mRunning;
+
+    int64_t mWallStart;
+    int64_t mCpuStart;
+    int64_t mWallNs;
+    int64_t mCpuNs;
+    int64_t mAllocStart;
+    int64_t mAllocs;
+
+    int64_t mItems;
+    int64_t mBytes;
+    std::map<std::string, double> mCounters;
+    std::string mSkipReason;
+};
+
+class XBenchmark {
+public:
+    XBenchmark(const std::string& name, std::function<void(XBenchState&)> fn);
+
+    XBenchmark* args(const std::vector<int64_t>& values);
+
+    XBenchmark* iterations(int64_t count);
+
+private:
+    friend class XBenchRunner;
+
+    std::string mName;
+    std::function<void(XBenchState&)> mFn;
+    std::vector<int64_t> mArgs;
+    int64_t mFixedIterations;
+};
+
+class XBenchRunner {
+public:
+    static XBenchmark* add(const std::string& name, std::function<void(XBenchState&)> fn);
+
+    static int run(int argc, char* argv[]);
+
+    /* 进程启动以来的分配次数(operator new, glibc 下也包括 malloc 系列) */
+    static int64_t allocationCount();
+
+    /* 进程的峰值常驻内存(字节) */
+    static int64_t peakRss();
+
+    static int64_t wallTimeNs();
+
+    static int64_t cpuTimeNs();
+};
+
+#define XBENCH_CONCAT_(a, b) a##b
+#define XBENCH_CONCAT(a, b) XBENCH_CONCAT_(a, b)
+#define XBENCH(fn) \
+    static XBenchmark* XBENCH_CONCAT(sXBench_, __LINE__) __attribute__((unused)) = XBenchRunner::add(#fn, fn)
+
+#endif //MIXER_XBENCH_H
@@ -0,0 +1,685 @@
+//
+// Created by Andy on 2020/7/20.
+//
+
+#include "XBench.h"
+#include "XDecoder.h"
+#include "XLog.h"
+#include "XMixer.h"
+#include "XMixKernels.h"
+#include "XPacketQueue.h"
+#include "XProbeCache.h"
+#include "XSampleQueue.h"
+#include "XTelemetry.h"
+#include "XWaveform.h"
+
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+
+/*
+ * 性能测试用的输入都是本地生成的 WAV(正弦 + 噪声), 不依赖 assets 目录:
+ *   ./mixer_bench                            运行全部测试
+ *   ./mixer_bench --filter=Mix --seconds=30  只跑宏观测试, 每路输入 30 秒
+ *   ./mixer_bench --json=base.json           保存结果, 之后用 --baseline=base.json 对比
+ */
+static int gSeconds = 10;
+static std::string gWorkDir;
+static std::vector<std::string> gGeneratedFiles;
+
+static const int SAMPLE_RATE = 44100;
+static const int CHANNELS = 2;
+
+/* 生成一路 16bit 立体声 WAV, 每路输入的频率不同, 叠加少量噪声避免编码器走捷径 */
+static std::string syntheticInput(int index, int sampleRate, int seconds) {
+    std::string path = gWorkDir + "/input_" + std::to_string(index) + "_" + std::to_string(sampleRate) + "_" +
+                       std::to_string(seconds) + ".wav";
+    struct stat st;
+    if (stat(path.data(), &st) == 0) {
+        return path;
+    }
+
+    FILE* file = fopen(path.data(), "wb");
+    if (!file) {
+        return std::string();
+    }
+
+    uint32_t nbSamples = static_cast<uint32_t>(sampleRate) * seconds;
+    uint32_t dataSize = nbSamples * CHANNELS * sizeof(int16_t);
+    uint32_t byteRate = static_cast<uint32_t>(sampleRate) * CHANNELS * sizeof(int16_t);
+    uint16_t blockAlign = CHANNELS * sizeof(int16_t);
+    uint32_t riffSize = 36 + dataSize;
+    uint32_t fmtSize = 16;
+    uint16_t pcmFormat = 1;
+    uint16_t channels = CHANNELS;
+    uint32_t rate = static_cast<uint32_t>(sampleRate);
+    uint16_t bits = 16;
+
+    fwrite("RIFF", 1, 4, file);
+    fwrite(&riffSize, 4, 1, file);
+    fwrite("WAVEfmt ", 1, 8, file);
+    fwrite(&fmtSize, 4, 1, file);
+    fwrite(&pcmFormat, 2, 1, file);
+    fwrite(&channels, 2, 1, file);
+    fwrite(&rate, 4, 1, file);
+    fwrite(&byteRate, 4, 1, file);
+    fwrite(&blockAlign, 2, 1, file);
+    fwrite(&bits, 2, 1, file);
+    fwrite("data", 1, 4, file);
+    fwrite(&dataSize, 4, 1, file);
+
+    std::mt19937 random(static_cast<unsigned>(index));
+    std::uniform_real_distribution<float> noise(-0.01f, 0.01f);
+    double phase = 0;
+    double step = 2 * M_PI * (220.0 + 55.0 * index) / sampleRate;
+    std::vector<int16_t> block(4096 * CHANNELS);
+    for (uint32_t done = 0; done < nbSamples;) {
+        uint32_t count = std::min<uint32_t>(4096, nbSamples - done);
+        for (uint32_t i = 0; i < count; ++i) {
+            float value = static_cast<float>(0.25 * std::sin(phase)) + noise(random);
+            phase += step;
+            for (int c = 0; c < CHANNELS; ++c) {
+                block[i * CHANNELS + c] = static_cast<int16_t>(value * 32767);
+            }
+        }
+        fwrite(block.data(), sizeof(int16_t), count * CHANNELS, file);
+        done += count;
+    }
+    fclose(file);
+
+    gGeneratedFiles.push_back(path);
+    return path;
+}
+
+/* 访问 XDecoder/XMixer 的内部函数, 两个类都把它声明为 friend */
+class XMixerBench {
+public:
+    static void attachSampleQueue(XDecoder& decoder, int size) {
+        decoder.mSampleQueue = rbuf_create(size);
+    }
+
+    static rbuf_t* sampleQueue(XDecoder& decoder) {
+        return decoder.mSampleQueue;
+    }
+
+    static int sampleConvert(XDecoder& decoder, AVFrame* frame) {
+        return decoder.sampleConvert(frame);
+    }
+
+    /* 和 XMixer::mix 一样打开输出并准备好编码用的 AVFrame, 返回帧缓冲, 由调用方释放 */
+    static uint8_t* openEncoder(XMixer& mixer, const std::string& path, int* ret) {
+        *ret = mixer.openOutFile(path);
+        if (*ret < 0) {
+            return nullptr;
+        }
+
+        AVCodecContext* avctx = mixer.mAudioCodecCtx.get();
+        mixer.mAudioFrame = std::make_unique<Frame>();
+        mixer.mAudioFrame->avframe->nb_samples = avctx->frame_size;
+        mixer.mAudioFrame->avframe->format = avctx->sample_fmt;
+
+        int bufferSize = av_samples_get_buffer_size(nullptr, avctx->channels, avctx->frame_size, avctx->sample_fmt, 1);
+        uint8_t* buffer = reinterpret_cast<uint8_t*>(av_malloc(bufferSize));
+        if (!buffer) {
+            *ret = AVERROR(ENOMEM);
+            return nullptr;
+        }
+        avcodec_fill_audio_frame(mixer.mAudioFrame->avframe, avctx->channels, avctx->sample_fmt, buffer, bufferSize, 1);
+        return buffer;
+    }
+
+    static int frameSize(XMixer& mixer) {
+        return mixer.mAudioCodecCtx->frame_size;
+    }
+
+    static int16_t* frameData(XMixer& mixer) {
+        return reinterpret_cast<int16_t*>(mixer.mAudioFrame->avframe->data[0]);
+    }
+
+    static int encodeAudioFrame(XMixer& mixer) {
+        return mixer.encodeAudioFrame(mixer.mAudioFrame->avframe);
+    }
+
+    static void closeEncoder(XMixer& mixer) {
+        av_write_trailer(mixer.mFormatCtx.get());
+        mixer.mAudioCodecCtx.reset();
+        avio_close(mixer.mFormatCtx->pb);
+        mixer.mFormatCtx.reset();
+    }
+};
+
+static void fillSine(float* samples, int count, float frequency) {
+    for (int i = 0; i < count; ++i) {
+        samples[i] = 0.25f * std::sin(2 * static_cast<float>(M_PI) * frequency * (i / CHANNELS) / SAMPLE_RATE);
+    }
+}
+
+// ---------------------------------------------------------------- 样本环形缓冲
+
+static void BM_RbufWrite(XBenchState& state) {
+    int chunk = static_cast<int>(state.arg());
+    rbuf_t* rbuf = rbuf_create(1 << 20);
+    std::vector<u_char> data(chunk, 0x55);
+
+    while (state.keepRunning()) {
+        if (rbuf_available(rbuf) < chunk) {
+            rbuf_clear(rbuf);
+        }
+        rbuf_write(rbuf, data.data(), chunk);
+    }
+
+    state.setBytesProcessed(state.iterations() * chunk);
+    rbuf_destroy(rbuf);
+}
+XBENCH(BM_RbufWrite)->args({1024, 4096});
+
+static void BM_RbufRead(XBenchState& state) {
+    int chunk = static_cast<int>(state.arg());
+    int size = 1 << 20;
+    rbuf_t* rbuf = rbuf_create(size);
+    std::vector<u_char> fill(size, 0x55);
+    std::vector<u_char> out(chunk);
+
+    while (state.keepRunning()) {
+        if (rbuf_used(rbuf) < chunk) {
+            rbuf_write(rbuf, fill.data(), rbuf_available(rbuf));
+        }
+        rbuf_read(rbuf, out.data(), chunk);
+    }
+
+    state.setBytesProcessed(state.iterations() * chunk);
+    rbuf_destroy(rbuf);
+}
+XBENCH(BM_RbufRead)->args({1024, 4096});
+
+// 零拷贝读: 直接访问缓冲区里的数据, 和 BM_RbufRead 的拷贝读对比
+static void BM_RbufPeekRead(XBenchState& state) {
+    int chunk = static_cast<int>(state.arg());
+    int size = 1 << 20;
+    rbuf_t* rbuf = rbuf_create(size);
+    std::vector<u_char> fill(size, 0x55);
+    volatile unsigned int sum = 0;
+
+    while (state.keepRunning()) {
+        if (rbuf_used(rbuf) < chunk) {
+            rbuf_write(rbuf, fill.data(), rbuf_available(rbuf));
+        }
+        int used = 0;
+        const u_char* data = rbuf_peek_read(rbuf, &used);
+        int n = std::min(chunk, used);
+        sum += data[0] + data[n - 1];
+        rbuf_commit_read(rbuf, n);
+    }
+
+    state.setBytesProcessed(state.iterations() * chunk);
+    state.counter("mirrored", rbuf_is_mirrored(rbuf));
+    rbuf_destroy(rbuf);
+}
+XBENCH(BM_RbufPeekRead)->args({1024, 4096});
+
+// ---------------------------------------------------------------- 包队列
+
+static std::shared_ptr<Packet> makePacket(int size) {
+    auto pkt = std::make_shared<Packet>();
+    av_new_packet(pkt->avpkt, size);
+    memset(pkt->avpkt->data, 0, size);
+    return pkt;
+}
+
+/* 单线程 put + get, 测的是加锁和包引用本身的开销 */
+static void BM_PacketQueuePutGet(XBenchState& state) {
+    XPacketQueue queue;
+    auto pkt = makePacket(512);
+
+    while (state.keepRunning()) {
+        queue.put(pkt);
+        queue.get();
+    }
+
+    state.setItemsProcessed(state.iterations());
+}
+XBENCH(BM_PacketQueuePutGet);
+
+/* 读线程生产, 解码线程消费, 和 XDecoder 的用法相同, 包含线程切换和条件变量唤醒 */
+static void BM_PacketQueueThreaded(XBenchState& state) {
+    XPacketQueue queue;
+    auto pkt = makePacket(512);
+    int64_t count = 0;
+
+    while (state.keepRunning()) {
+        ++count;
+    }
+
+    state.resumeTiming();
+    std::thread producer([&queue, &pkt, count] {
+        for (int64_t i = 0; i < count; ++i) {
+            queue.put(pkt);
+        }
+    });
+    for (int64_t i = 0; i < count; ++i) {
+        queue.get();
+    }
+    producer.join();
+    state.pauseTiming();
+
+    state.setItemsProcessed(count);
+}
+XBENCH(BM_PacketQueueThreaded);
+
+// ---------------------------------------------------------------- 重采样
+
+/* 解码器输出常见的 FLTP 转成 S16 立体声, arg 为输入采样率, 44100 时走特化的转换内核, 其它走 swr */
+static void BM_SampleConvert(XBenchState& state) {
+    int sampleRate = static_cast<int>(state.arg());
+    std::string path = syntheticInput(0, sampleRate, 1);
+
+    std::unique_ptr<XDecoder> decoder;
+    try {
+        decoder = std::make_unique<XDecoder>(path);
+    } catch (std::exception& e) {
+        state.skip(std::string("open decoder failed: ") + e.what());
+        return;
+    }
+    XMixerBench::attachSampleQueue(*decoder, 1 << 20);
+
+    Frame frame;
+    AVFrame* src = frame.avframe;
+    src->format = AV_SAMPLE_FMT_FLTP;
+    src->sample_rate = sampleRate;
+    src->channel_layout = AV_CH_LAYOUT_STEREO;
+    src->channels = CHANNELS;
+    src->nb_samples = 1152;
+    src->best_effort_timestamp = AV_NOPTS_VALUE;
+    if (av_frame_get_buffer(src, 0) < 0) {
+        state.skip("av_frame_get_buffer failed");
+        return;
+    }
+    for (int c = 0; c < CHANNELS; ++c) {
+        float* data = reinterpret_cast<float*>(src->data[c]);
+        for (int i = 0; i < src->nb_samples; ++i) {
+            data[i] = 0.25f * std::sin(2 * static_cast<float>(M_PI) * 440 * i / sampleRate);
+        }
+    }
+
+    rbuf_t* rbuf = XMixerBench::sampleQueue(*decoder);
+    while (state.keepRunning()) {
+        XMixerBench::sampleConvert(*decoder, src);
+        rbuf_clear(rbuf);
+    }
+
+    state.setItemsProcessed(state.iterations() * src->nb_samples);
+}
+XBENCH(BM_SampleConvert)->args({44100, 48000});
+
+/* FLTP 一帧 1024 个采样点转成 S16 立体声, arg 为输入声道数 */
+static void BM_ConvertKernel(XBenchState& state) {
+    int channels = static_cast<int>(state.arg());
+    int nbSamples = 1024;
+    std::vector<std::vector<float>> planes(channels, std::vector<float>(nbSamples, 0.25f));
+    std::vector<const uint8_t*> src;
+    for (auto& plane : planes) {
+        src.push_back(reinterpret_cast<const uint8_t*>(plane.data()));
+    }
+    std::vector<int16_t> dst(nbSamples * CHANNELS);
+
+    XMixKernels::ConvertFunc convert =
+            XMixKernels::findConverter(AV_SAMPLE_FMT_FLTP, av_get_default_channel_layout(channels));
+    if (!convert) {
+        state.skip("no converter");
+        return;
+    }
+    while (state.keepRunning()) {
+        convert(src.data(), dst.data(), nbSamples);
+    }
+
+    state.setItemsProcessed(state.iterations() * nbSamples);
+}
+XBENCH(BM_ConvertKernel)->args({1, 2, 6});
+
+// ---------------------------------------------------------------- 混音内核
+
+static void BM_S16ToFloat(XBenchState& state) {
+    int count = static_cast<int>(state.arg()) * CHANNELS;
+    std::vector<int16_t> src(count, 1234);
+    std::vector<float> dst(count);
+
+    while (state.keepRunning()) {
+        XMixKernels::s16ToFloat(src.data(), dst.data(), count);
+    }
+
+    state.setItemsProcessed(state.iterations() * count);
+}
+XBENCH(BM_S16ToFloat)->args({1024, 4096});
+
+/* 解码线程对每帧做的静音检查, 和 BM_S16ToFloat 对比就是跳过静音块省下的转换开销 */
+static void BM_PeakS16(XBenchState& state) {
+    int count = static_cast<int>(state.arg()) * CHANNELS;
+    std::vector<int16_t> src(count, 0);
+
+    int peak = 0;
+    while (state.keepRunning()) {
+        peak += XMixKernels::peakS16(src.data(), count);
+    }
+
+    state.counter("peak", peak);
+    state.setItemsProcessed(state.iterations() * count);
+}
+XBENCH(BM_PeakS16)->args({1024, 4096});
+
+static void BM_Accumulate(XBenchState& state) {
+    int count = static_cast<int>(state.arg()) * CHANNELS;
+    std::vector<float> src(count);
+    std::vector<float> dst(count, 0.0f);
+    fillSine(src.data(), count, 440);
+
+    while (state.keepRunning()) {
+        XMixKernels::accumulate(dst.data(), src.data(), 0.5f, count);
+    }
+
+    state.setItemsProcessed(state.iterations() * count);
+}
+XBENCH(BM_Accumulate)->args({1024, 4096});
+
+static void BM_FloatToS16(XBenchState& state) {
+    int count = static_cast<int>(state.arg()) * CHANNELS;
+    std::vector<float> src(count);
+    std::vector<int16_t> dst(count);
+    fillSine(src.data(), count, 440);
+
+    while (state.keepRunning()) {
+        XMixKernels::floatToS16(src.data(), dst.data(), count);
+    }
+
+    state.setItemsProcessed(state.iterations() * count);
+}
+XBENCH(BM_FloatToS16)->args({1024, 4096});
+
+/* 一个混音块的波形概览, 三级(256/1024/8192) */
+static void BM_Waveform(XBenchState& state) {
+    int nbSamples = static_cast<int>(state.arg());
+    std::vector<float> src(static_cast<size_t>(nbSamples) * CHANNELS);
+    fillSine(src.data(), static_cast<int>(src.size()), 440);
+
+    XWaveform waveform(SAMPLE_RATE, {256, 1024, 8192});
+    while (state.keepRunning()) {
+        waveform.process(src.data(), nbSamples);
+    }
+
+    state.setItemsProcessed(state.iterations() * nbSamples * CHANNELS);
+}
+XBENCH(BM_Waveform)->args({1024, 4096});
+
+/* 一个编码帧(1024 个采样点)的完整求和: N 路 S16 -> float 累加到总线, 再转回 S16, arg 为输入路数 */
+static void BM_MixSum(XBenchState& state) {
+    int tracks = static_cast<int>(state.arg());
+    int count = 1024 * CHANNELS;
+    std::vector<std::vector<int16_t>> inputs(tracks, std::vector<int16_t>(count, 1234));
+    std::vector<float> samples(count);
+    std::vector<float> bus(count);
+    std::vector<int16_t> out(count);
+
+    while (state.keepRunning()) {
+        std::fill(bus.begin(), bus.end(), 0.0f);
+        for (auto& input : inputs) {
+            XMixKernels::s16ToFloat(input.data(), samples.data(), count);
+            XMixKernels::accumulate(bus.data(), samples.data(), 1.0f, count);
+        }
+        XMixKernels::floatToS16(bus.data(), out.data(), count);
+    }
+
+    state.setItemsProcessed(state.iterations() * count / CHANNELS * tracks);
+}
+XBENCH(BM_MixSum)->args({1, 8, 32});
+
+// ---------------------------------------------------------------- 编码
+
+static void BM_EncodeAudioFrame(XBenchState& state) {
+    XMixer mixer;
+    int ret = 0;
+    uint8_t* buffer = XMixerBench::openEncoder(mixer, gWorkDir + "/encode.aac", &ret);
+    if (!buffer) {
+        state.skip(std::string("open encoder failed: ") + av_err2str(ret));
+        return;
+    }
+
+    int frameSize = XMixerBench::frameSize(mixer);
+    std::vector<float> samples(static_cast<size_t>(frameSize) * CHANNELS);
+    fillSine(samples.data(), static_cast<int>(samples.size()), 440);
+    XMixKernels::floatToS16(samples.data(), XMixerBench::frameData(mixer), static_cast<int>(samples.size()));
+
+    while (state.keepRunning()) {
+        if (XMixerBench::encodeAudioFrame(mixer) < 0) {
+            state.skip("encodeAudioFrame failed");
+        }
+    }
+
+    state.setItemsProcessed(state.iterations() * frameSize);
+    XMixerBench::closeEncoder(mixer);
+    av_free(buffer);
+}
+XBENCH(BM_EncodeAudioFrame);
+
+/*
+ * 单个长输入从打开到取完全部样本, arg 为解码线程数, 1 即串行解码; 输入为 48kHz, 包含重采样.
+ * WAV 的解码本身很便宜, 这里主要体现切段规划和按顺序拼接的开销, MP3/AAC 的加速比更高
+ */
+static void BM_DecodeLongInput(XBenchState& state) {
+    int threads = static_cast<int>(state.arg());
+    std::string path = syntheticInput(0, 48000, gSeconds * 6);
+    if (path.empty()) {
+        state.skip("cannot create synthetic input");
+        return;
+    }
+
+    std::vector<uint8_t> out(4096);
+    int64_t samples = 0;
+    while (state.keepRunning()) {
+        XDecoderOptions options;
+        options.decodeThreads = threads;
+        options.segmentSeconds = 5;
+        try {
+            XDecoder decoder(path, options);
+            decoder.start();
+            int ret;
+            while ((ret = decoder.getSamples(out.data(), static_cast<int>(out.size()))) > 0) {
+                samples += ret / (CHANNELS * static_cast<int>(sizeof(int16_t)));
+            }
+            decoder.stop();
+        } catch (std::exception& e) {
+            state.skip(e.what());
+            return;
+        }
+    }
+
+    state.setItemsProcessed(samples);
+}
+XBENCH(BM_DecodeLongInput)->args({1, 4});
+
+/* 构造解码器(打开输入和解码器)的耗时: arg 0 完整探测, 1 探测缓存命中, 2 只给格式提示 */
+static void BM_OpenInput(XBenchState& state) {
+    int mode = static_cast<int>(state.arg());
+    std::string path = syntheticInput(0, 48000, gSeconds);
+    if (path.empty()) {
+        state.skip("cannot create synthetic input");
+        return;
+    }
+
+    XDecoderOptions options;
+    if (mode == 1) {
+        options.probeCache = std::make_shared<XProbeCache>(gWorkDir + "/probe.cache");
+        XDecoder warmup(path, options);
+    } else if (mode == 2) {
+        options.formatHint = "wav";
+    }
+
+    while (state.keepRunning()) {
+        try {
+            XDecoder decoder(path, options);
+        } catch (std::exception& e) {
+            state.skip(e.what());
+            return;
+        }
+    }
+
+    state.setItemsProcessed(state.iterations());
+}
+XBENCH(BM_OpenInput)->args({0, 1, 2});
+
+// ---------------------------------------------------------------- 性能统计
+
+static void BM_HistogramRecord(XBenchState& state) {
+    XHistogram histogram;
+    uint64_t value = 1;
+
+    XTelemetry::setEnabled(true);
+    while (state.keepRunning()) {
+        XScopedTimer timer(histogram);
+        value = value * 6364136223846793005ULL + 1442695040888963407ULL;
+        histogram.record(value >> 40);
+    }
+    XTelemetry::setEnabled(false);
+
+    state.setItemsProcessed(state.iterations());
+}
+XBENCH(BM_HistogramRecord);
+
+// ---------------------------------------------------------------- 宏观测试
+
+/*
+ * 完整跑一次 XMixer::mix: N 路 gSeconds 秒的输入, 一半 44.1kHz 一半 48kHz(需要重采样)
+ *   realtime_x:   音频时长 / 耗时
+ *   cpu_pct_per_input: 每路输入每秒音频占用的 CPU 时间(单核百分比), 包含解码线程
+ *   allocs_per_sec: 每秒钟墙钟时间内的分配次数
+ *   peak_rss_mb:  进程峰值内存, 宏观测试按路数从小到大执行, 所以可以近似看作本项的峰值
+ */
+static void mixRender(XBenchState& state, int tracks, bool telemetry, int blockSize, int threads = 1) {
+    std::vector<std::string> inputs;
+    for (int i = 0; i < tracks; ++i) {
+        std::string path = syntheticInput(i, i % 2 == 0 ? 44100 : 48000, gSeconds);
+        if (path.empty()) {
+            state.skip("cannot create synthetic input");
+            return;
+        }
+        inputs.push_back(path);
+    }
+    std::string outPath = gWorkDir + "/mix.aac";
+
+    int64_t wallStart = XBenchRunner::wallTimeNs();
+    int64_t cpuStart = XBenchRunner::cpuTimeNs();
+    int64_t allocStart = XBenchRunner::allocationCount();
+    while (state.keepRunning()) {
+        unlink(outPath.data());
+        XMixer mixer;
+        XTelemetryOptions options;
+        options.enabled = telemetry;
+        mixer.setTelemetry(options);
+        mixer.setBlockSize(blockSize);
+        mixer.setMixThreads(threads);
+        for (auto& input : inputs) {
+            mixer.add(input);
+        }
+        mixer.mix(outPath);
+    }
+    double wall = (XBenchRunner::wallTimeNs() - wallStart) / 1e9;
+    double cpu = (XBenchRunner::cpuTimeNs() - cpuStart) / 1e9;
+    int64_t allocs = XBenchRunner::allocationCount() - allocStart;
+
+    struct stat st;
+    if (stat(outPath.data(), &st) != 0 || st.st_size == 0) {
+        state.skip("mix produced no output (encoder unavailable?)");
+        return;
+    }
+
+    double audio = static_cast<double>(gSeconds) * state.iterations();
+    state.setItemsProcessed(static_cast<int64_t>(audio * SAMPLE_RATE) * tracks);
+    state.counter("realtime_x", audio / wall);
+    state.counter("cpu_pct_per_input", cpu / tracks / audio * 100);
+    state.counter("allocs_per_sec", allocs / wall);
+    state.counter("peak_rss_mb", XBenchRunner::peakRss() / (1024.0 * 1024.0));
+}
+
+static void BM_MixRender(XBenchState& state) {
+    mixRender(state, static_cast<int>(state.arg()), false, 4096);
+}
+XBENCH(BM_MixRender)->args({1, 4, 16})->iterations(1);
+
+/* 和 BM_MixRender 对比即为统计本身的开销 */
+static void BM_MixRenderTelemetry(XBenchState& state) {
+    mixRender(state, static_cast<int>(state.arg()), true, 4096);
+}
+XBENCH(BM_MixRenderTelemetry)->args({1, 4, 16})->iterations(1);
+
+/* 8 路输入, arg 为混音块大小: 1024 即和编码帧一样大 */
+static void BM_MixBlockSize(XBenchState& state) {
+    mixRender(state, 8, false, static_cast<int>(state.arg()));
+}
+XBENCH(BM_MixBlockSize)->args({1024, 4096})->iterations(1);
+
+/* 32 路输入, arg 为混音线程数 */
+static void BM_MixThreads(XBenchState& state) {
+    mixRender(state, 32, false, 4096, static_cast<int>(state.arg()));
+}
+XBENCH(BM_MixThreads)->args({1, 4})->iterations(1);
+
+/* 同一个 1 秒的素材在时间线上放 arg 次, 只解码一次 */
+static void BM_MixPlacements(XBenchState& state) {
+    int placements = static_cast<int>(state.arg());
+    std::string input = syntheticInput(0, 44100, 1);
+    if (input.empty()) {
+        state.skip("cannot create synthetic input");
+        return;
+    }
+    std::string outPath = gWorkDir + "/placements.aac";
+
+    int64_t wallStart = XBenchRunner::wallTimeNs();
+    while (state.keepRunning()) {
+        unlink(outPath.data());
+        XMixer mixer;
+        for (int i = 0; i < placements; ++i) {
+            auto track = mixer.add(input);
+            track->offsetMs = static_cast<int64_t>(i) * gSeconds * 1000 / placements;
+        }
+        mixer.mix(outPath);
+    }
+    double wall = (XBenchRunner::wallTimeNs() - wallStart) / 1e9;
+
+    state.setItemsProcessed(static_cast<int64_t>(state.iterations()) * placements * SAMPLE_RATE);
+    state.counter("realtime_x", gSeconds * state.iterations() / wall);
+    state.counter("peak_rss_mb", XBenchRunner::peakRss() / (1024.0 * 1024.0));
+}
+XBENCH(BM_MixPlacements)->args({8, 64})->iterations(1);
+
+int main(int argc, char* argv[]) {
+    bool verbose = false;
+    for (int i = 1; i < argc; ++i) {
+        if (strncmp(argv[i], "--seconds=", 10) == 0) {
+            gSeconds = std::max(1, atoi(argv[i] + 10));
+        } else if (strcmp(argv[i], "--verbose") == 0) {
+            verbose = true;
+        }
+    }
+
+    // 混音过程中每帧都会打日志, 测试时默认只保留错误
+    XLog::setLevel(verbose ? AV_LOG_INFO : AV_LOG_ERROR);
+
+    char workDir[] = "/tmp/mixer_bench.XXXXXX";
+    if (!mkdtemp(workDir)) {
+        perror("mkdtemp");
+        return 1;
+    }
+    gWorkDir = workDir;
+
+    int ret = XBenchRunner::run(argc, argv);
+
+    for (auto& path : gGeneratedFiles) {
+        unlink(path.data());
+    }
+    unlink((gWorkDir + "/encode.aac").data());
+    unlink((gWorkDir + "/mix.aac").data());
+    rmdir(gWorkDir.data());
+    return ret;
+}
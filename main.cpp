@@ -5,22 +5,79 @@
 #include "XDecoder.h"
 #include "XMixer.h"
 #include <iostream>
+#include <cstring>
+#include <thread>
+#include <vector>
 
-std::string inFilename = "/Users/andy/Desktop/Mixer/assets/jieqian.mp3";
+std::vector<std::string> inFilenames = {"/Users/andy/Desktop/Mixer/assets/jieqian.mp3"};
 std::string outPath = "/Users/andy/Desktop/output.aac";
 
 void testMixer() {
     auto mixer = std::make_unique<XMixer>();
     try {
-        mixer->add(inFilename);
+        for (auto& filename : inFilenames) {
+            mixer->add(filename);
+        }
         mixer->mix(outPath);
     } catch (std::exception& e) {
         std::cerr << e.what() << std::endl;
     }
 }
 
+/*
+ * 本地用 ffmpeg 推一路直播流来测试, 中途可以随时 kill 掉再重新推流, 混音不会中断:
+ *   ffmpeg -re -f lavfi -i sine=frequency=440 -c:a aac -f mpegts udp://127.0.0.1:12345
+ */
+void testLiveMixer(const std::string& url, int seconds) {
+    auto mixer = std::make_unique<XMixer>();
+    try {
+        XDecoderOptions options;
+        options.live = true;
+        mixer->add(url, options);
+        for (auto& filename : inFilenames) {
+            mixer->add(filename);
+        }
+
+        std::thread timer([&mixer, seconds] {
+            std::this_thread::sleep_for(std::chrono::seconds(seconds));
+            mixer->stop();
+        });
+        mixer->mix(outPath);
+        timer.join();
+    } catch (std::exception& e) {
+        std::cerr << e.what() << std::endl;
+    }
+}
 
+
+/*
+ * 用法:
+ *   Mixer [output.aac input1 [input2 ...]]
+ *   Mixer --live [url [output.aac input1 ...]]
+ * 不带参数时使用上面的默认路径
+ */
 int main(int argc, char *argv[]) {
+    int index = 1;
+    bool live = argc > 1 && strcmp(argv[1], "--live") == 0;
+    std::string url = "udp://127.0.0.1:12345";
+    if (live) {
+        index = 2;
+        if (argc > 2) {
+            url = argv[2];
+            index = 3;
+        }
+    }
+
+    if (argc > index + 1) {
+        outPath = argv[index];
+        inFilenames.assign(argv + index + 1, argv + argc);
+    }
+
+    if (live) {
+        testLiveMixer(url, 60);
+        return 0;
+    }
+
     testMixer();
     return 0;
 }